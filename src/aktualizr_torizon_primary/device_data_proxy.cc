@@ -10,13 +10,19 @@
 
 static const uint16_t default_port = 8850;
 
+// Interval after which the device data is uploaded again even if it did not
+// change (in between, unchanged data is not uploaded).
+static const int64_t default_full_refresh_s = 3600;
+
 DeviceDataProxy::DeviceDataProxy() {
   port = default_port;
   running = false;
   enabled = false;
+  full_refresh_interval = std::chrono::seconds(default_full_refresh_s);
+  total_bytes_saved = 0;
 }
 
-void DeviceDataProxy::Initialize(const uint16_t p) {
+void DeviceDataProxy::Initialize(const uint16_t p, const int64_t refresh_s) {
   LOG_INFO << "PROXY: initializing...";
 
   enabled = true;
@@ -31,6 +37,17 @@ void DeviceDataProxy::Initialize(const uint16_t p) {
 
   LOG_INFO << "PROXY: using TCP port " << port << ".";
 
+  if (refresh_s >= 0) {
+    full_refresh_interval = std::chrono::seconds(refresh_s);
+  }
+
+  if (full_refresh_interval.count() == 0) {
+    LOG_INFO << "PROXY: skipping of unchanged device data disabled.";
+  } else {
+    LOG_INFO << "PROXY: skipping unchanged device data, full refresh every "
+             << full_refresh_interval.count() << " seconds.";
+  }
+
   if (pipe(cancel_pipe)) {
     status_message = "could not create pipe for thread synchronization";
     throw std::runtime_error(status_message);
@@ -97,18 +114,98 @@ std::string DeviceDataProxy::FindAndReplaceString(std::string str, const std::st
     return str;
 }
 
-void DeviceDataProxy::SendDeviceData(Aktualizr& aktualizr, std::string& str_data) {
+Json::Value DeviceDataProxy::MergeSnapshot(const Json::Value& json_data) {
+  if (!current_data.isObject()) {
+    current_data = Json::Value(Json::objectValue);
+  }
+  for (const auto& key : json_data.getMemberNames()) {
+    if (json_data[key].isNull()) {
+      current_data.removeMember(key);
+    } else {
+      current_data[key] = json_data[key];
+    }
+  }
+
+  // skipping disabled: always send the whole snapshot
+  if (full_refresh_interval.count() == 0) {
+    return current_data;
+  }
+
+  bool refresh_due = last_uploaded_data.isNull() ||
+                     (std::chrono::steady_clock::now() - last_full_upload >= full_refresh_interval);
+  if (!refresh_due && current_data == last_uploaded_data) {
+    total_bytes_saved += Utils::jsonToCanonicalStr(current_data).size();
+    LOG_INFO << "PROXY: device data not changed since last upload. Skipping... ("
+             << total_bytes_saved << " bytes saved in total)";
+    return Json::Value(Json::nullValue);
+  }
+
+  return current_data;
+}
+
+void DeviceDataProxy::UpdateSnapshot(const Json::Value& upload_data) {
+  last_uploaded_data = upload_data;
+  last_full_upload = std::chrono::steady_clock::now();
+}
+
+void DeviceDataProxy::SendDeviceData(std::string& str_data) {
   if (str_data.size()) {
-    LOG_INFO << "PROXY: sending device data to Torizon OTA.";
     str_data = "{" + FindAndReplaceString(str_data, "}\n{", ",") + "}";
     Json::Value json_data = Utils::parseJSON(str_data);
-    LOG_DEBUG << "PROXY: Sending Json formatted message:" << std::endl << json_data;
-    aktualizr.SendDeviceData(json_data).get();
     str_data.clear();
+
+    Json::Value upload_data = MergeSnapshot(json_data);
+    if (upload_data.isNull()) {
+      return;
+    }
+
+    LOG_INFO << "PROXY: sending device data to Torizon OTA.";
+    LOG_DEBUG << "PROXY: Sending Json formatted message:" << std::endl << upload_data;
+    try {
+      uploader(upload_data);
+    } catch (const std::exception& e) {
+      // keep the previous snapshot so that the data is sent again next time
+      LOG_ERROR << "PROXY: failed to send device data: " << e.what();
+      return;
+    }
+
+    UpdateSnapshot(upload_data);
+  }
+}
+
+bool DeviceDataProxy::Post(uint16_t port, const Json::Value& data) {
+  // the proxy expects one JSON object per message, terminated by a newline
+  const std::string message = Utils::jsonToCanonicalStr(data) + "\n";
+
+  int socketfd;
+  if ((socketfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    LOG_ERROR << "PROXY: could not create socket! [" << strerror(errno) << "]";
+    return false;
+  }
+
+  sockaddr_in sockaddr;
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  sockaddr.sin_port = htons(port);
+
+  bool success = connect(socketfd, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == 0;
+  size_t sent = 0;
+  while (success && sent < message.size()) {
+    ssize_t n = send(socketfd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    success = n > 0;
+    sent += success ? static_cast<size_t>(n) : 0;
+  }
+  if (!success) {
+    LOG_ERROR << "PROXY: could not send data to the proxy! [" << strerror(errno) << "]";
   }
+
+  close(socketfd);
+  return success;
 }
 
-void DeviceDataProxy::ReportStatus(Aktualizr& aktualizr, bool error) {
+void DeviceDataProxy::ReportStatus(bool error) {
   std::string str_data;
 
   // start proxy info
@@ -129,11 +226,16 @@ void DeviceDataProxy::ReportStatus(Aktualizr& aktualizr, bool error) {
   // end proxy info
   str_data += "}";
 
-  SendDeviceData(aktualizr, str_data);
+  SendDeviceData(str_data);
 }
 
 void DeviceDataProxy::Start(Aktualizr& aktualizr) {
-  future = std::async(std::launch::async, [this, &aktualizr](){
+  Start([&aktualizr](const Json::Value& data) { aktualizr.SendDeviceData(data).get(); });
+}
+
+void DeviceDataProxy::Start(Uploader upload) {
+  uploader = std::move(upload);
+  future = std::async(std::launch::async, [this](){
 
     LOG_INFO << "PROXY: starting thread.";
 
@@ -146,7 +248,7 @@ void DeviceDataProxy::Start(Aktualizr& aktualizr) {
     if ((listener_socket = ConnectionCreate()) == -1) {
         status_message = "could not create connection";
         LOG_ERROR << "PROXY: " << status_message << "! Exiting...";
-        ReportStatus(aktualizr, true);
+        ReportStatus(true);
         return;
     }
 
@@ -182,14 +284,14 @@ void DeviceDataProxy::Start(Aktualizr& aktualizr) {
         if (++epoll_errors >= 5) {
           status_message = "maximum epoll errors reached";
           LOG_ERROR << "PROXY: " << status_message << ". Exiting thread!";
-          ReportStatus(aktualizr, true);
+          ReportStatus(true);
           break;
         }
       }
 
       // timer expired, send data (if available) to Torizon OTA
       else if (!ret) {
-         SendDeviceData(aktualizr, device_buffered_data);
+         SendDeviceData(device_buffered_data);
          timeout = -1;
       }
 
@@ -282,13 +384,23 @@ void DeviceDataProxy::Start(Aktualizr& aktualizr) {
 }
 
 void DeviceDataProxy::Stop(Aktualizr& aktualizr, bool error) {
+  // the proxy may fail to initialize before it is started
+  if (!uploader) {
+    uploader = [&aktualizr](const Json::Value& data) { aktualizr.SendDeviceData(data).get(); };
+  }
+  Stop(error);
+}
+
+void DeviceDataProxy::Stop(bool error) {
   if (enabled == true) {
-    if (running == true) {
+    // the thread may not be listening yet: the stop command waits in the pipe
+    if (future.valid()) {
       write(cancel_pipe[1], "stop", 4);
       future.get();
     }
     if (error == false)
       status_message = "execution stopped by the user";
-    ReportStatus(aktualizr, error);
+    if (uploader)
+      ReportStatus(error);
   }
 }
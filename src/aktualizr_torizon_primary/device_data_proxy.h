@@ -1,12 +1,18 @@
 #ifndef DEVICE_DATA_PROXY_H_
 #define DEVICE_DATA_PROXY_H_
 
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <future>
 #include "libaktualizr/aktualizr.h"
 
 class DeviceDataProxy {
+ public:
+  // Uploads the device data to Torizon OTA; throws on failure.
+  using Uploader = std::function<void(const Json::Value&)>;
 
+ private:
   std::future<void> future;
   std::atomic<bool> running;
   std::atomic<bool> enabled;
@@ -14,20 +20,42 @@ class DeviceDataProxy {
   int cancel_pipe[2];
   uint16_t port;
 
+  // Torizon OTA replaces the whole custom device data on each upload, so the
+  // proxy keeps every entry received so far and always uploads all of them;
+  // an entry received with a null value is removed. Uploads are skipped when
+  // nothing changed since the last successful one, unless the full refresh
+  // interval is 0.
+  Json::Value current_data;
+  Json::Value last_uploaded_data;
+  std::chrono::steady_clock::time_point last_full_upload;
+  std::chrono::seconds full_refresh_interval;
+  std::atomic<uint64_t> total_bytes_saved;
+  Uploader uploader;
+
   int  ConnectionCreate(void);
   int  ConnectionSetNonblock(int socketfd);
-  void SendDeviceData(Aktualizr& aktualizr, std::string& str_data);
-  void ReportStatus(Aktualizr& aktualizr, bool error);
+  void SendDeviceData(std::string& str_data);
+  void ReportStatus(bool error);
+  Json::Value MergeSnapshot(const Json::Value& json_data);
+  void UpdateSnapshot(const Json::Value& upload_data);
 
   std::string FindAndReplaceString(std::string str, const std::string& from,
                                    const std::string& to);
 
  public:
   DeviceDataProxy();
-  void Initialize(const uint16_t p);
+  void Initialize(const uint16_t p, const int64_t refresh_s = -1);
   void Start(Aktualizr& aktualizr);
+  void Start(Uploader upload);
   void Stop(Aktualizr& aktualizr, bool error);
-
+  void Stop(bool error);
+  uint16_t GetPort() const { return port; }
+  // Size of the device data whose upload was skipped because it did not change.
+  uint64_t GetBytesSaved() const { return total_bytes_saved; }
+
+  // Hand data over to the proxy listening on port; it is merged into the
+  // device data and uploaded from the proxy thread.
+  static bool Post(uint16_t port, const Json::Value& data);
 };
 
 #endif  // DEVICE_DATA_PROXY_H_
@@ -0,0 +1,161 @@
+#include <gtest/gtest.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "device_data_proxy.h"
+#include "logging/logging.h"
+#include "utilities/utils.h"
+
+/*
+ * Collects the device data uploaded by a proxy.
+ */
+class UploadRecorder {
+ public:
+  DeviceDataProxy::Uploader uploader() {
+    return [this](const Json::Value& data) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      uploads_.push_back(data);
+      cv_.notify_all();
+    };
+  }
+
+  // Wait for the n-th upload (counting from 1); null if it did not happen.
+  Json::Value waitFor(size_t n) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!cv_.wait_for(lock, std::chrono::seconds(10), [this, n]() { return uploads_.size() >= n; })) {
+      return Json::Value(Json::nullValue);
+    }
+    return uploads_[n - 1];
+  }
+
+  size_t count() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return uploads_.size();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<Json::Value> uploads_;
+};
+
+static uint16_t getFreePort() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  addr.sin_port = 0;
+  socklen_t len = sizeof(addr);
+  EXPECT_EQ(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+  EXPECT_EQ(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len), 0);
+  close(fd);
+  return ntohs(addr.sin_port);
+}
+
+// Post data to the proxy, waiting for it to listen.
+static bool post(uint16_t port, const Json::Value& data) {
+  for (int i = 0; i < 100; i++) {
+    if (DeviceDataProxy::Post(port, data)) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  return false;
+}
+
+static bool waitForBytesSaved(const DeviceDataProxy& proxy, uint64_t previous) {
+  for (int i = 0; i < 200; i++) {
+    if (proxy.GetBytesSaved() > previous) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  return false;
+}
+
+/*
+ * Every upload carries all the entries received so far, unchanged device data
+ * is not uploaded again and entries posted with a null value are removed.
+ */
+TEST(DeviceDataProxy, UploadsMergedSnapshot) {
+  UploadRecorder recorder;
+  DeviceDataProxy proxy;
+  proxy.Initialize(getFreePort());
+  proxy.Start(recorder.uploader());
+
+  EXPECT_TRUE(post(proxy.GetPort(), Utils::parseJSON(R"({"a": 1, "b": "x"})")));
+  EXPECT_EQ(recorder.waitFor(1), Utils::parseJSON(R"({"a": 1, "b": "x"})"));
+
+  EXPECT_TRUE(post(proxy.GetPort(), Utils::parseJSON(R"({"b": "x"})")));
+  EXPECT_TRUE(waitForBytesSaved(proxy, 0));
+  EXPECT_EQ(recorder.count(), 1u);
+
+  EXPECT_TRUE(post(proxy.GetPort(), Utils::parseJSON(R"({"a": null, "c": [1, 2]})")));
+  EXPECT_EQ(recorder.waitFor(2), Utils::parseJSON(R"({"b": "x", "c": [1, 2]})"));
+
+  proxy.Stop(false);
+  Json::Value last = recorder.waitFor(3);
+  EXPECT_EQ(last["b"], "x");
+  EXPECT_EQ(last["proxy"]["status"], "stopped");
+}
+
+/*
+ * Unchanged data is uploaded again once the full refresh interval elapsed.
+ */
+TEST(DeviceDataProxy, FullRefresh) {
+  UploadRecorder recorder;
+  DeviceDataProxy proxy;
+  proxy.Initialize(getFreePort(), 1);
+  proxy.Start(recorder.uploader());
+
+  Json::Value data = Utils::parseJSON(R"({"a": 1})");
+  EXPECT_TRUE(post(proxy.GetPort(), data));
+  EXPECT_EQ(recorder.waitFor(1), data);
+
+  // the proxy waits for more data for longer than the refresh interval
+  EXPECT_TRUE(post(proxy.GetPort(), data));
+  EXPECT_EQ(recorder.waitFor(2), data);
+  EXPECT_EQ(proxy.GetBytesSaved(), 0u);
+
+  proxy.Stop(false);
+}
+
+/*
+ * A full refresh interval of 0 disables skipping: the whole snapshot is
+ * uploaded every time, including removals.
+ */
+TEST(DeviceDataProxy, SkippingDisabled) {
+  UploadRecorder recorder;
+  DeviceDataProxy proxy;
+  proxy.Initialize(getFreePort(), 0);
+  proxy.Start(recorder.uploader());
+
+  EXPECT_TRUE(post(proxy.GetPort(), Utils::parseJSON(R"({"a": 1, "b": 2})")));
+  EXPECT_EQ(recorder.waitFor(1), Utils::parseJSON(R"({"a": 1, "b": 2})"));
+
+  EXPECT_TRUE(post(proxy.GetPort(), Utils::parseJSON(R"({"a": null})")));
+  EXPECT_EQ(recorder.waitFor(2), Utils::parseJSON(R"({"b": 2})"));
+
+  EXPECT_TRUE(post(proxy.GetPort(), Utils::parseJSON(R"({"b": 2})")));
+  EXPECT_EQ(recorder.waitFor(3), Utils::parseJSON(R"({"b": 2})"));
+  EXPECT_EQ(proxy.GetBytesSaved(), 0u);
+
+  proxy.Stop(false);
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  logger_init();
+  logger_set_threshold(boost::log::trivial::trace);
+  return RUN_ALL_TESTS();
+}
+#endif
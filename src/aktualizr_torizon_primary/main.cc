@@ -14,7 +14,9 @@
 #include "utilities/sig_handler.h"
 #include "utilities/utils.h"
 #include "update_events.h"
+#include "update_metrics.h"
 #include "device_data_proxy.h"
+#include "updatetrace.h"
 
 namespace bpo = boost::program_options;
 
@@ -48,8 +50,14 @@ bpo::variables_map parseOptions(int argc, char **argv) {
       ("secondary-config-file", bpo::value<boost::filesystem::path>(), "Secondary ECUs configuration file")
       ("campaign-id", bpo::value<std::string>(), "ID of the campaign to act on")
       ("hwinfo-file", bpo::value<boost::filesystem::path>(), "custom hardware information JSON file")
-      ("enable-data-proxy", "enable proxy to send device data to Torizon OTA via SendDeviceData()")
-      ("data-proxy-port", bpo::value<int>(), "TCP port to be used by the proxy (defaults to 8850)");
+      ("enable-data-proxy", "enable proxy to send device data to Torizon OTA via SendDeviceData(); an entry sent with a null value is removed")
+      ("data-proxy-port", bpo::value<int>(), "TCP port to be used by the proxy (defaults to 8850)")
+      ("data-proxy-full-refresh", bpo::value<int64_t>(), "interval in seconds after which device data is uploaded even if unchanged; unchanged data is not uploaded in between (defaults to 3600, 0 disables skipping)")
+      ("metrics-port", bpo::value<int>(), "serve update cycle metrics in the Prometheus format on this local TCP port")
+      ("metrics-socket", bpo::value<boost::filesystem::path>(), "serve update cycle metrics on this unix socket instead of a TCP port")
+      ("metrics-device-data", "send the update cycle metrics as device data at the end of each cycle (requires --enable-data-proxy)")
+      ("trace-device-data", "send a timing summary of each offline container update as device data (requires --enable-data-proxy)")
+      ("update-lock-timeout", bpo::value<int>(), "time in seconds to wait for applications to release the update lock before postponing an update (defaults to 60)");
 
   // clang-format on
 
@@ -117,9 +125,29 @@ int main(int argc, char *argv[]) {
 
     conn = aktualizr.SetSignalHandler(f_cb);
 
+    events->setLockTimeout(std::chrono::seconds(
+        commandline_map.count("update-lock-timeout") != 0 ? commandline_map["update-lock-timeout"].as<int>() : 60));
+
+    // configure update cycle metrics
+    events->setPollingInterval(std::chrono::seconds(config.uptane.polling_sec));
+    MetricsServer metrics_server(events->getMetrics());
+    if (commandline_map.count("metrics-port") != 0 || commandline_map.count("metrics-socket") != 0) {
+      try {
+        if (commandline_map.count("metrics-socket") != 0) {
+          metrics_server.Start(0, commandline_map["metrics-socket"].as<boost::filesystem::path>().string());
+        } else {
+          metrics_server.Start(static_cast<uint16_t>(commandline_map["metrics-port"].as<int>()));
+        }
+      } catch (const std::exception &ex) {
+        LOG_ERROR << "METRICS: error: " << ex.what();
+      }
+    }
+
     if (!config.uptane.secondary_config_file.empty()) {
       try {
-        Primary::initSecondaries(aktualizr, config.uptane.secondary_config_file);
+        auto offline_metadata = std::make_shared<Primary::OfflineUpdateMetadata>();
+        events->setOfflineMetadata(offline_metadata);
+        Primary::initSecondaries(aktualizr, config.uptane.secondary_config_file, offline_metadata);
       } catch (const std::exception &e) {
         LOG_ERROR << "Failed to initialize Secondaries: " << e.what();
         LOG_ERROR << "Exiting...";
@@ -145,14 +173,32 @@ int main(int argc, char *argv[]) {
       if (commandline_map.count("data-proxy-port") != 0)
         port = commandline_map["data-proxy-port"].as<int>();
 
+      // setup interval between full device data uploads
+      int64_t full_refresh = -1;
+      if (commandline_map.count("data-proxy-full-refresh") != 0)
+        full_refresh = commandline_map["data-proxy-full-refresh"].as<int64_t>();
+
       // start proxy
       try {
-        proxy.Initialize(port);
+        proxy.Initialize(port, full_refresh);
         proxy.Start(aktualizr);
+        if (commandline_map.count("trace-device-data") != 0) {
+          UpdateTrace::setDataProxyPort(proxy.GetPort());
+        }
+        if (commandline_map.count("metrics-device-data") != 0) {
+          events->setPushMetrics(proxy.GetPort());
+        }
       } catch (const std::exception &ex) {
         proxy.Stop(aktualizr, true);
         LOG_ERROR << "PROXY: error: " << ex.what();
       }
+    } else {
+      if (commandline_map.count("trace-device-data") != 0) {
+        LOG_WARNING << "Parameter --trace-device-data requires --enable-data-proxy: ignoring it";
+      }
+      if (commandline_map.count("metrics-device-data") != 0) {
+        LOG_WARNING << "Parameter --metrics-device-data requires --enable-data-proxy: ignoring it";
+      }
     }
 
     // Check if Offline Updates are enabled
@@ -164,7 +210,8 @@ int main(int argc, char *argv[]) {
     }
 
     // handle unix signals
-    SigHandler::get().start([&aktualizr,&proxy]() {
+    SigHandler::get().start([&aktualizr,&proxy,events]() {
+      events->cancelLockWait();
       proxy.Stop(aktualizr, false);
       aktualizr.Abort();
       aktualizr.Shutdown();
@@ -188,6 +235,7 @@ int main(int argc, char *argv[]) {
       run_mode = commandline_map["run-mode"].as<std::string>();
     }
     // launch the first event
+    events->markCycleStart();
     if (run_mode == "campaign_check") {
       aktualizr.CampaignCheck().get();
     } else if (run_mode == "campaign_accept" || run_mode == "campaign_decline" || run_mode == "campaign_postpone") {
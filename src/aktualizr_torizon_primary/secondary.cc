@@ -1,14 +1,19 @@
 #include <boost/asio/deadline_timer.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
-#include <boost/asio/placeholders.hpp>
-#include <boost/bind/bind.hpp>
+#include <boost/asio/post.hpp>
+
+#include <sys/socket.h>
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
 #include <unordered_map>
 
 #include "ipuptanesecondary.h"
 #include "logging/logging.h"
+#include "managedsecondary.h"
 #include "secondary.h"
 #include "secondary_config.h"
 #include "utilities/utils.h"
@@ -53,21 +58,55 @@ static Secondaries createSecondaries(const SecondaryConfig& config, Aktualizr& a
   return (sec_factory_registry.at(config.type()))(config, aktualizr);
 }
 
-void initSecondaries(Aktualizr& aktualizr, const boost::filesystem::path& config_file) {
+void initSecondaries(Aktualizr& aktualizr, const boost::filesystem::path& config_file,
+                     const std::shared_ptr<OfflineUpdateMetadata>& offline_metadata) {
   if (!boost::filesystem::exists(config_file)) {
     throw std::invalid_argument("Secondary ECUs config file does not exist: " + config_file.string());
   }
 
   auto secondary_configs = SecondaryConfigParser::parse_config_file(config_file);
 
-  for (auto& config : secondary_configs) {
+  // Secondaries are independent of each other and their construction can be
+  // slow (key generation, storage, metadata checks, docker-compose), so they
+  // are created in parallel, with at most one worker per core. They are then
+  // registered in configuration order.
+  std::vector<Secondaries> created(secondary_configs.size());
+  std::vector<std::exception_ptr> errors(secondary_configs.size());
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    for (size_t i = next++; i < secondary_configs.size(); i = next++) {
+      try {
+        LOG_INFO << "Initializing " << secondary_configs[i]->type() << " Secondaries...";
+        created[i] = createSecondaries(*secondary_configs[i], aktualizr);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    }
+  };
+
+  size_t num_workers = std::min<size_t>(std::max(1U, std::thread::hardware_concurrency()), secondary_configs.size());
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < num_workers; ++i) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& w : workers) {
+    w.join();
+  }
+
+  for (size_t i = 0; i < secondary_configs.size(); ++i) {
     try {
-      LOG_INFO << "Initializing " << config->type() << " Secondaries...";
-      Secondaries secondaries = createSecondaries(*config, aktualizr);
+      if (errors[i]) {
+        std::rethrow_exception(errors[i]);
+      }
 
-      for (const auto& secondary : secondaries) {
+      for (const auto& secondary : created[i]) {
         LOG_INFO << "Adding Secondary with ECU serial: " << secondary->getSerial()
                  << " with hardware ID: " << secondary->getHwId();
+        auto managed = std::dynamic_pointer_cast<ManagedSecondary>(secondary);
+        if (managed != nullptr && offline_metadata != nullptr) {
+          managed->setOfflineMetadata(offline_metadata);
+        }
         aktualizr.AddSecondary(secondary);
       }
     } catch (const std::exception& exc) {
@@ -79,6 +118,15 @@ void initSecondaries(Aktualizr& aktualizr, const boost::filesystem::path& config
 
 class SecondaryWaiter {
  public:
+  enum class Status { kOk, kTimeout, kError };
+
+  struct Result {
+    Status status{Status::kOk};
+    std::string error;
+    // Addresses (ip:port) of the Secondaries that did not connect in time.
+    std::vector<std::string> missing;
+  };
+
   SecondaryWaiter(Aktualizr& aktualizr, uint16_t wait_port, int timeout_s, Secondaries& secondaries)
       : aktualizr_(aktualizr),
         endpoint_{boost::asio::ip::tcp::v4(), wait_port},
@@ -86,104 +134,320 @@ class SecondaryWaiter {
         timer_{io_context_},
         connected_secondaries_{secondaries} {}
 
+  ~SecondaryWaiter() {
+    for (auto& worker : workers_) {
+      if (worker.joinable()) {
+        worker.join();
+      }
+    }
+  }
+
   void addSecondary(const std::string& ip, uint16_t port, VerificationType verification_type) {
-    secondaries_to_wait_for_.insert({key(ip, port), verification_type});
+    secondaries_to_wait_for_.insert({key(ip, port), {ip, port, verification_type, nullptr}});
   }
 
-  void wait() {
-    if (secondaries_to_wait_for_.empty()) {
+  using DialHandler = std::function<void(const SecondaryInterface::Ptr&)>;
+
+  // Connect to a configured Secondary and run the Uptane handshake on that
+  // connection, both within timeout. on_done gets the Secondary, or nullptr if
+  // it could not be reached or verified. The connections of all dials run
+  // concurrently on the waiter's io_context when runDials() is called; only
+  // the (blocking) handshakes run on worker threads.
+  void dial(const std::string& ip, uint16_t port, VerificationType verification_type,
+            boost::posix_time::time_duration timeout, DialHandler on_done) {
+    auto dial = std::make_shared<Dial>(io_context_, Expected{ip, port, verification_type, nullptr}, std::move(on_done));
+    boost::system::error_code ec;
+    auto address = boost::asio::ip::address::from_string(ip, ec);
+    if (!!ec) {
+      LOG_ERROR << "Invalid address of IP Secondary: " << ip;
+      boost::asio::post(io_context_, [this, dial]() { dialHdlr(dial, nullptr); });
       return;
     }
 
+    dial->timer.expires_from_now(timeout);
+    dial->timer.async_wait([dial](const boost::system::error_code& error_code) {
+      if (dial->done || error_code == boost::asio::error::operation_aborted) {
+        return;
+      }
+      boost::system::error_code ignored;
+      if (dial->handshaking) {
+        // Unblock the handshake running on the worker thread.
+        ::shutdown(dial->expected.socket->native_handle(), SHUT_RDWR);
+      } else {
+        dial->expected.socket->close(ignored);
+      }
+    });
+    dial->expected.socket->async_connect({address, port}, [this, dial](const boost::system::error_code& error_code) {
+      if (!!error_code) {
+        dialHdlr(dial, nullptr);
+        return;
+      }
+      // asio connects in non-blocking mode, the handshake needs a blocking socket
+      boost::system::error_code ec;
+      dial->expected.socket->native_non_blocking(false, ec);
+      if (!!ec) {
+        dialHdlr(dial, nullptr);
+        return;
+      }
+      dial->handshaking = true;
+      const Expected expected = dial->expected;
+      const int fd = expected.socket->native_handle();
+      workers_.emplace_back([this, dial, expected, fd]() {
+        SecondaryInterface::Ptr secondary;
+        try {
+          secondary = Uptane::IpUptaneSecondary::create(expected.ip, expected.port, expected.verification_type, fd);
+        } catch (const std::exception& exc) {
+          LOG_WARNING << "Failed to connect to IP Secondary at " << expected.ip << ":" << expected.port << ": "
+                      << exc.what();
+        }
+        boost::asio::post(io_context_, [this, dial, secondary]() { dialHdlr(dial, secondary); });
+      });
+    });
+  }
+
+  // Run the dials until each of them has completed.
+  void runDials() {
+    io_context_.run();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+    workers_.clear();
+    io_context_.restart();
+    io_context_.poll();
+    io_context_.restart();
+  }
+
+  // Accept connections from the Secondaries until all of them are initialized
+  // or the timeout expires. Handshakes run on worker threads, so accepting
+  // continues while earlier connections are being resolved. Errors are
+  // reported in the result, never thrown.
+  Result wait() {
+    if (secondaries_to_wait_for_.empty()) {
+      return result_;
+    }
+
     timer_.expires_from_now(timeout_);
-    timer_.async_wait([&](const boost::system::error_code& error_code) {
+    timer_.async_wait([this](const boost::system::error_code& error_code) {
+      if (error_code == boost::asio::error::operation_aborted) {
+        return;
+      }
       if (!!error_code) {
         LOG_ERROR << "Wait for Secondaries has failed: " << error_code;
-        throw std::runtime_error("Error while waiting for IP Secondaries");
+        finish(Status::kError, "Error while waiting for IP Secondaries");
       } else {
-        LOG_ERROR << "Timeout while waiting for Secondaries: " << error_code;
-        throw std::runtime_error("Timeout while waiting for IP Secondaries");
+        LOG_ERROR << "Timeout while waiting for Secondaries";
+        finish(Status::kTimeout, "Timeout while waiting for IP Secondaries");
       }
-      io_context_.stop();
     });
+    LOG_INFO << "Waiting for connection from " << secondaries_to_wait_for_.size() << " Secondaries...";
     accept();
     io_context_.run();
+
+    // Handshakes still in flight were shut down by finish(); wait for their
+    // workers and run their completions so that every socket gets closed.
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+    workers_.clear();
+    io_context_.restart();
+    io_context_.poll();
+
+    return result_;
   }
 
  private:
+  struct Expected {
+    std::string ip;
+    uint16_t port;
+    VerificationType verification_type;
+    std::shared_ptr<boost::asio::ip::tcp::socket> socket;
+  };
+
+  struct Dial {
+    Dial(boost::asio::io_service& io_context, Expected e, DialHandler handler)
+        : expected{std::move(e)}, timer{io_context}, on_done{std::move(handler)} {
+      expected.socket = std::make_shared<boost::asio::ip::tcp::socket>(io_context);
+    }
+
+    Expected expected;
+    boost::asio::deadline_timer timer;
+    DialHandler on_done;
+    bool handshaking{false};
+    bool done{false};
+  };
+
+  void dialHdlr(const std::shared_ptr<Dial>& dial, const SecondaryInterface::Ptr& secondary) {
+    boost::system::error_code ec;
+    dial->done = true;
+    dial->timer.cancel(ec);
+    dial->expected.socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+    dial->expected.socket->close(ec);
+    dial->on_done(secondary);
+  }
+
   void accept() {
-    LOG_INFO << "Waiting for connection from " << secondaries_to_wait_for_.size() << " Secondaries...";
-    acceptor_.async_accept(con_socket_,
-                           boost::bind(&SecondaryWaiter::connectionHdlr, this, boost::asio::placeholders::error));
+    auto socket = std::make_shared<boost::asio::ip::tcp::socket>(io_context_);
+    acceptor_.async_accept(
+        *socket, [this, socket](const boost::system::error_code& error_code) { connectionHdlr(socket, error_code); });
   }
 
-  void connectionHdlr(const boost::system::error_code& error_code) {
-    if (!error_code) {
-      auto sec_ip = con_socket_.remote_endpoint().address().to_string();
-      auto sec_port = con_socket_.remote_endpoint().port();
-      auto it = secondaries_to_wait_for_.find(key(sec_ip, sec_port));
-      if (it == secondaries_to_wait_for_.end()) {
-        LOG_INFO << "Unexpected connection from a Secondary: (" << sec_ip << ":" << sec_port << ")";
-        return;
+  void connectionHdlr(const std::shared_ptr<boost::asio::ip::tcp::socket>& socket,
+                      const boost::system::error_code& error_code) {
+    if (done_ || error_code == boost::asio::error::operation_aborted) {
+      return;
+    }
+    if (!!error_code) {
+      LOG_ERROR << "Failed to accept connection from a Secondary: " << error_code.message();
+      accept();
+      return;
+    }
+
+    boost::system::error_code ec;
+    auto remote = socket->remote_endpoint(ec);
+    auto it = !ec ? secondaries_to_wait_for_.find(key(remote.address().to_string(), remote.port()))
+                  : secondaries_to_wait_for_.end();
+    if (it == secondaries_to_wait_for_.end()) {
+      if (!ec) {
+        LOG_INFO << "Unexpected connection from a Secondary: (" << remote.address().to_string() << ":"
+                 << remote.port() << ")";
       }
+      socket->close(ec);
+      accept();
+      return;
+    }
+
+    Expected expected = it->second;
+    expected.socket = socket;
+    secondaries_to_wait_for_.erase(it);
+    in_flight_.insert({key(expected.ip, expected.port), expected});
+    LOG_INFO << "Accepted connection from a Secondary: (" << expected.ip << ":" << expected.port << ")";
 
-      LOG_INFO << "Accepted connection from a Secondary: (" << sec_ip << ":" << sec_port << ")";
+    const int fd = socket->native_handle();
+    workers_.emplace_back([this, expected, fd]() {
+      SecondaryInterface::Ptr secondary;
+      std::string error;
       try {
-        auto secondary = Uptane::IpUptaneSecondary::create(sec_ip, sec_port, it->second, con_socket_.native_handle());
-        if (secondary) {
-          connected_secondaries_.push_back(secondary);
-          // set ip/port in the db so that we can match everything later
-          Json::Value d;
-          d["ip"] = sec_ip;
-          d["port"] = sec_port;
-          d["verification_type"] = Uptane::VerificationTypeToString(it->second);
-          aktualizr_.SetSecondaryData(secondary->getSerial(), Utils::jsonToCanonicalStr(d));
-        }
+        secondary = Uptane::IpUptaneSecondary::create(expected.ip, expected.port, expected.verification_type, fd);
       } catch (const std::exception& exc) {
-        LOG_ERROR << "Failed to initialize a Secondary: " << exc.what();
+        error = exc.what();
       }
-      con_socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both);
-      con_socket_.close();
+      boost::asio::post(io_context_, [this, expected, secondary, error]() {
+        handshakeHdlr(key(expected.ip, expected.port), secondary, error);
+      });
+    });
 
-      secondaries_to_wait_for_.erase(it);
-      if (!secondaries_to_wait_for_.empty()) {
-        accept();
-      } else {
-        io_context_.stop();
-      }
+    accept();
+  }
+
+  void handshakeHdlr(const std::string& sec_key, const SecondaryInterface::Ptr& secondary, const std::string& error) {
+    auto it = in_flight_.find(sec_key);
+    if (it == in_flight_.end()) {
+      return;
+    }
+    Expected expected = it->second;
+    in_flight_.erase(it);
+
+    boost::system::error_code ec;
+    expected.socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+    expected.socket->close(ec);
+    expected.socket.reset();
+
+    if (done_) {
+      return;
+    }
+
+    if (secondary) {
+      connected_secondaries_.push_back(secondary);
+      // set ip/port in the db so that we can match everything later
+      Json::Value d;
+      d["ip"] = expected.ip;
+      d["port"] = expected.port;
+      d["verification_type"] = Uptane::VerificationTypeToString(expected.verification_type);
+      aktualizr_.SetSecondaryData(secondary->getSerial(), Utils::jsonToCanonicalStr(d));
     } else {
-      LOG_ERROR << "Failed to accept connection from a Secondary";
+      // Let the Secondary retry until the timeout expires.
+      LOG_ERROR << "Failed to initialize a Secondary (" << expected.ip << ":" << expected.port
+                << "): " << (error.empty() ? "handshake failed" : error);
+      secondaries_to_wait_for_.insert({sec_key, expected});
+    }
+
+    if (secondaries_to_wait_for_.empty() && in_flight_.empty()) {
+      finish(Status::kOk, "");
+    } else if (secondary) {
+      LOG_INFO << "Waiting for connection from " << secondaries_to_wait_for_.size() + in_flight_.size()
+               << " Secondaries...";
     }
   }
 
-  static std::string key(const std::string& ip, uint16_t port) { return (ip + std::to_string(port)); }
+  void finish(Status status, const std::string& error) {
+    done_ = true;
+    result_.status = status;
+    result_.error = error;
+    for (const auto& sec : secondaries_to_wait_for_) {
+      result_.missing.push_back(sec.second.ip + ":" + std::to_string(sec.second.port));
+    }
+    for (const auto& sec : in_flight_) {
+      result_.missing.push_back(sec.second.ip + ":" + std::to_string(sec.second.port));
+      // Unblock the handshake running on the worker thread.
+      ::shutdown(sec.second.socket->native_handle(), SHUT_RDWR);
+    }
+
+    boost::system::error_code ec;
+    timer_.cancel(ec);
+    acceptor_.close(ec);
+    io_context_.stop();
+  }
+
+  static std::string key(const std::string& ip, uint16_t port) { return (ip + ":" + std::to_string(port)); }
 
   Aktualizr& aktualizr_;
 
   boost::asio::io_service io_context_;
   boost::asio::ip::tcp::endpoint endpoint_;
   boost::asio::ip::tcp::acceptor acceptor_{io_context_, endpoint_};
-  boost::asio::ip::tcp::socket con_socket_{io_context_};
   boost::posix_time::seconds timeout_;
   boost::asio::deadline_timer timer_;
 
   Secondaries& connected_secondaries_;
-  std::unordered_map<std::string, VerificationType> secondaries_to_wait_for_;
+  std::unordered_map<std::string, Expected> secondaries_to_wait_for_;
+  std::unordered_map<std::string, Expected> in_flight_;
+  std::vector<std::thread> workers_;
+  bool done_{false};
+  Result result_;
 };
 
+// Connection to a configured IP Secondary.
+struct IPSecondaryConnection {
+  IPSecondaryConfig cfg;
+  bool is_new;
+  SecondaryInfo stored;
+  SecondaryInterface::Ptr secondary;
+};
+
+// Deadline for connecting to and verifying the configured IP Secondaries. The
+// connection attempts made by libaktualizr are only bounded by the kernel's
+// (minutes long) connect timeout, so the Primary connects to them itself.
+static const boost::posix_time::seconds kDialTimeout{5};
+
 // Four options for each Secondary:
 // 1. Secondary is configured and stored: nothing to do.
 // 2. Secondary is configured but not stored: it must be new. Try to connect to get information and store it. This will
 // cause re-registration.
 // 3. Same as 2 but cannot connect: abort.
 // 4. Secondary is stored but not configured: it must have been removed. Skip it. This will cause re-registration.
+//
+// All configured Secondaries are connected to and verified concurrently;
+// those that cannot be reached within kDialTimeout are waited for (new ones)
+// or used with their stored data (known ones). The wait port is already listening meanwhile
+// (SecondaryWaiter binds it on construction), so Secondaries connecting to the
+// Primary during that time are queued and accepted by the waiter afterwards.
 static Secondaries createIPSecondaries(const IPSecondariesConfig& config, Aktualizr& aktualizr) {
   Secondaries result;
   SecondaryWaiter sec_waiter{aktualizr, config.secondaries_wait_port, config.secondaries_timeout_s, result};
   auto secondaries_info = aktualizr.GetSecondaries();
+  std::vector<IPSecondaryConnection> connections;
 
   for (const auto& cfg : config.secondaries_cfg) {
-    SecondaryInterface::Ptr secondary;
     const SecondaryInfo* info = nullptr;
 
     // Try to match the configured Secondaries to stored Secondaries.
@@ -208,39 +472,78 @@ static Secondaries createIPSecondaries(const IPSecondariesConfig& config, Aktual
       LOG_INFO << "Migrated a single IP Secondary to new storage format.";
     } else if (f == secondaries_info.cend()) {
       // Secondary was not found in storage; it must be new.
-      secondary = Uptane::IpUptaneSecondary::connectAndCreate(cfg.ip, cfg.port, cfg.verification_type);
-      if (secondary == nullptr) {
-        LOG_DEBUG << "Could not connect to IP Secondary at " << cfg.ip << ":" << cfg.port
-                  << "; now trying to wait for it.";
-        sec_waiter.addSecondary(cfg.ip, cfg.port, cfg.verification_type);
-      } else {
-        result.push_back(secondary);
-        // set ip/port in the db so that we can match everything later
-        Json::Value d;
-        d["ip"] = cfg.ip;
-        d["port"] = cfg.port;
-        d["verification_type"] = Uptane::VerificationTypeToString(cfg.verification_type);
-        aktualizr.SetSecondaryData(secondary->getSerial(), Utils::jsonToCanonicalStr(d));
-      }
+      connections.push_back({cfg, true, SecondaryInfo()});
       continue;
     } else {
       // The configured Secondary was found in storage.
       info = &(*f);
     }
 
+    connections.push_back({cfg, false, *info});
+  }
+
+  const auto timeout = std::min(kDialTimeout, boost::posix_time::seconds(config.secondaries_timeout_s));
+  for (auto& connection : connections) {
+    const auto& cfg = connection.cfg;
+    sec_waiter.dial(cfg.ip, cfg.port, cfg.verification_type, timeout,
+                    [&connection](const SecondaryInterface::Ptr& secondary) { connection.secondary = secondary; });
+  }
+  sec_waiter.runDials();
+
+  // Collect the results in configuration order.
+  for (auto& connection : connections) {
+    const auto& cfg = connection.cfg;
+    SecondaryInterface::Ptr secondary = connection.secondary;
     if (secondary == nullptr) {
-      secondary = Uptane::IpUptaneSecondary::connectAndCheck(cfg.ip, cfg.port, cfg.verification_type, info->serial,
-                                                             info->hw_id, info->pub_key);
+      LOG_WARNING << "Could not connect to and verify IP Secondary at " << cfg.ip << ":" << cfg.port << " within "
+                  << timeout.total_seconds() << " seconds";
+    }
+
+    if (connection.is_new) {
       if (secondary == nullptr) {
-        throw std::runtime_error("Unable to connect to or verify IP Secondary at " + cfg.ip + ":" +
-                                 std::to_string(cfg.port));
+        LOG_DEBUG << "Could not connect to IP Secondary at " << cfg.ip << ":" << cfg.port
+                  << "; now trying to wait for it.";
+        sec_waiter.addSecondary(cfg.ip, cfg.port, cfg.verification_type);
+        continue;
+      }
+      // set ip/port in the db so that we can match everything later
+      Json::Value d;
+      d["ip"] = cfg.ip;
+      d["port"] = cfg.port;
+      d["verification_type"] = Uptane::VerificationTypeToString(cfg.verification_type);
+      aktualizr.SetSecondaryData(secondary->getSerial(), Utils::jsonToCanonicalStr(d));
+    } else if (secondary == nullptr) {
+      // Same as connectAndCheck() when it cannot connect: keep using the
+      // stored registration data.
+      const auto& stored = connection.stored;
+      secondary = std::make_shared<Uptane::IpUptaneSecondary>(cfg.ip, cfg.port, cfg.verification_type, stored.serial,
+                                                              stored.hw_id, stored.pub_key);
+    } else {
+      // Same as connectAndCheck(): a Secondary that changed is used as it is
+      // now, which causes re-registration.
+      const auto& stored = connection.stored;
+      const bool matches = secondary->getSerial() == stored.serial && secondary->getHwId() == stored.hw_id &&
+                           secondary->getPublicKey() == stored.pub_key;
+      if (!matches) {
+        LOG_WARNING << "IP Secondary at " << cfg.ip << ":" << cfg.port << " does not match the stored serial "
+                    << stored.serial << ", hardware ID " << stored.hw_id << " or public key";
       }
     }
 
     result.push_back(secondary);
   }
 
-  sec_waiter.wait();
+  auto wait_result = sec_waiter.wait();
+  if (wait_result.status != SecondaryWaiter::Status::kOk) {
+    std::string missing;
+    for (const auto& addr : wait_result.missing) {
+      missing += (missing.empty() ? "" : ", ") + addr;
+    }
+    if (config.wait_policy == IPSecondariesConfig::WaitPolicy::kAll) {
+      throw std::runtime_error(wait_result.error + " (missing: " + missing + ")");
+    }
+    LOG_WARNING << wait_result.error << "; proceeding without the IP Secondaries at " << missing;
+  }
 
   return result;
 }
@@ -1,13 +1,20 @@
 #ifndef SECONDARY_H_
 #define SECONDARY_H_
 
+#include <memory>
+
 #include <boost/filesystem.hpp>
 
 #include "libaktualizr/aktualizr.h"
 
 namespace Primary {
 
-void initSecondaries(Aktualizr& aktualizr, const boost::filesystem::path& config_file);
+class OfflineUpdateMetadata;
+
+// Create the Secondaries listed in `config_file` and add them to aktualizr.
+// The managed Secondaries share `offline_metadata` during offline updates.
+void initSecondaries(Aktualizr& aktualizr, const boost::filesystem::path& config_file,
+                     const std::shared_ptr<OfflineUpdateMetadata>& offline_metadata = nullptr);
 
 }  // namespace Primary
 
@@ -36,6 +36,7 @@ config file example
   "IP": {
                 "secondaries_wait_port": 9040,
                 "secondaries_wait_timeout": 20,
+                "secondaries_wait_policy": "partial",
                 "secondaries": [
                         {"addr": "127.0.0.1:9031", "verification_type": "Full"}
                         {"addr": "127.0.0.1:9032", "verification_type": "Tuf"}
@@ -97,6 +98,15 @@ void JsonConfigParser::createIPSecondariesCfg(Configs& configs, const Json::Valu
       json_ip_sec_cfg[IPSecondariesConfig::TimeoutField].asInt());
   auto secondaries = json_ip_sec_cfg[IPSecondariesConfig::SecondariesField];
 
+  if (json_ip_sec_cfg.isMember(IPSecondariesConfig::WaitPolicyField)) {
+    auto policy = json_ip_sec_cfg[IPSecondariesConfig::WaitPolicyField].asString();
+    if (policy == "partial") {
+      resultant_cfg->wait_policy = IPSecondariesConfig::WaitPolicy::kPartial;
+    } else if (policy != "all") {
+      throw std::invalid_argument("Invalid " + std::string(IPSecondariesConfig::WaitPolicyField) + ": " + policy);
+    }
+  }
+
   LOG_INFO << "Found IP secondaries config: " << *resultant_cfg;
 
   for (const auto& secondary : secondaries) {
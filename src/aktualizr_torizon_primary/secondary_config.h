@@ -39,17 +39,24 @@ class IPSecondariesConfig : public SecondaryConfig {
   static constexpr const char* const PortField{"secondaries_wait_port"};
   static constexpr const char* const TimeoutField{"secondaries_wait_timeout"};
   static constexpr const char* const SecondariesField{"secondaries"};
+  static constexpr const char* const WaitPolicyField{"secondaries_wait_policy"};
+
+  // What to do when some Secondaries did not connect before the timeout:
+  // abort (kAll, the default) or proceed with the ones that did (kPartial).
+  enum class WaitPolicy { kAll, kPartial };
 
   IPSecondariesConfig(const uint16_t wait_port, const int timeout_s)
       : SecondaryConfig(Type), secondaries_wait_port{wait_port}, secondaries_timeout_s{timeout_s} {}
 
   friend std::ostream& operator<<(std::ostream& os, const IPSecondariesConfig& cfg) {
-    os << "(wait_port: " << cfg.secondaries_wait_port << " timeout_s: " << cfg.secondaries_timeout_s << ")";
+    os << "(wait_port: " << cfg.secondaries_wait_port << " timeout_s: " << cfg.secondaries_timeout_s
+       << " wait_policy: " << (cfg.wait_policy == WaitPolicy::kPartial ? "partial" : "all") << ")";
     return os;
   }
 
   const uint16_t secondaries_wait_port;
   const int secondaries_timeout_s;
+  WaitPolicy wait_policy{WaitPolicy::kAll};
   std::vector<IPSecondaryConfig> secondaries_cfg;
 };
 
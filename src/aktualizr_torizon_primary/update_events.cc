@@ -8,74 +8,11 @@
 #include <iostream>
 #include <string>
 #include "update_events.h"
+#include "device_data_proxy.h"
 #include "logging/logging.h"
 
-// Map event into lambda returning extra information to log as part of processEvent():
-static const std::map<std::string, std::function<std::string(const event::BaseEvent *)> > extra_logs_map = {
-  {
-    "PutManifestComplete",
-    [](const event::BaseEvent *base) -> std::string {
-      const auto *event_ptr = dynamic_cast<const event::PutManifestComplete *>(base);
-      return event_ptr->success ? "Result - Success" : "Result - Error";
-    }
-  },
-  {
-    "UpdateCheckComplete",
-    [](const event::BaseEvent *base) -> std::string {
-      const auto *event_ptr = dynamic_cast<const event::UpdateCheckComplete *>(base);
-      if (event_ptr->result.status == result::UpdateStatus::kNoUpdatesAvailable)
-        return "Result - No updates available";
-      else if (event_ptr->result.status == result::UpdateStatus::kUpdatesAvailable)
-        return "Result - Updates available";
-      else if (event_ptr->result.status == result::UpdateStatus::kError)
-        return "Result - Error";
-      return "Result - Unknown";
-    }
-  },
-  {
-    "DownloadProgressReport",
-    [](const event::BaseEvent *base) -> std::string {
-      const auto *event_ptr = dynamic_cast<const event::DownloadProgressReport *>(base);
-      return "Progress at " + std::to_string(event_ptr->progress) + "%";
-    }
-  },
-  {
-    "DownloadTargetComplete",
-    [](const event::BaseEvent *base) -> std::string {
-      const auto *event_ptr = dynamic_cast<const event::DownloadTargetComplete *>(base);
-      return event_ptr->success ? "Result - Success" : "Result - Error";
-    }
-  },
-  {
-    "AllDownloadsComplete",
-    [](const event::BaseEvent *base) -> std::string {
-      const auto *event_ptr = dynamic_cast<const event::AllDownloadsComplete *>(base);
-      if (event_ptr->result.status == result::DownloadStatus::kSuccess)
-        return "Result - Success";
-      else if (event_ptr->result.status == result::DownloadStatus::kPartialSuccess)
-        return "Result - Partial success";
-      else if (event_ptr->result.status == result::DownloadStatus::kNothingToDownload)
-        return "Result - Nothing to download";
-      else if (event_ptr->result.status == result::DownloadStatus::kError)
-        return "Result - Error";
-      return "Result - Unknown";
-    }
-  },
-  {
-    "InstallTargetComplete",
-    [](const event::BaseEvent *base) -> std::string {
-      const auto *event_ptr = dynamic_cast<const event::InstallTargetComplete *>(base);
-      return event_ptr->success ? "Result - Success" : "Result - Error";
-    }
-  },
-  {
-    "AllInstallsComplete",
-    [](const event::BaseEvent *base) -> std::string {
-      const auto *event_ptr = dynamic_cast<const event::AllInstallsComplete *>(base);
-      return "Result - " + event_ptr->result.dev_report.result_code.ToString();
-    }
-  },
-};
+// Download progress is logged in steps of this many percent per target.
+static const unsigned int progress_log_step = 10;
 
 UpdateEvents* UpdateEvents::instance = nullptr;
 
@@ -88,34 +25,176 @@ UpdateEvents *UpdateEvents::getInstance(Aktualizr *a) {
 void UpdateEvents::processAllInstallsComplete() {
   LOG_INFO << "Update install completed. Releasing the update lock...";
   lock.free();
+  if (offline_metadata) {
+    offline_metadata->reset();
+  }
 }
 
 void UpdateEvents::processUpdateCheckComplete(const result::UpdateStatus status) {
   lock.free();
+  if (offline_metadata) {
+    offline_metadata->reset();
+  }
   if (status == result::UpdateStatus::kUpdatesAvailable) {
     LOG_INFO << "Update available. Acquiring the update lock...";
-    if (lock.try_get() == false)
+    /* Wait (bounded) for the applications holding the lock to release it
+     * instead of skipping the update until the next check interval. The
+     * wait is cut short on shutdown (see cancelLockWait()).
+     */
+    if (lock.get(lock_timeout) == false)
       aktualizr->DisableUpdates(true);
     else
       aktualizr->DisableUpdates(false);
   }
 }
 
-void UpdateEvents::processEvent(const std::shared_ptr<event::BaseEvent> &event) {
-  auto extra = extra_logs_map.find(event->variant);
-  if (extra == extra_logs_map.end()) {
-    LOG_INFO << "Event: " << event->variant;
-  } else {
-    // Display extra information for some events.
-    LOG_INFO << "Event: " << event->variant << ", " << extra->second(event.get());
+void UpdateEvents::observe(const std::string &phase, Clock::time_point &start, const std::string &label_name,
+                           const std::string &label_value) {
+  if (start == Clock::time_point()) {
+    return;
+  }
+  Clock::time_point now = Clock::now();
+  if (now >= start) {
+    metrics.observe(phase, std::chrono::duration<double>(now - start).count(), label_name, label_value);
+  }
+  start = Clock::time_point();
+}
+
+void UpdateEvents::endCycle() {
+  // In daemon mode the next update check starts after the polling interval.
+  if (polling_interval.count() > 0) {
+    check_start = Clock::now() + polling_interval;
+  }
+
+  if (metrics_proxy_port != 0) {
+    Json::Value data;
+    data["update_metrics"] = metrics.toJson();
+    DeviceDataProxy::Post(metrics_proxy_port, data);
   }
+}
 
+void UpdateEvents::processDownloadProgressReport(const event::DownloadProgressReport &event) {
+  // Progress reports arrive at a high rate: only log when a new step is
+  // reached (or a new target starts downloading).
+  const std::string &target = event.target.filename();
+  unsigned int step = event.progress / progress_log_step;
+  if (target == progress_target && step <= progress_logged / progress_log_step && event.progress < 100) {
+    return;
+  }
+  if (target == progress_target && event.progress == progress_logged) {
+    return;
+  }
+
+  progress_target = target;
+  progress_logged = event.progress;
+  LOG_INFO << "Event: " << event.variant << ", Progress at " << event.progress << "%";
+}
+
+const UpdateEvents::HandlerTable &UpdateEvents::handlers() {
+  // Table built once; dispatching is a lookup on the event's dynamic type.
+  static const HandlerTable table = {
+    on<event::PutManifestComplete>([](UpdateEvents *e, const event::PutManifestComplete &ev) {
+      LOG_INFO << "Event: " << ev.variant << ", " << (ev.success ? "Result - Success" : "Result - Error");
+      e->metrics.countResult("manifest_put", ev.success);
+      if (e->manifest_start != Clock::time_point()) {
+        e->observe("manifest_put", e->manifest_start);
+        e->endCycle();
+      }
+    }),
+    on<event::UpdateCheckComplete>([](UpdateEvents *e, const event::UpdateCheckComplete &ev) {
+      std::string result = "Result - Unknown";
+      if (ev.result.status == result::UpdateStatus::kNoUpdatesAvailable)
+        result = "Result - No updates available";
+      else if (ev.result.status == result::UpdateStatus::kUpdatesAvailable)
+        result = "Result - Updates available";
+      else if (ev.result.status == result::UpdateStatus::kError)
+        result = "Result - Error";
+      LOG_INFO << "Event: " << ev.variant << ", " << result;
+      if (e->check_start <= Clock::now()) {
+        e->observe("update_check", e->check_start);
+      } else {
+        e->check_start = Clock::time_point();
+      }
+      e->metrics.countResult("update_check", ev.result.status != result::UpdateStatus::kError);
+      e->processUpdateCheckComplete(ev.result.status);
+      if (ev.result.status == result::UpdateStatus::kUpdatesAvailable) {
+        e->downloads_start = e->download_target_start = Clock::now();
+      } else {
+        e->endCycle();
+      }
+    }),
+    on<event::DownloadProgressReport>([](UpdateEvents *e, const event::DownloadProgressReport &ev) {
+      e->processDownloadProgressReport(ev);
+    }),
+    on<event::DownloadTargetComplete>([](UpdateEvents *e, const event::DownloadTargetComplete &ev) {
+      LOG_INFO << "Event: " << ev.variant << ", " << (ev.success ? "Result - Success" : "Result - Error");
+      e->progress_target.clear();
+      e->observe("download_target", e->download_target_start, "target", ev.update.filename());
+      e->metrics.countResult("download_target", ev.success);
+      // targets are downloaded one after the other
+      e->download_target_start = Clock::now();
+    }),
+    on<event::AllDownloadsComplete>([](UpdateEvents *e, const event::AllDownloadsComplete &ev) {
+      std::string result = "Result - Unknown";
+      if (ev.result.status == result::DownloadStatus::kSuccess)
+        result = "Result - Success";
+      else if (ev.result.status == result::DownloadStatus::kPartialSuccess)
+        result = "Result - Partial success";
+      else if (ev.result.status == result::DownloadStatus::kNothingToDownload)
+        result = "Result - Nothing to download";
+      else if (ev.result.status == result::DownloadStatus::kError)
+        result = "Result - Error";
+      LOG_INFO << "Event: " << ev.variant << ", " << result;
+      e->observe("download", e->downloads_start);
+      e->download_target_start = Clock::time_point();
+      e->metrics.countResult("download", ev.result.status != result::DownloadStatus::kError);
+      if (ev.result.status != result::DownloadStatus::kSuccess) {
+        e->endCycle();
+      }
+    }),
+    on<event::InstallStarted>([](UpdateEvents *e, const event::InstallStarted &ev) {
+      LOG_INFO << "Event: " << ev.variant;
+      Clock::time_point now = Clock::now();
+      if (e->install_start.empty()) {
+        e->installs_start = now;
+      }
+      e->install_start[ev.serial.ToString()] = now;
+    }),
+    on<event::InstallTargetComplete>([](UpdateEvents *e, const event::InstallTargetComplete &ev) {
+      LOG_INFO << "Event: " << ev.variant << ", " << (ev.success ? "Result - Success" : "Result - Error");
+      auto start = e->install_start.find(ev.serial.ToString());
+      if (start != e->install_start.end()) {
+        e->observe("install_ecu", start->second, "ecu", ev.serial.ToString());
+      }
+      e->metrics.countResult("install_ecu", ev.success);
+    }),
+    on<event::AllInstallsComplete>([](UpdateEvents *e, const event::AllInstallsComplete &ev) {
+      LOG_INFO << "Event: " << ev.variant << ", Result - " << ev.result.dev_report.result_code.ToString();
+      e->observe("install", e->installs_start);
+      e->install_start.clear();
+      e->metrics.countResult("install", ev.result.dev_report.success);
+      // the manifest with the installation results is sent next
+      e->manifest_start = Clock::now();
+      e->processAllInstallsComplete();
+    }),
+  };
+  return table;
+}
+
+void UpdateEvents::processEvent(const std::shared_ptr<event::BaseEvent> &event) {
+  const event::BaseEvent &base = *event;
+  const HandlerTable &table = handlers();
   UpdateEvents *e = getInstance(0);
 
-  if (event->variant == event::UpdateCheckComplete::TypeName) {
-    const auto *update_event = dynamic_cast<event::UpdateCheckComplete *>(event.get());
-    e->processUpdateCheckComplete(update_event->result.status);
-  } else if (event->variant == event::AllInstallsComplete::TypeName) {
-    e->processAllInstallsComplete();
+  if (typeid(base) != typeid(event::DownloadProgressReport)) {
+    e->metrics.countEvent(event->variant);
   }
+
+  auto handler = table.find(std::type_index(typeid(base)));
+  if (handler == table.end()) {
+    LOG_INFO << "Event: " << event->variant;
+    return;
+  }
+
+  handler->second(e, base);
 }
@@ -1,25 +1,87 @@
 #ifndef UPDATE_EVENTS_H_
 #define UPDATE_EVENTS_H_
 
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <typeindex>
+#include <unordered_map>
+
 #include "libaktualizr/aktualizr.h"
+#include "offlinemetadatasnapshot.h"
 #include "update_lock.h"
+#include "update_metrics.h"
 
 class UpdateEvents {
 
+  // Event handlers indexed by the dynamic type of the event.
+  using EventHandler = std::function<void(UpdateEvents *, const event::BaseEvent &)>;
+  using HandlerTable = std::unordered_map<std::type_index, EventHandler>;
+  using Clock = std::chrono::steady_clock;
+
   boost::filesystem::path update_lock_file = "/run/lock/aktualizr-lock";
 
-  UpdateEvents(Aktualizr *a) : aktualizr(a), lock(update_lock_file) {}
+  UpdateEvents(Aktualizr *a)
+      : aktualizr(a), lock(update_lock_file), lock_timeout(0), progress_logged(0), polling_interval(0) {}
 
   static UpdateEvents *instance;
   Aktualizr *aktualizr;
   UpdateLock lock;
+  std::chrono::milliseconds lock_timeout;
+
+  // Last download progress logged, to avoid flooding the journal.
+  std::string progress_target;
+  unsigned int progress_logged;
+
+  // Timing of the update cycle phases. libaktualizr only reports the end of
+  // an update check, so its start is either marked explicitly or estimated
+  // from the end of the previous cycle plus the polling interval.
+  UpdateMetrics metrics;
+  uint16_t metrics_proxy_port{0};
+  std::chrono::seconds polling_interval;
+  Clock::time_point check_start;
+  Clock::time_point downloads_start;
+  Clock::time_point download_target_start;
+  Clock::time_point installs_start;
+  Clock::time_point manifest_start;
+  std::map<std::string, Clock::time_point> install_start;
+
+  // Offline update metadata shared by the managed Secondaries; it only lives
+  // for one update.
+  std::shared_ptr<Primary::OfflineUpdateMetadata> offline_metadata;
+
+  void observe(const std::string &phase, Clock::time_point &start, const std::string &label_name = "",
+               const std::string &label_value = "");
+  void endCycle();
 
   void processUpdateCheckComplete(const result::UpdateStatus status);
   void processAllInstallsComplete();
+  void processDownloadProgressReport(const event::DownloadProgressReport &event);
+
+  // Register a handler for events of type T.
+  template <class T>
+  static HandlerTable::value_type on(std::function<void(UpdateEvents *, const T &)> handler) {
+    return {std::type_index(typeid(T)),
+            [handler](UpdateEvents *e, const event::BaseEvent &base) { handler(e, static_cast<const T &>(base)); }};
+  }
+  static const HandlerTable &handlers();
 
  public:
   static UpdateEvents *getInstance(Aktualizr *a);
   static void processEvent(const std::shared_ptr<event::BaseEvent> &event);
+
+  const UpdateMetrics &getMetrics() const { return metrics; }
+  void setLockTimeout(std::chrono::milliseconds timeout) { lock_timeout = timeout; }
+  // Stop waiting for the update lock (on shutdown); the pending update is
+  // postponed.
+  void cancelLockWait() { lock.cancel(); }
+  void setPollingInterval(std::chrono::seconds interval) { polling_interval = interval; }
+  // Send the metrics at the end of each cycle to the device data proxy
+  // listening on this port (which merges them into the device data).
+  void setPushMetrics(uint16_t proxy_port) { metrics_proxy_port = proxy_port; }
+  void markCycleStart() { check_start = Clock::now(); }
+  void setOfflineMetadata(std::shared_ptr<Primary::OfflineUpdateMetadata> m) { offline_metadata = std::move(m); }
 };
 
 #endif  // UPDATE_EVENTS_H_
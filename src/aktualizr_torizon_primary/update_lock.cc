@@ -1,14 +1,34 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 
 #include "update_lock.h"
 #include "logging/logging.h"
 
-bool UpdateLock::get(bool block) {
+/* Holders that unlock the file without closing it do not generate inotify
+ * events, so waiters also retry the lock at this interval.
+ */
+static const std::chrono::milliseconds retry_interval(250);
+
+static int lock_flags(UpdateLock::Mode mode) {
+  return mode == UpdateLock::Mode::kShared ? LOCK_SH : LOCK_EX;
+}
+
+UpdateLock::UpdateLock(boost::filesystem::path lock)
+    : lockfile(lock), lockdesc(0), notifydesc(-1), cancelled(false) {
+  canceldesc = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
 
-  int flags = LOCK_EX;
+bool UpdateLock::open_lock() {
 
   /* Open the lock file. If for some reason the lock file cannot be opened,
    * we won't lock updates to prevent situations that could make the device
@@ -20,10 +40,20 @@ bool UpdateLock::get(bool block) {
     if (lockdesc < 0) {
       LOG_ERROR << "Unable to open lock file: " << lockfile;
       lockdesc = 0;
-      return true;
+      return false;
     }
   }
 
+  return true;
+}
+
+bool UpdateLock::get(bool block, Mode mode) {
+
+  int flags = lock_flags(mode);
+
+  if (!open_lock())
+    return true;
+
   if (block == false)
     flags |= LOCK_NB;
 
@@ -35,8 +65,68 @@ bool UpdateLock::get(bool block) {
   return true;
 }
 
-bool UpdateLock::try_get() {
-  return get(false);
+bool UpdateLock::try_get(Mode mode) {
+  return get(false, mode);
+}
+
+bool UpdateLock::get(std::chrono::milliseconds timeout, Mode mode) {
+
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+
+  if (!open_lock())
+    return true;
+
+  while (true) {
+    if (cancelled) {
+      LOG_INFO << "Stopped waiting for lock: " << lockfile;
+      return false;
+    }
+
+    if (flock(lockdesc, lock_flags(mode) | LOCK_NB) == 0)
+      return true;
+
+    if (errno != EWOULDBLOCK && errno != EINTR) {
+      LOG_ERROR << "Unable to acquire lock: " << lockfile << " [" << strerror(errno) << "]";
+      return false;
+    }
+
+    if (std::chrono::steady_clock::now() >= deadline) {
+      LOG_INFO << "Timeout waiting for lock: " << lockfile;
+      return false;
+    }
+
+    wait_release(deadline);
+  }
+}
+
+bool UpdateLock::wait_release(std::chrono::steady_clock::time_point deadline) {
+
+  /* The watch on the lock file is kept for the lifetime of the lock, so that
+   * a release happening between a failed lock attempt and the next wait is
+   * not missed.
+   */
+  if (notifydesc < 0) {
+    notifydesc = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notifydesc >= 0 && inotify_add_watch(notifydesc, lockfile.c_str(), IN_CLOSE | IN_ATTRIB | IN_DELETE_SELF) < 0) {
+      LOG_WARNING << "Unable to watch lock file: " << lockfile << " [" << strerror(errno) << "]";
+      close(notifydesc);
+      notifydesc = -1;
+    }
+  }
+
+  auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+  int wait_ms = static_cast<int>(std::max(std::chrono::milliseconds(0), std::min(remaining, retry_interval)).count());
+
+  pollfd pfd[2] = {{canceldesc, POLLIN, 0}, {notifydesc, POLLIN, 0}};
+  if (poll(pfd, 2, wait_ms) <= 0 || (pfd[1].revents & POLLIN) == 0)
+    return false;
+
+  // Drain the queued events, the lock attempt itself tells if it was released.
+  char events[4096];
+  while (read(notifydesc, events, sizeof(events)) > 0) {
+  }
+
+  return true;
 }
 
 bool UpdateLock::free() {
@@ -52,8 +142,19 @@ bool UpdateLock::free() {
   return true;
 }
 
+void UpdateLock::cancel() {
+  cancelled = true;
+  uint64_t value = 1;
+  if (canceldesc >= 0 && write(canceldesc, &value, sizeof(value)) < 0)
+    LOG_WARNING << "Unable to wake up lock waiter: " << lockfile;
+}
+
 UpdateLock::~UpdateLock()
 {
   if (lockdesc)
     close(lockdesc);
+  if (notifydesc >= 0)
+    close(notifydesc);
+  if (canceldesc >= 0)
+    close(canceldesc);
 }
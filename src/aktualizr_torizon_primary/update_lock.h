@@ -1,20 +1,43 @@
 #ifndef UPDATE_LOCK_H_
 #define UPDATE_LOCK_H_
 
+#include <atomic>
+#include <chrono>
+
 #include "libaktualizr/aktualizr.h"
 
+/*
+ * Advisory lock used to prevent updates while applications are doing
+ * critical work. Applications take the lock in shared mode (flock(LOCK_SH)),
+ * so any number of them can hold it at the same time, and the updater takes
+ * it in exclusive mode before installing an update.
+ */
 class UpdateLock {
 
   boost::filesystem::path lockfile;
   int lockdesc;
+  int notifydesc;
+  int canceldesc;
+  std::atomic<bool> cancelled;
+
+  bool open_lock();
+  bool wait_release(std::chrono::steady_clock::time_point deadline);
 
  public:
-  UpdateLock(boost::filesystem::path lock) : lockfile(lock), lockdesc(0) {}
+  enum class Mode { kShared, kExclusive };
+
+  UpdateLock(boost::filesystem::path lock);
   ~UpdateLock();
 
-  bool get(bool block = true);
-  bool try_get();
+  bool get(bool block = true, Mode mode = Mode::kExclusive);
+  bool try_get(Mode mode = Mode::kExclusive);
+  // Wait at most `timeout` for the lock. Waiters are woken up as soon as a
+  // holder closes the lock file, with a periodic retry for holders that only
+  // unlock it.
+  bool get(std::chrono::milliseconds timeout, Mode mode = Mode::kExclusive);
   bool free();
+  // Make a pending and any later timed get() fail immediately (on shutdown).
+  void cancel();
 };
 
-#endif  // UPDATE_EVENTS_H_
+#endif  // UPDATE_LOCK_H_
@@ -0,0 +1,97 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <future>
+#include <thread>
+
+#include "logging/logging.h"
+#include "update_lock.h"
+#include "utilities/utils.h"
+
+using std::chrono::milliseconds;
+using Clock = std::chrono::steady_clock;
+
+/*
+ * A timed get() gives up after the timeout while an application holds the
+ * lock.
+ */
+TEST(UpdateLock, Timeout) {
+  TemporaryDirectory temp_dir;
+  UpdateLock holder(temp_dir / "lock");
+  UpdateLock updater(temp_dir / "lock");
+
+  ASSERT_TRUE(holder.get(true, UpdateLock::Mode::kShared));
+
+  auto start = Clock::now();
+  EXPECT_FALSE(updater.get(milliseconds(300)));
+  EXPECT_GE(Clock::now() - start, milliseconds(300));
+
+  holder.free();
+  EXPECT_TRUE(updater.get(milliseconds(300)));
+}
+
+/*
+ * Any number of applications can hold the lock in shared mode; the updater
+ * gets it once the last one releases it.
+ */
+TEST(UpdateLock, SharedHolders) {
+  TemporaryDirectory temp_dir;
+  UpdateLock app1(temp_dir / "lock");
+  UpdateLock app2(temp_dir / "lock");
+  UpdateLock updater(temp_dir / "lock");
+
+  ASSERT_TRUE(app1.try_get(UpdateLock::Mode::kShared));
+  ASSERT_TRUE(app2.try_get(UpdateLock::Mode::kShared));
+  EXPECT_FALSE(updater.try_get());
+
+  app1.free();
+  EXPECT_FALSE(updater.try_get());
+
+  auto release = std::async(std::launch::async, [&app2]() {
+    std::this_thread::sleep_for(milliseconds(200));
+    app2.free();
+  });
+  auto start = Clock::now();
+  EXPECT_TRUE(updater.get(milliseconds(10000)));
+  EXPECT_LT(Clock::now() - start, milliseconds(5000));
+  release.get();
+
+  // the updater now holds it exclusively
+  EXPECT_FALSE(app1.try_get(UpdateLock::Mode::kShared));
+  updater.free();
+  EXPECT_TRUE(app1.try_get(UpdateLock::Mode::kShared));
+}
+
+/*
+ * cancel() interrupts a pending wait.
+ */
+TEST(UpdateLock, Cancel) {
+  TemporaryDirectory temp_dir;
+  UpdateLock holder(temp_dir / "lock");
+  UpdateLock updater(temp_dir / "lock");
+
+  ASSERT_TRUE(holder.get(true, UpdateLock::Mode::kShared));
+
+  auto cancel = std::async(std::launch::async, [&updater]() {
+    std::this_thread::sleep_for(milliseconds(200));
+    updater.cancel();
+  });
+  auto start = Clock::now();
+  EXPECT_FALSE(updater.get(milliseconds(60000)));
+  EXPECT_LT(Clock::now() - start, milliseconds(5000));
+  cancel.get();
+
+  holder.free();
+  EXPECT_FALSE(updater.get(milliseconds(100)));
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+
+  logger_init();
+  logger_set_threshold(boost::log::trivial::trace);
+
+  return RUN_ALL_TESTS();
+}
+#endif
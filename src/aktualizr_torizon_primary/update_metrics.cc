@@ -0,0 +1,283 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <sstream>
+
+#include "logging/logging.h"
+#include "update_metrics.h"
+
+static const char *const metric_duration = "aktualizr_torizon_phase_duration_seconds";
+static const char *const metric_events = "aktualizr_torizon_events_total";
+static const char *const metric_results = "aktualizr_torizon_phase_results_total";
+
+// Histogram buckets (in seconds), from sub-second metadata checks up to
+// hour-long downloads.
+static const std::vector<double> duration_buckets = {0.1, 0.5, 1, 2.5, 5, 10, 30, 60, 120, 300, 600, 1800, 3600};
+
+void UpdateMetrics::Histogram::observe(double value) {
+  for (size_t i = 0; i < bounds.size(); ++i) {
+    if (value <= bounds[i]) {
+      counts[i]++;
+    }
+  }
+  count++;
+  sum += value;
+}
+
+UpdateMetrics::Labels UpdateMetrics::labels(const std::string &phase, const std::string &label_name,
+                                            const std::string &label_value) {
+  Labels res{{"phase", phase}};
+  if (!label_name.empty()) {
+    res.emplace_back(label_name, label_value);
+  }
+  return res;
+}
+
+// Render a label set as name="value",... escaping the values as required by
+// the Prometheus text format.
+std::string UpdateMetrics::formatLabels(const Labels &labels) {
+  std::string res;
+  for (const auto &label : labels) {
+    if (!res.empty()) {
+      res += ",";
+    }
+    res += label.first + "=\"";
+    for (char c : label.second) {
+      if (c == '\\' || c == '"') {
+        res += '\\';
+        res += c;
+      } else if (c == '\n') {
+        res += "\\n";
+      } else {
+        res += c;
+      }
+    }
+    res += "\"";
+  }
+  return res;
+}
+
+void UpdateMetrics::observe(const std::string &phase, double seconds, const std::string &label_name,
+                            const std::string &label_value) {
+  std::lock_guard<std::mutex> guard(mutex);
+  auto &series = histograms[metric_duration];
+  auto it = series.emplace(labels(phase, label_name, label_value), Histogram(duration_buckets)).first;
+  it->second.observe(seconds);
+  LOG_DEBUG << "Update phase " << phase << (label_value.empty() ? "" : " (" + label_value + ")") << " took "
+            << seconds << " seconds";
+}
+
+void UpdateMetrics::countEvent(const std::string &event) {
+  std::lock_guard<std::mutex> guard(mutex);
+  counters[metric_events][Labels{{"event", event}}]++;
+}
+
+void UpdateMetrics::countResult(const std::string &phase, bool success) {
+  std::lock_guard<std::mutex> guard(mutex);
+  counters[metric_results][labels(phase, "result", success ? "success" : "error")]++;
+}
+
+std::string UpdateMetrics::toPrometheus() const {
+  std::lock_guard<std::mutex> guard(mutex);
+  std::ostringstream out;
+
+  for (const auto &metric : histograms) {
+    out << "# HELP " << metric.first << " Duration of the update cycle phases.\n";
+    out << "# TYPE " << metric.first << " histogram\n";
+    for (const auto &series : metric.second) {
+      const Histogram &h = series.second;
+      const std::string labels = formatLabels(series.first);
+      for (size_t i = 0; i < h.bounds.size(); ++i) {
+        out << metric.first << "_bucket{" << labels << ",le=\"" << h.bounds[i] << "\"} " << h.counts[i] << "\n";
+      }
+      out << metric.first << "_bucket{" << labels << ",le=\"+Inf\"} " << h.count << "\n";
+      out << metric.first << "_sum{" << labels << "} " << h.sum << "\n";
+      out << metric.first << "_count{" << labels << "} " << h.count << "\n";
+    }
+  }
+
+  for (const auto &metric : counters) {
+    out << "# TYPE " << metric.first << " counter\n";
+    for (const auto &series : metric.second) {
+      out << metric.first << "{" << formatLabels(series.first) << "} " << series.second << "\n";
+    }
+  }
+
+  return out.str();
+}
+
+// Turn a label set such as phase="install",ecu="x" into install,ecu=x.
+std::string UpdateMetrics::jsonKey(const Labels &labels) {
+  std::string key;
+  for (const auto &label : labels) {
+    key += key.empty() ? label.second : "," + label.first + "=" + label.second;
+  }
+  return key;
+}
+
+Json::Value UpdateMetrics::toJson() const {
+  std::lock_guard<std::mutex> guard(mutex);
+  Json::Value res;
+
+  // Only the aggregates are sent as device data, buckets stay local.
+  for (const auto &metric : histograms) {
+    for (const auto &series : metric.second) {
+      Json::Value &entry = res["durations"][jsonKey(series.first)];
+      entry["count"] = Json::UInt64(series.second.count);
+      entry["sum"] = series.second.sum;
+    }
+  }
+  for (const auto &metric : counters) {
+    for (const auto &series : metric.second) {
+      res[metric.first == metric_events ? "events" : "results"][jsonKey(series.first)] = Json::UInt64(series.second);
+    }
+  }
+
+  return res;
+}
+
+MetricsServer::MetricsServer(const UpdateMetrics &m) : metrics(m), running(false), cancel_pipe{-1, -1} {}
+
+MetricsServer::~MetricsServer() { Stop(); }
+
+int MetricsServer::ListenTcp(uint16_t port) {
+  int socketfd;
+  if ((socketfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    LOG_ERROR << "METRICS: could not create socket! [" << strerror(errno) << "]";
+    return -1;
+  }
+
+  int enable = 1;
+  setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+
+  sockaddr_in sockaddr{};
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  sockaddr.sin_port = htons(port);
+
+  if (bind(socketfd, reinterpret_cast<struct sockaddr *>(&sockaddr), sizeof(sockaddr)) < 0) {
+    LOG_ERROR << "METRICS: failed to bind to TCP port " << port << "! [" << strerror(errno) << "]";
+    close(socketfd);
+    return -1;
+  }
+
+  return socketfd;
+}
+
+int MetricsServer::ListenUnix(const std::string &path) {
+  int socketfd;
+  if ((socketfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    LOG_ERROR << "METRICS: could not create socket! [" << strerror(errno) << "]";
+    return -1;
+  }
+
+  sockaddr_un sockaddr{};
+  sockaddr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(sockaddr.sun_path)) {
+    LOG_ERROR << "METRICS: unix socket path too long: " << path;
+    close(socketfd);
+    return -1;
+  }
+  strncpy(sockaddr.sun_path, path.c_str(), sizeof(sockaddr.sun_path) - 1);
+  unlink(path.c_str());
+
+  if (bind(socketfd, reinterpret_cast<struct sockaddr *>(&sockaddr), sizeof(sockaddr)) < 0) {
+    LOG_ERROR << "METRICS: failed to bind to " << path << "! [" << strerror(errno) << "]";
+    close(socketfd);
+    return -1;
+  }
+
+  return socketfd;
+}
+
+void MetricsServer::Serve(int connection) {
+  // Drain the request (only GET is expected, its content does not matter).
+  char buffer[1024];
+  pollfd pfd{connection, POLLIN, 0};
+  if (poll(&pfd, 1, 1000) > 0) {
+    if (recv(connection, buffer, sizeof(buffer), 0) < 0) {
+      return;
+    }
+  }
+
+  const std::string body = metrics.toPrometheus();
+  std::ostringstream response;
+  response << "HTTP/1.0 200 OK\r\n"
+           << "Content-Type: text/plain; version=0.0.4\r\n"
+           << "Content-Length: " << body.size() << "\r\n"
+           << "\r\n"
+           << body;
+  const std::string data = response.str();
+
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(connection, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      break;
+    }
+    sent += static_cast<size_t>(n);
+  }
+}
+
+void MetricsServer::Start(uint16_t port, const std::string &socket_path) {
+  int listener = socket_path.empty() ? ListenTcp(port) : ListenUnix(socket_path);
+  if (listener < 0) {
+    throw std::runtime_error("could not create metrics endpoint");
+  }
+  if (listen(listener, 8) < 0 || pipe(cancel_pipe) != 0) {
+    close(listener);
+    throw std::runtime_error("could not listen on metrics endpoint");
+  }
+
+  if (socket_path.empty()) {
+    LOG_INFO << "METRICS: serving metrics on 127.0.0.1:" << port << ".";
+  } else {
+    LOG_INFO << "METRICS: serving metrics on " << socket_path << ".";
+  }
+
+  running = true;
+  future = std::async(std::launch::async, [this, listener, socket_path]() {
+    pollfd fds[2] = {{cancel_pipe[0], POLLIN, 0}, {listener, POLLIN, 0}};
+    while (true) {
+      if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        LOG_ERROR << "METRICS: unexpected error when waiting for connections!";
+        break;
+      }
+      if ((fds[0].revents & POLLIN) != 0) {
+        break;
+      }
+      if ((fds[1].revents & POLLIN) != 0) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection >= 0) {
+          Serve(connection);
+          close(connection);
+        }
+      }
+    }
+
+    close(listener);
+    if (!socket_path.empty()) {
+      unlink(socket_path.c_str());
+    }
+    running = false;
+  });
+}
+
+void MetricsServer::Stop() {
+  if (future.valid()) {
+    if (write(cancel_pipe[1], "stop", 4) < 0) {
+      LOG_ERROR << "METRICS: could not stop metrics server!";
+    }
+    future.get();
+    close(cancel_pipe[0]);
+    close(cancel_pipe[1]);
+  }
+}
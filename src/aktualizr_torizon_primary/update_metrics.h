@@ -0,0 +1,81 @@
+#ifndef UPDATE_METRICS_H_
+#define UPDATE_METRICS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <json/json.h>
+
+/*
+ * Latency histograms and counters of the update cycle phases (update check,
+ * downloads, installs, manifest upload), rendered in the Prometheus text
+ * exposition format or as JSON (to be sent as device data).
+ */
+class UpdateMetrics {
+
+  class Histogram {
+   public:
+    explicit Histogram(const std::vector<double> &bounds) : bounds(bounds), counts(bounds.size(), 0) {}
+    void observe(double value);
+
+    const std::vector<double> &bounds;
+    std::vector<uint64_t> counts;
+    uint64_t count{0};
+    double sum{0};
+  };
+
+  // Label names and (unescaped) values of a series.
+  using Labels = std::vector<std::pair<std::string, std::string>>;
+
+  // Histograms and counters keyed by metric name and then by label set.
+  std::map<std::string, std::map<Labels, Histogram>> histograms;
+  std::map<std::string, std::map<Labels, uint64_t>> counters;
+  mutable std::mutex mutex;
+
+  static Labels labels(const std::string &phase, const std::string &label_name, const std::string &label_value);
+  static std::string formatLabels(const Labels &labels);
+  static std::string jsonKey(const Labels &labels);
+
+ public:
+  // Duration of a phase, in seconds; label_name/label_value optionally
+  // identify the ECU or target the phase applies to.
+  void observe(const std::string &phase, double seconds, const std::string &label_name = "",
+               const std::string &label_value = "");
+  void countEvent(const std::string &event);
+  void countResult(const std::string &phase, bool success);
+
+  std::string toPrometheus() const;
+  Json::Value toJson() const;
+};
+
+/*
+ * Serves the metrics over HTTP, in the Prometheus text format, on a local TCP
+ * port or on a unix socket.
+ */
+class MetricsServer {
+
+  const UpdateMetrics &metrics;
+  std::future<void> future;
+  std::atomic<bool> running;
+  int cancel_pipe[2];
+
+  int ListenTcp(uint16_t port);
+  int ListenUnix(const std::string &path);
+  void Serve(int connection);
+
+ public:
+  explicit MetricsServer(const UpdateMetrics &m);
+  ~MetricsServer();
+
+  // Either port or socket_path must be set.
+  void Start(uint16_t port, const std::string &socket_path = "");
+  void Stop();
+};
+
+#endif  // UPDATE_METRICS_H_
@@ -0,0 +1,80 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "logging/logging.h"
+#include "update_metrics.h"
+
+static bool contains(const std::string &text, const std::string &line) {
+  return text.find(line + "\n") != std::string::npos;
+}
+
+/*
+ * Buckets are cumulative and the +Inf bucket, sum and count cover every
+ * observation.
+ */
+TEST(UpdateMetrics, Histogram) {
+  UpdateMetrics metrics;
+  metrics.observe("install", 0.05);
+  metrics.observe("install", 0.7);
+  metrics.observe("install", 4000);
+  metrics.observe("download", 2);
+
+  const std::string text = metrics.toPrometheus();
+  const std::string name = "aktualizr_torizon_phase_duration_seconds";
+  EXPECT_TRUE(contains(text, name + "_bucket{phase=\"install\",le=\"0.1\"} 1"));
+  EXPECT_TRUE(contains(text, name + "_bucket{phase=\"install\",le=\"0.5\"} 1"));
+  EXPECT_TRUE(contains(text, name + "_bucket{phase=\"install\",le=\"1\"} 2"));
+  EXPECT_TRUE(contains(text, name + "_bucket{phase=\"install\",le=\"3600\"} 2"));
+  EXPECT_TRUE(contains(text, name + "_bucket{phase=\"install\",le=\"+Inf\"} 3"));
+  EXPECT_TRUE(contains(text, name + "_sum{phase=\"install\"} 4000.75"));
+  EXPECT_TRUE(contains(text, name + "_count{phase=\"install\"} 3"));
+  EXPECT_TRUE(contains(text, name + "_bucket{phase=\"download\",le=\"1\"} 0"));
+  EXPECT_TRUE(contains(text, name + "_bucket{phase=\"download\",le=\"2.5\"} 1"));
+
+  Json::Value json = metrics.toJson();
+  EXPECT_EQ(json["durations"]["install"]["count"].asUInt64(), 3);
+  EXPECT_DOUBLE_EQ(json["durations"]["install"]["sum"].asDouble(), 4000.75);
+}
+
+/*
+ * Metric families are announced once and label values are escaped.
+ */
+TEST(UpdateMetrics, ExpositionFormat) {
+  UpdateMetrics metrics;
+  metrics.observe("install_ecu", 1, "ecu", "a\"b\\c\nd");
+  metrics.countEvent("InstallStarted");
+  metrics.countResult("install", true);
+  metrics.countResult("install", false);
+  metrics.countResult("install", false);
+
+  const std::string text = metrics.toPrometheus();
+  EXPECT_TRUE(contains(text, "# TYPE aktualizr_torizon_phase_duration_seconds histogram"));
+  EXPECT_TRUE(contains(text, "aktualizr_torizon_phase_duration_seconds_count{phase=\"install_ecu\",ecu=\"a\\\"b\\\\c\\nd\"} 1"));
+  EXPECT_TRUE(contains(text, "# TYPE aktualizr_torizon_events_total counter"));
+  EXPECT_TRUE(contains(text, "aktualizr_torizon_events_total{event=\"InstallStarted\"} 1"));
+  EXPECT_TRUE(contains(text, "# TYPE aktualizr_torizon_phase_results_total counter"));
+  EXPECT_TRUE(contains(text, "aktualizr_torizon_phase_results_total{phase=\"install\",result=\"success\"} 1"));
+  EXPECT_TRUE(contains(text, "aktualizr_torizon_phase_results_total{phase=\"install\",result=\"error\"} 2"));
+
+  // a raw newline in a label value would break the line based format
+  for (size_t pos = 0, end; (end = text.find('\n', pos)) != std::string::npos; pos = end + 1) {
+    const std::string line = text.substr(pos, end - pos);
+    EXPECT_TRUE(line[0] == '#' || line.find("} ") != std::string::npos) << line;
+  }
+
+  Json::Value json = metrics.toJson();
+  EXPECT_EQ(json["results"]["install,result=error"].asUInt64(), 2);
+  EXPECT_EQ(json["events"]["InstallStarted"].asUInt64(), 1);
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+
+  logger_init();
+  logger_set_threshold(boost::log::trivial::trace);
+
+  return RUN_ALL_TESTS();
+}
+#endif
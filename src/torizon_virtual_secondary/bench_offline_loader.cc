@@ -0,0 +1,371 @@
+/*
+ * Benchmarks of the offline container update path: validation and loading of
+ * `docker save` tarballs and of the images referenced by a docker-compose file.
+ *
+ * The tarballs, manifests and compose files are synthetic and the `docker`
+ * program is replaced by a script that drains its input, so that only the
+ * work done by aktualizr-torizon is measured. Arguments of each benchmark are
+ * the number of images, the number of layers per image and the size of each
+ * layer in KiB. Throughput is reported per tarball byte and the number of
+ * heap allocations per iteration is reported as the "allocs" counter.
+ */
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+
+#include "crypto/crypto.h"
+#include "dockerloadsink.h"
+#include "dockerofflineloader.h"
+#include "dockertarballloader.h"
+#include "logging/logging.h"
+#include "logguard.h"
+#include "utilities/utils.h"
+
+// ---
+// Allocation counting.
+// ---
+
+static std::atomic<uint64_t> num_allocs{0};
+
+void *operator new(std::size_t size) {
+  num_allocs.fetch_add(1, std::memory_order_relaxed);
+  void *ptr = std::malloc(size != 0 ? size : 1);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+static void reportAllocs(benchmark::State &state, uint64_t allocs_start) {
+  state.counters["allocs"] = benchmark::Counter(static_cast<double>(num_allocs.load() - allocs_start),
+                                                benchmark::Counter::kAvgIterations);
+}
+
+// ---
+// Synthetic update generation.
+// ---
+
+static std::string sha256Hex(const std::string &data) {
+  MultiPartSHA256Hasher hasher;
+  hasher.update(reinterpret_cast<const unsigned char *>(data.data()), data.size());
+  return boost::algorithm::to_lower_copy(hasher.getHexDigest());
+}
+
+/**
+ * Minimal writer of ustar archives, enough for `docker save` tarballs.
+ */
+class TarWriter {
+ public:
+  explicit TarWriter(const boost::filesystem::path &path) : out_(path.string(), std::ios::binary) {}
+
+  void add(const std::string &name, const std::string &data) {
+    char header[512] = {};
+    std::strncpy(header, name.c_str(), 99);
+    std::snprintf(header + 100, 8, "%07o", 0644);
+    std::snprintf(header + 108, 8, "%07o", 0);
+    std::snprintf(header + 116, 8, "%07o", 0);
+    std::snprintf(header + 124, 12, "%011llo", static_cast<unsigned long long>(data.size()));
+    std::snprintf(header + 136, 12, "%011o", 0);
+    header[156] = '0';
+    std::memcpy(header + 257, "ustar", 6);
+    std::memcpy(header + 263, "00", 2);
+    std::memset(header + 148, ' ', 8);
+    unsigned checksum = 0;
+    for (char c : header) {
+      checksum += static_cast<unsigned char>(c);
+    }
+    std::snprintf(header + 148, 8, "%06o", checksum);
+
+    out_.write(header, sizeof(header));
+    out_.write(data.data(), static_cast<std::streamsize>(data.size()));
+    pad(data.size());
+  }
+
+  uint64_t finish() {
+    const std::string end_marker(1024, '\0');
+    out_.write(end_marker.data(), static_cast<std::streamsize>(end_marker.size()));
+    out_.close();
+    total_ += end_marker.size();
+    return total_;
+  }
+
+ private:
+  void pad(size_t size) {
+    const size_t rem = size % 512;
+    if (rem != 0) {
+      const std::string padding(512 - rem, '\0');
+      out_.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+    }
+    total_ += 512 + size + (rem != 0 ? 512 - rem : 0);
+  }
+
+  std::ofstream out_;
+  uint64_t total_{0};
+};
+
+/**
+ * Offline update with the given number of images (one service per image),
+ * layers per image and layer size, plus a `docker` script that drains its
+ * standard input.
+ */
+class SyntheticUpdate {
+ public:
+  SyntheticUpdate(int images, int layers, int layer_kib) {
+    boost::filesystem::create_directories(imagesDir());
+    boost::filesystem::create_directories(manifestsDir());
+
+    std::mt19937 rng(1234);
+    std::string compose = "version: '2.4'\nservices:\n";
+    for (int img = 0; img < images; ++img) {
+      const std::string name = "bench/app" + std::to_string(img);
+      compose += "  app" + std::to_string(img) + ":\n    image: " + addImage(name, layers, layer_kib, rng) + "\n";
+    }
+    Utils::writeFile(composePath(), compose);
+
+    docker_ = dir_ / "docker";
+    Utils::writeFile(docker_, std::string("#!/bin/sh\nexec cat > /dev/null\n"));
+    boost::filesystem::permissions(docker_, boost::filesystem::owner_all);
+    DockerTarballLoader::setDockerProgram(docker_.string());
+  }
+
+  boost::filesystem::path imagesDir() const { return dir_ / "images"; }
+  boost::filesystem::path manifestsDir() const { return dir_ / "manifests"; }
+  boost::filesystem::path composePath() const { return dir_ / "docker-compose.yml"; }
+  const std::vector<boost::filesystem::path> &tarballs() const { return tarballs_; }
+  const std::vector<DockerTarballLoader::StringToStringSet> &expected() const { return expected_; }
+  uint64_t tarballBytes() const { return tarball_bytes_; }
+
+ private:
+  std::string addImage(const std::string &name, int layers, int layer_kib, std::mt19937 &rng) {
+    Json::Value config;
+    config["architecture"] = "arm64";
+    config["os"] = "linux";
+    config["rootfs"]["type"] = "layers";
+
+    Json::Value manifest;
+    manifest["schemaVersion"] = 2;
+    manifest["mediaType"] = "application/vnd.docker.distribution.manifest.v2+json";
+
+    std::vector<std::string> layer_data;
+    for (int idx = 0; idx < layers; ++idx) {
+      std::string data(static_cast<size_t>(layer_kib) * 1024, '\0');
+      for (auto &c : data) {
+        c = static_cast<char>(rng());
+      }
+      const std::string diff_id = "sha256:" + sha256Hex(data);
+      config["rootfs"]["diff_ids"].append(diff_id);
+
+      Json::Value layer;
+      layer["mediaType"] = "application/vnd.docker.image.rootfs.diff.tar.gzip";
+      layer["size"] = Json::UInt64(data.size());
+      layer["digest"] = diff_id;
+      manifest["layers"].append(layer);
+      layer_data.push_back(std::move(data));
+    }
+
+    const std::string config_str = Utils::jsonToCanonicalStr(config);
+    const std::string config_digest = sha256Hex(config_str);
+    manifest["config"]["mediaType"] = "application/vnd.docker.container.image.v1+json";
+    manifest["config"]["size"] = Json::UInt64(config_str.size());
+    manifest["config"]["digest"] = "sha256:" + config_digest;
+
+    const std::string manifest_str = Utils::jsonToCanonicalStr(manifest);
+    const std::string manifest_digest = sha256Hex(manifest_str);
+    Utils::writeFile(manifestsDir() / (manifest_digest + ".json"), manifest_str);
+
+    // Tag given by DockerComposeOfflineLoader to the image.
+    const std::string tag = name + ":digest_sha256_" + manifest_digest;
+
+    Json::Value save_manifest;
+    save_manifest[0]["Config"] = config_digest + ".json";
+    save_manifest[0]["RepoTags"].append(tag);
+    const boost::filesystem::path tarball = imagesDir() / (manifest_digest + ".tar");
+    TarWriter writer(tarball);
+    for (size_t idx = 0; idx < layer_data.size(); ++idx) {
+      const std::string layer_dir = "layer" + std::to_string(idx);
+      writer.add(layer_dir + "/VERSION", "1.0");
+      writer.add(layer_dir + "/json", "{\"id\":\"" + layer_dir + "\"}");
+      writer.add(layer_dir + "/layer.tar", layer_data[idx]);
+      save_manifest[0]["Layers"].append(layer_dir + "/layer.tar");
+    }
+    writer.add(config_digest + ".json", config_str);
+    writer.add("manifest.json", Utils::jsonToCanonicalStr(save_manifest));
+    tarball_bytes_ += writer.finish();
+
+    tarballs_.push_back(tarball);
+    DockerTarballLoader::StringToStringSet expected;
+    expected[config_digest].insert(tag);
+    expected_.push_back(expected);
+
+    return name + "@sha256:" + manifest_digest;
+  }
+
+  TemporaryDirectory dir_;
+  boost::filesystem::path docker_;
+  std::vector<boost::filesystem::path> tarballs_;
+  std::vector<DockerTarballLoader::StringToStringSet> expected_;
+  uint64_t tarball_bytes_{0};
+};
+
+// ---
+// Benchmarks.
+// ---
+
+static void BM_TarballLoadMetadata(benchmark::State &state) {
+  SyntheticUpdate update(1, static_cast<int>(state.range(1)), static_cast<int>(state.range(2)));
+  const uint64_t allocs_start = num_allocs.load();
+  for (auto _ : state) {
+    DockerTarballLoader loader(update.tarballs()[0]);
+    loader.loadMetadata();
+  }
+  reportAllocs(state, allocs_start);
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * update.tarballBytes()));
+}
+
+// Arguments: number of layers, KiB per layer, reading threads (1: no read-ahead).
+static void BM_TarballLoadMetadataThreads(benchmark::State &state) {
+  SyntheticUpdate update(1, static_cast<int>(state.range(0)), static_cast<int>(state.range(1)));
+  for (auto _ : state) {
+    DockerTarballLoader loader(update.tarballs()[0]);
+    loader.setHashThreads(static_cast<unsigned>(state.range(2)));
+    loader.loadMetadata();
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * update.tarballBytes()));
+}
+
+static void BM_TarballValidateMetadata(benchmark::State &state) {
+  SyntheticUpdate update(1, static_cast<int>(state.range(1)), static_cast<int>(state.range(2)));
+  DockerTarballLoader loader(update.tarballs()[0]);
+  loader.loadMetadata();
+  auto expected = update.expected()[0];
+  const uint64_t allocs_start = num_allocs.load();
+  for (auto _ : state) {
+    if (!loader.validateMetadata(&expected)) {
+      state.SkipWithError("validation failed");
+      break;
+    }
+  }
+  reportAllocs(state, allocs_start);
+}
+
+static void BM_TarballLoadImages(benchmark::State &state) {
+  SyntheticUpdate update(1, static_cast<int>(state.range(1)), static_cast<int>(state.range(2)));
+  const uint64_t allocs_start = num_allocs.load();
+  for (auto _ : state) {
+    state.PauseTiming();
+    DockerTarballLoader loader(update.tarballs()[0]);
+    loader.loadMetadata();
+    state.ResumeTiming();
+    if (!loader.loadImages()) {
+      state.SkipWithError("loading failed");
+      break;
+    }
+  }
+  reportAllocs(state, allocs_start);
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * update.tarballBytes()));
+}
+
+// Verification alone: the tarball is sent to a sink that only counts it.
+static void BM_TarballVerify(benchmark::State &state) {
+  SyntheticUpdate update(1, static_cast<int>(state.range(1)), static_cast<int>(state.range(2)));
+  DockerCountingSink sink;
+  const uint64_t allocs_start = num_allocs.load();
+  for (auto _ : state) {
+    state.PauseTiming();
+    DockerTarballLoader loader(update.tarballs()[0]);
+    loader.loadMetadata();
+    state.ResumeTiming();
+    if (!loader.loadImages(sink)) {
+      state.SkipWithError("verification failed");
+      break;
+    }
+  }
+  reportAllocs(state, allocs_start);
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * update.tarballBytes()));
+}
+
+static void BM_ComposeLoad(benchmark::State &state) {
+  SyntheticUpdate update(static_cast<int>(state.range(0)), static_cast<int>(state.range(1)),
+                         static_cast<int>(state.range(2)));
+  const uint64_t allocs_start = num_allocs.load();
+  for (auto _ : state) {
+    auto dmcache = std::make_shared<DockerManifestsCache>(update.manifestsDir());
+    DockerComposeOfflineLoader dcloader(update.imagesDir(), dmcache);
+    dcloader.loadCompose(update.composePath(), "");
+  }
+  reportAllocs(state, allocs_start);
+}
+
+static void BM_InstallImages(benchmark::State &state) {
+  SyntheticUpdate update(static_cast<int>(state.range(0)), static_cast<int>(state.range(1)),
+                         static_cast<int>(state.range(2)));
+  const uint64_t allocs_start = num_allocs.load();
+  for (auto _ : state) {
+    auto dmcache = std::make_shared<DockerManifestsCache>(update.manifestsDir());
+    DockerComposeOfflineLoader dcloader(update.imagesDir(), dmcache);
+    dcloader.loadCompose(update.composePath(), "");
+    dcloader.installImages();
+  }
+  reportAllocs(state, allocs_start);
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * update.tarballBytes()));
+}
+
+// Cost of a trace message below the logging threshold, as emitted for each
+// layer by the tarball loader: argument 0 uses LOG_TRACE, 1 LOG_TRACE_LAZY.
+static void BM_DisabledTraceLog(benchmark::State &state) {
+  const std::string digest(64, 'a');
+  const bool lazy = state.range(0) != 0;
+  const uint64_t allocs_start = num_allocs.load();
+  for (auto _ : state) {
+    for (int idx = 0; idx < 64; idx++) {
+      if (lazy) {
+        LOG_TRACE_LAZY << "layer[" << idx << "]: " << digest.substr(0, 12) << ", size=" << 1024 * idx;
+      } else {
+        LOG_TRACE << "layer[" << idx << "]: " << digest.substr(0, 12) << ", size=" << 1024 * idx;
+      }
+    }
+  }
+  reportAllocs(state, allocs_start);
+}
+
+// Arguments: images, layers per image, KiB per layer.
+#define OFFLINE_ARGS Args({1, 4, 256})->Args({1, 8, 8192})->Args({4, 16, 1024})->Unit(benchmark::kMillisecond)
+
+BENCHMARK(BM_TarballLoadMetadata)->OFFLINE_ARGS;
+BENCHMARK(BM_TarballLoadMetadataThreads)
+    ->Args({16, 4096, 1})->Args({16, 4096, 2})
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_TarballValidateMetadata)->OFFLINE_ARGS;
+BENCHMARK(BM_TarballLoadImages)->OFFLINE_ARGS;
+BENCHMARK(BM_TarballVerify)->OFFLINE_ARGS;
+BENCHMARK(BM_ComposeLoad)->OFFLINE_ARGS;
+BENCHMARK(BM_InstallImages)->OFFLINE_ARGS;
+BENCHMARK(BM_DisabledTraceLog)->Arg(0)->Arg(1);
+
+int main(int argc, char **argv) {
+  logger_init();
+  logger_set_threshold(boost::log::trivial::warning);
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
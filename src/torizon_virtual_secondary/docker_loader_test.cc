@@ -0,0 +1,426 @@
+#include <gtest/gtest.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#include "crypto/crypto.h"
+#include "dockerloadsink.h"
+#include "dockerofflineloader.h"
+#include "dockerstorageplanner.h"
+#include "dockertarballloader.h"
+#include "logging/logging.h"
+#include "utilities/utils.h"
+
+/*
+ * Storage needed by a container update only accounts for layers that are not
+ * in Docker's layer store yet, counting shared layers once.
+ */
+TEST(DockerLoader, DockerStoragePlanner) {
+  TemporaryDirectory data_root;
+  DockerStoragePlanner planner(data_root.Path());
+  const std::string base(64, 'a');
+  const std::string app(64, 'b');
+
+  planner.addTarballImage({{base, 1000}, {app, 200}}, 1500);
+  planner.addTarballImage({{base, 1000}}, 1100);
+  EXPECT_EQ(planner.estimate().needed, 1000u + 200u + 1500u);
+
+  // The chain ID of a base layer is its diff ID.
+  boost::filesystem::create_directories(data_root / "image" / "overlay2" / "layerdb" / "sha256" / base);
+  EXPECT_EQ(planner.estimate().needed, 200u + 1500u);
+
+  // Unused images are not removed unless allowed: the update is refused.
+  planner.addTarballImage({}, std::numeric_limits<uint64_t>::max() / 2);
+  DockerStoragePlanner::Estimate est{};
+  EXPECT_FALSE(planner.ensureCapacity(false, &est));
+  EXPECT_GT(est.needed, est.available);
+}
+
+/* Write a ustar archive with the given files, enough for `docker save` tarballs. */
+static void writeTarball(const boost::filesystem::path &path,
+                         const std::vector<std::pair<std::string, std::string>> &files) {
+  std::ofstream out(path.string(), std::ios::binary);
+  for (const auto &file : files) {
+    char header[512] = {};
+    std::strncpy(header, file.first.c_str(), 99);
+    std::snprintf(header + 100, 8, "%07o", 0644);
+    std::snprintf(header + 108, 8, "%07o", 0);
+    std::snprintf(header + 116, 8, "%07o", 0);
+    std::snprintf(header + 124, 12, "%011llo", static_cast<unsigned long long>(file.second.size()));
+    std::snprintf(header + 136, 12, "%011o", 0);
+    header[156] = '0';
+    std::memcpy(header + 257, "ustar", 6);
+    std::memcpy(header + 263, "00", 2);
+    std::memset(header + 148, ' ', 8);
+    unsigned checksum = 0;
+    for (char c : header) {
+      checksum += static_cast<unsigned char>(c);
+    }
+    std::snprintf(header + 148, 8, "%06o", checksum);
+    out.write(header, sizeof(header));
+    out << file.second << std::string((512 - file.second.size() % 512) % 512, '\0');
+  }
+  out << std::string(1024, '\0');
+}
+
+/*
+ * Add a single-layer image to an offline update: its manifest goes to the
+ * manifests directory and its `docker save` tarball to the images directory.
+ * Returns the digest of the image configuration.
+ */
+static std::string addOfflineImage(const boost::filesystem::path &update_dir, const std::string &name,
+                                   const std::string &layer_data, std::string *reference) {
+  const std::string diff_id = "sha256:" + Crypto::sha256digestHex(layer_data);
+  Json::Value config;
+  config["architecture"] = "arm64";
+  config["os"] = "linux";
+  config["rootfs"]["type"] = "layers";
+  config["rootfs"]["diff_ids"].append(diff_id);
+  const std::string config_str = Utils::jsonToCanonicalStr(config);
+  const std::string config_digest = Crypto::sha256digestHex(config_str);
+
+  Json::Value manifest;
+  manifest["schemaVersion"] = 2;
+  manifest["mediaType"] = "application/vnd.docker.distribution.manifest.v2+json";
+  manifest["config"]["mediaType"] = "application/vnd.docker.container.image.v1+json";
+  manifest["config"]["size"] = Json::UInt64(config_str.size());
+  manifest["config"]["digest"] = "sha256:" + config_digest;
+  manifest["layers"][0]["mediaType"] = "application/vnd.docker.image.rootfs.diff.tar.gzip";
+  manifest["layers"][0]["size"] = Json::UInt64(layer_data.size());
+  manifest["layers"][0]["digest"] = diff_id;
+  const std::string manifest_str = Utils::jsonToCanonicalStr(manifest);
+  const std::string manifest_digest = Crypto::sha256digestHex(manifest_str);
+  Utils::writeFile(update_dir / "manifests" / (manifest_digest + ".json"), manifest_str);
+
+  Json::Value save_manifest;
+  save_manifest[0]["Config"] = config_digest + ".json";
+  save_manifest[0]["RepoTags"].append(name + ":digest_sha256_" + manifest_digest);
+  save_manifest[0]["Layers"].append("layer/layer.tar");
+  writeTarball(update_dir / "images" / (manifest_digest + ".tar"),
+               {{"layer/VERSION", "1.0"},
+                {"layer/json", "{\"id\":\"layer\"}"},
+                {"layer/layer.tar", layer_data},
+                {config_digest + ".json", config_str},
+                {"manifest.json", Utils::jsonToCanonicalStr(save_manifest)}});
+
+  *reference = name + "@sha256:" + manifest_digest;
+  return config_digest;
+}
+
+/* Run the given program instead of the docker CLI while in scope. */
+class DockerProgramOverride {
+ public:
+  explicit DockerProgramOverride(const boost::filesystem::path &program)
+      : previous_(DockerTarballLoader::setDockerProgram(program.string())) {}
+  ~DockerProgramOverride() { DockerTarballLoader::setDockerProgram(previous_); }
+  DockerProgramOverride(const DockerProgramOverride &) = delete;
+  DockerProgramOverride &operator=(const DockerProgramOverride &) = delete;
+
+ private:
+  std::string previous_;
+};
+
+/* Sink that refuses any load after the given number of them. */
+class InterruptingSink : public DockerCountingSink {
+ public:
+  explicit InterruptingSink(int max_loads) : loads_left_(max_loads) {}
+  bool begin() override {
+    if (loads_left_ == 0) {
+      return false;
+    }
+    loads_left_--;
+    loads_++;
+    return DockerCountingSink::begin();
+  }
+  int loads() const { return loads_; }
+
+ private:
+  int loads_left_;
+  int loads_{0};
+};
+
+/*
+ * An interrupted installation is resumed without loading again the images
+ * already in the journal (and confirmed by the daemon); the journal is removed
+ * once all images are loaded.
+ */
+TEST(DockerLoader, OfflineLoaderJournal) {
+  TemporaryDirectory update_dir;
+  boost::filesystem::create_directories(update_dir / "images");
+  boost::filesystem::create_directories(update_dir / "manifests");
+  std::string app0, app1;
+  const std::string config0 = addOfflineImage(update_dir.Path(), "test/app0", std::string(3000, 'a'), &app0);
+  addOfflineImage(update_dir.Path(), "test/app1", std::string(2000, 'b'), &app1);
+  Utils::writeFile(update_dir / "docker-compose.yml",
+                   "version: '2.4'\nservices:\n  app0:\n    image: " + app0 + "\n  app1:\n    image: " + app1 + "\n");
+
+  // The daemon only knows about the first image.
+  const boost::filesystem::path docker = update_dir / "docker";
+  Utils::writeFile(docker, "#!/bin/sh\n[ \"$1\" = image ] && echo sha256:" + config0 + "\nexit 0\n");
+  boost::filesystem::permissions(docker, boost::filesystem::owner_all);
+  DockerProgramOverride docker_override(docker);
+
+  const boost::filesystem::path journal = update_dir / "offline-images.journal";
+  auto dmcache = std::make_shared<DockerManifestsCache>(update_dir / "manifests");
+  {
+    DockerComposeOfflineLoader dcloader(update_dir / "images", dmcache);
+    dcloader.loadCompose(update_dir / "docker-compose.yml", "");
+    dcloader.setJournal(journal);
+    auto sink = std::make_shared<InterruptingSink>(1);
+    dcloader.setLoadSink(sink);
+    EXPECT_THROW(dcloader.installImages(), std::runtime_error);
+    EXPECT_EQ(sink->loads(), 1);
+  }
+  ASSERT_TRUE(boost::filesystem::exists(journal));
+  EXPECT_FALSE(boost::filesystem::exists(journal.string() + ".tmp"));
+
+  {
+    DockerComposeOfflineLoader dcloader(update_dir / "images", dmcache);
+    dcloader.loadCompose(update_dir / "docker-compose.yml", "");
+    dcloader.setJournal(journal);
+    auto sink = std::make_shared<InterruptingSink>(2);
+    dcloader.setLoadSink(sink);
+    EXPECT_NO_THROW(dcloader.installImages());
+    // Only the second image is loaded again.
+    EXPECT_EQ(sink->loads(), 1);
+    EXPECT_TRUE(sink->committed());
+  }
+  EXPECT_FALSE(boost::filesystem::exists(journal));
+}
+
+/* Compress a file with a libarchive filter (e.g. archive_write_add_filter_gzip). */
+static void compressFile(const boost::filesystem::path &src, const boost::filesystem::path &dst,
+                         int (*add_filter)(struct archive *)) {
+  const std::string data = Utils::readFile(src);
+  struct archive *arch = archive_write_new();
+  add_filter(arch);
+  archive_write_set_format_raw(arch);
+  ASSERT_EQ(archive_write_open_filename(arch, dst.c_str()), ARCHIVE_OK);
+  struct archive_entry *entry = archive_entry_new();
+  archive_entry_set_pathname(entry, "data");
+  archive_entry_set_filetype(entry, AE_IFREG);
+  archive_entry_set_size(entry, static_cast<int64_t>(data.size()));
+  archive_write_header(arch, entry);
+  archive_write_data(arch, data.data(), data.size());
+  archive_entry_free(entry);
+  archive_write_close(arch);
+  archive_write_free(arch);
+}
+
+/*
+ * Offline updates can have gzip or zstd compressed tarballs: they are checked
+ * and sent uncompressed to Docker, reading ahead in another thread or not.
+ */
+TEST(DockerLoader, CompressedTarballs) {
+  const std::vector<std::pair<std::string, int (*)(struct archive *)>> formats{
+      {".tar.gz", archive_write_add_filter_gzip}, {".tar.zst", archive_write_add_filter_zstd}};
+  for (const auto &format : formats) {
+    TemporaryDirectory update_dir;
+    boost::filesystem::create_directories(update_dir / "images");
+    boost::filesystem::create_directories(update_dir / "manifests");
+    std::string app;
+    // Half random, so that the compressed tarball spans several reads.
+    std::string layer_data(2 * 1024 * 1024, '\0');
+    uint32_t seed = 1;
+    for (size_t idx = 0; idx < layer_data.size() / 2; idx++) {
+      seed = seed * 1103515245U + 12345U;
+      layer_data[idx] = static_cast<char>(seed >> 16);
+    }
+    const std::string config = addOfflineImage(update_dir.Path(), "test/app", layer_data, &app);
+    const std::string man_digest = app.substr(app.find("@sha256:") + 8);
+    const boost::filesystem::path tarball = update_dir / "images" / (man_digest + ".tar");
+    const boost::filesystem::path compressed = update_dir / "images" / (man_digest + format.first);
+    compressFile(tarball, compressed, format.second);
+    const uint64_t tarball_size = boost::filesystem::file_size(tarball);
+    boost::filesystem::remove(tarball);
+    ASSERT_LT(boost::filesystem::file_size(compressed), tarball_size);
+
+    for (unsigned threads : {1U, 4U}) {
+      DockerTarballLoader loader(compressed);
+      loader.setHashThreads(threads);
+      loader.loadMetadata();
+      DockerTarballLoader::StringToStringSet expected;
+      expected[config].insert("test/app:digest_sha256_" + man_digest);
+      EXPECT_TRUE(loader.validateMetadata(&expected));
+      EXPECT_EQ(loader.getContentLength(), tarball_size);
+      DockerCountingSink sink;
+      EXPECT_TRUE(loader.loadImages(sink));
+      EXPECT_EQ(sink.bytes(), tarball_size);
+      EXPECT_TRUE(sink.committed());
+    }
+
+    // The compressed tarball is found by the loader of the compose file.
+    Utils::writeFile(update_dir / "docker-compose.yml",
+                     "version: '2.4'\nservices:\n  app:\n    image: " + app + "\n");
+    auto dmcache = std::make_shared<DockerManifestsCache>(update_dir / "manifests");
+    DockerComposeOfflineLoader dcloader(update_dir / "images", dmcache);
+    dcloader.loadCompose(update_dir / "docker-compose.yml", "");
+    auto sink = std::make_shared<DockerCountingSink>();
+    dcloader.setLoadSink(sink);
+    EXPECT_NO_THROW(dcloader.installImages());
+    EXPECT_EQ(sink->bytes(), tarball_size);
+
+    // Modifications of the compressed data are detected.
+    std::string data = Utils::readFile(compressed);
+    DockerTarballLoader loader(compressed);
+    loader.setHashThreads(4);
+    loader.loadMetadata();
+    data[data.size() / 2] = static_cast<char>(data[data.size() / 2] ^ 1);
+    Utils::writeFile(compressed, data);
+    DockerCountingSink corrupt_sink;
+    EXPECT_FALSE(loader.loadImages(corrupt_sink));
+  }
+}
+
+/*
+ * Compressed layers of OCI layouts are only accepted when the manifest listing
+ * them is the expected one.
+ */
+TEST(DockerLoader, OciCompressedLayers) {
+  TemporaryDirectory temp_dir;
+  Utils::writeFile(temp_dir / "layer.tar", std::string(4096, 'l'));
+  compressFile(temp_dir / "layer.tar", temp_dir / "layer.tar.gz", archive_write_add_filter_gzip);
+  const std::string layer = Utils::readFile(temp_dir / "layer.tar");
+  const std::string layer_gz = Utils::readFile(temp_dir / "layer.tar.gz");
+
+  Json::Value config;
+  config["architecture"] = "arm64";
+  config["os"] = "linux";
+  config["rootfs"]["type"] = "layers";
+  config["rootfs"]["diff_ids"].append("sha256:" + Crypto::sha256digestHex(layer));
+  const std::string config_str = Utils::jsonToCanonicalStr(config);
+  const std::string config_digest = Crypto::sha256digestHex(config_str);
+
+  Json::Value manifest;
+  manifest["schemaVersion"] = 2;
+  manifest["mediaType"] = "application/vnd.oci.image.manifest.v1+json";
+  manifest["config"]["mediaType"] = "application/vnd.oci.image.config.v1+json";
+  manifest["config"]["digest"] = "sha256:" + config_digest;
+  manifest["layers"][0]["mediaType"] = "application/vnd.oci.image.layer.v1.tar+gzip";
+  manifest["layers"][0]["digest"] = "sha256:" + Crypto::sha256digestHex(layer_gz);
+  const std::string manifest_str = Utils::jsonToCanonicalStr(manifest);
+  const std::string manifest_digest = Crypto::sha256digestHex(manifest_str);
+
+  Json::Value index;
+  index["schemaVersion"] = 2;
+  index["manifests"][0]["mediaType"] = manifest["mediaType"];
+  index["manifests"][0]["digest"] = "sha256:" + manifest_digest;
+  index["manifests"][0]["annotations"]["io.containerd.image.name"] = "docker.io/test/app:1";
+  const boost::filesystem::path tarball = temp_dir / "image.tar";
+  writeTarball(tarball, {{"oci-layout", "{\"imageLayoutVersion\":\"1.0.0\"}"},
+                         {"index.json", Utils::jsonToCanonicalStr(index)},
+                         {"blobs/sha256/" + manifest_digest, manifest_str},
+                         {"blobs/sha256/" + config_digest, config_str},
+                         {"blobs/sha256/" + Crypto::sha256digestHex(layer_gz), layer_gz}});
+
+  DockerTarballLoader loader(tarball);
+  loader.loadMetadata();
+  EXPECT_TRUE(loader.validateMetadata());
+  DockerTarballLoader::StringToStringSet expected;
+  expected[config_digest].insert("test/app:1");
+  DockerTarballLoader::StringToString expected_manifests;
+  EXPECT_FALSE(loader.validateMetadata(&expected));
+  expected_manifests[config_digest] = std::string(64, '0');
+  EXPECT_FALSE(loader.validateMetadata(&expected, &expected_manifests));
+  expected_manifests[config_digest] = manifest_digest;
+  EXPECT_TRUE(loader.validateMetadata(&expected, &expected_manifests));
+}
+
+/* Files that cannot be stored (e.g. duplicates) are rejected, with or without read-ahead. */
+TEST(DockerLoader, TarballDuplicateFiles) {
+  TemporaryDirectory temp_dir;
+  const boost::filesystem::path tarball = temp_dir / "image.tar";
+  for (const char *name : {"manifest.json", "layer/layer.tar"}) {
+    writeTarball(tarball, {{"layer/layer.tar", "layer data"}, {"manifest.json", "[]"}, {name, "[{}]"}});
+    for (unsigned threads : {1U, 4U}) {
+      DockerTarballLoader loader(tarball);
+      loader.setHashThreads(threads);
+      EXPECT_THROW(loader.loadMetadata(), std::runtime_error) << name << ", threads=" << threads;
+    }
+  }
+}
+
+/*
+ * Images of a manifest list are selected for the requested platform or, when
+ * there is none and the platform is the default one, for the first compatible
+ * platform having one.
+ */
+TEST(DockerLoader, PlatformSelection) {
+  Json::Value list;
+  list["mediaType"] = "application/vnd.docker.distribution.manifest.list.v2+json";
+  const std::vector<std::pair<std::string, std::string>> platforms = {{"amd64", ""}, {"arm", "v7"}, {"arm", "v6"}};
+  for (const auto &plat : platforms) {
+    Json::Value entry;
+    entry["digest"] = "sha256:" + plat.first + plat.second;
+    entry["platform"]["os"] = "linux";
+    entry["platform"]["architecture"] = plat.first;
+    if (!plat.second.empty()) {
+      entry["platform"]["variant"] = plat.second;
+    }
+    list["manifests"].append(entry);
+  }
+  DockerManifestWrapper wrapper(list);
+
+  std::string platform, digest;
+  wrapper.findBestPlatform("linux/amd64", &platform, &digest);
+  EXPECT_EQ(digest, "sha256:amd64");
+  wrapper.findBestPlatform("linux/arm/v6", &platform, &digest);
+  EXPECT_EQ(platform, "linux/arm/v6");
+  wrapper.findBestPlatform("linux/arm64", &platform, &digest, true);
+  EXPECT_EQ(platform, "linux/arm/v7");
+  // An explicitly requested platform gets no fallback.
+  EXPECT_THROW(wrapper.findBestPlatform("linux/arm64", &platform, &digest), std::runtime_error);
+  EXPECT_THROW(wrapper.findBestPlatform("linux/arm", &platform, &digest, true), std::runtime_error);
+  EXPECT_THROW(wrapper.findBestPlatform("linux/386", &platform, &digest, true), std::runtime_error);
+
+  EXPECT_TRUE(platformMatches("linux/arm/", "linux/arm/v7"));
+  EXPECT_FALSE(platformMatches("linux/arm/v5", "linux/arm/v6"));
+}
+
+/*
+ * OCI image indexes and manifests are accepted, with or without a media type.
+ */
+TEST(DockerLoader, OciManifests) {
+  Json::Value index;
+  Json::Value entry;
+  entry["digest"] = "sha256:arm64";
+  entry["platform"]["os"] = "linux";
+  entry["platform"]["architecture"] = "arm64";
+  index["manifests"].append(entry);
+  // Entries without a platform (e.g. attestations) are ignored.
+  entry.removeMember("platform");
+  entry["digest"] = "sha256:attestation";
+  index["manifests"].append(entry);
+
+  DockerManifestWrapper index_wrapper(index);
+  EXPECT_TRUE(index_wrapper.isMultiPlatform());
+  std::string platform, digest;
+  index_wrapper.findBestPlatform("linux/arm64/v8", &platform, &digest);
+  EXPECT_EQ(digest, "sha256:arm64");
+
+  Json::Value manifest;
+  manifest["mediaType"] = "application/vnd.oci.image.manifest.v1+json";
+  manifest["config"]["digest"] = "sha256:config";
+  manifest["layers"][0]["digest"] = "sha256:layer";
+  DockerManifestWrapper manifest_wrapper(manifest);
+  EXPECT_FALSE(manifest_wrapper.isMultiPlatform());
+  EXPECT_EQ(manifest_wrapper.getConfigDigest(true), "config");
+  EXPECT_EQ(manifest_wrapper.getLayers().size(), 1U);
+
+  manifest["mediaType"] = "application/vnd.oci.image.config.v1+json";
+  EXPECT_THROW(DockerManifestWrapper wrapper(manifest), std::runtime_error);
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+
+  logger_init();
+  logger_set_threshold(boost::log::trivial::trace);
+
+  return RUN_ALL_TESTS();
+}
+#endif
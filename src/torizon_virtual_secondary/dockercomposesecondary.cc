@@ -3,6 +3,8 @@
 
 #include "dockercomposesecondary.h"
 #include "dockerofflineloader.h"
+#include "dockerstorageplanner.h"
+#include "updatetrace.h"
 #include "uptane/manifest.h"
 #include "libaktualizr/types.h"
 #include "logging/logging.h"
@@ -19,6 +21,9 @@ namespace Primary {
 
 const char* const DockerComposeSecondaryConfig::Type = "docker-compose";
 
+// Timing trace of the last offline update (in the client directory).
+static const char* const OFFLINE_TRACE_FILE = "offline-update.trace.json";
+
 DockerComposeSecondaryConfig::DockerComposeSecondaryConfig(const Json::Value& json_config) : ManagedSecondaryConfig(Type) {
   partial_verifying = json_config["partial_verifying"].asBool();
   ecu_serial = json_config["ecu_serial"].asString();
@@ -29,6 +34,10 @@ DockerComposeSecondaryConfig::DockerComposeSecondaryConfig(const Json::Value& js
   firmware_path = json_config["firmware_path"].asString();
   target_name_path = json_config["target_name_path"].asString();
   metadata_path = json_config["metadata_path"].asString();
+  if (json_config.isMember(KeyTypeField)) {
+    key_type = keyTypeFromString(json_config[KeyTypeField].asString());
+  }
+  prune_unused_images = json_config[PruneImagesField].asBool();
 }
 
 std::vector<DockerComposeSecondaryConfig> DockerComposeSecondaryConfig::create_from_file(
@@ -59,6 +68,8 @@ void DockerComposeSecondaryConfig::dump(const boost::filesystem::path& file_full
   json_config["firmware_path"] = firmware_path.string();
   json_config["target_name_path"] = target_name_path.string();
   json_config["metadata_path"] = metadata_path.string();
+  json_config[KeyTypeField] = keyTypeToString(key_type);
+  json_config[PruneImagesField] = prune_unused_images;
 
   Json::Value root;
   root[Type].append(json_config);
@@ -75,6 +86,10 @@ void DockerComposeSecondaryConfig::dump(const boost::filesystem::path& file_full
 
 DockerComposeSecondary::DockerComposeSecondary(Primary::DockerComposeSecondaryConfig sconfig_in)
     : ManagedSecondary(std::move(sconfig_in)) {
+  // Checking pending installations needs the ECU serial, so this waits for
+  // the keys of a new ECU. Secondaries are constructed in parallel (see
+  // initSecondaries()), so the others are not delayed.
+  waitForKeys();
   validateInstall();
 }
 
@@ -117,27 +132,37 @@ data::InstallationResult DockerComposeSecondary::install(const Uptane::Target &t
 
   if (info.getUpdateType() == UpdateType::kOnline) {
     // Run online update method.
-    update_status = compose.update(false, sync_update);
+    if (checkPullStorage(compose_new)) {
+      update_status = compose.update(false, sync_update);
+    } else {
+      compose.sync_update = sync_update;
+    }
 
   } else if (info.getUpdateType() == UpdateType::kOffline) {
     auto img_path = info.getImagesPathOffline() / (target.sha256Hash() + ".images");
     auto man_path = info.getMetadataPathOffline() / "docker" / (target.sha256Hash() + ".manifests");
     boost::filesystem::path compose_out;
 
-    if (loadDockerImages(compose_new, target.sha256Hash(), img_path, man_path, &compose_out)) {
-      // Docker images loaded and an "offline" version of compose-file available.
-      // Overwrite the new compose file with that "offline" version.
-      boost::filesystem::rename(compose_out, compose_new);
-
-      update_status = compose.update(true, sync_update);
-    } else {
-      compose.sync_update = sync_update;
+    {
+      UpdateTrace::Recording recording(sconfig.full_client_dir / OFFLINE_TRACE_FILE);
+      UpdateTrace::Scope trace("offline update", target.filename());
+      if (loadDockerImages(compose_new, target.sha256Hash(), img_path, man_path, &compose_out)) {
+        // Docker images loaded and an "offline" version of compose-file available.
+        // Overwrite the new compose file with that "offline" version.
+        boost::filesystem::rename(compose_out, compose_new);
+
+        UpdateTrace::Scope up_trace("docker-compose up");
+        update_status = compose.update(true, sync_update);
+      } else {
+        compose.sync_update = sync_update;
+      }
     }
 
   } else {
     return data::InstallationResult(data::ResultCode::Numeric::kInstallFailed, "Unknown update type");
   }
 
+  invalidateManifest();
   if (update_status == true) {
     Utils::writeFile(sconfig.target_name_path, target.filename());
     if (sync_update) {
@@ -165,6 +190,8 @@ bool DockerComposeSecondary::loadDockerImages(const boost::filesystem::path &com
     auto dmcache = std::make_shared<DockerManifestsCache>(manifests_path);
 
     DockerComposeOfflineLoader dcloader(images_path, dmcache);
+    dcloader.setJournal(sconfig.full_client_dir / "offline-images.journal");
+    dcloader.setPruneUnusedImages(sconfig.prune_unused_images);
     dcloader.loadCompose(compose_in, compose_sha256);
     dcloader.dumpReferencedImages();
     dcloader.dumpImageMapping();
@@ -183,6 +210,31 @@ bool DockerComposeSecondary::loadDockerImages(const boost::filesystem::path &com
   return true;
 }
 
+bool DockerComposeSecondary::checkPullStorage(const boost::filesystem::path &compose) {
+  DockerComposeFile compose_file(compose);
+  StringToImagePlatformPair services;
+  if (!compose_file.good() || !compose_file.getServices(services, false)) {
+    LOG_WARNING << "Cannot determine images in " << compose << ": skipping storage check";
+    return true;
+  }
+
+  try {
+    DockerStoragePlanner planner;
+    for (auto &service : services) {
+      if (!planner.addRegistryImage(service.second.getImage(), service.second.getPlatform())) {
+        // Registry unreachable or unknown manifest: let the pull report it.
+        LOG_WARNING << "Skipping storage check of container update";
+        return true;
+      }
+    }
+    return planner.ensureCapacity(sconfig.prune_unused_images);
+
+  } catch (std::runtime_error &exc) {
+    LOG_WARNING << "Storage check of container update failed: " << exc.what();
+    return true;
+  }
+}
+
 bool DockerComposeSecondary::pendingPrimaryUpdate() {
   // TODO: Consider adding a method to perform this check as part of the `SecondaryProvider` in libaktualizr.
   // See https://gitlab.int.toradex.com/rd/torizon-core/aktualizr-torizon/-/merge_requests/7#note_70289
@@ -49,6 +49,13 @@ class DockerComposeSecondary : public ManagedSecondary {
                         boost::filesystem::path *compose_out = nullptr);
   bool pendingPrimaryUpdate();
 
+  /**
+   * Check that the images of a docker-compose file can be pulled without
+   * filling up Docker's storage (removing unused images if needed and allowed
+   * by the configuration).
+   */
+  bool checkPullStorage(const boost::filesystem::path &compose);
+
 };
 
 }  // namespace Primary
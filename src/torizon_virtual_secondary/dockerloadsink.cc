@@ -0,0 +1,108 @@
+#include "dockerloadsink.h"
+#include "logging/logging.h"
+
+#include <boost/process.hpp>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <vector>
+
+namespace bp = boost::process;
+
+bool DockerLoadSink::writeAll(int fd, const struct iovec *iov, int iovcnt) {
+  std::vector<struct iovec> pending(iov, iov + iovcnt);
+  size_t first = 0;
+  while (first < pending.size()) {
+    ssize_t count = ::writev(fd, &pending[first], static_cast<int>(std::min<size_t>(pending.size() - first, IOV_MAX)));
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    // Skip the buffers fully written and adjust the partially written one.
+    auto written = static_cast<size_t>(count);
+    while (first < pending.size() && written >= pending[first].iov_len) {
+      written -= pending[first].iov_len;
+      first++;
+    }
+    if (written > 0) {
+      pending[first].iov_base = static_cast<uint8_t *>(pending[first].iov_base) + written;
+      pending[first].iov_len -= written;
+    }
+  }
+  return true;
+}
+
+// ---
+// DockerProcessSink
+// ---
+
+struct DockerProcessSink::Process {
+  bp::pipe stdin_pipe;
+  bp::child child;
+};
+
+DockerProcessSink::DockerProcessSink(const std::string &program) : program_(program) {}
+
+DockerProcessSink::~DockerProcessSink() {
+  if (proc_) {
+    finish(false);
+  }
+}
+
+bool DockerProcessSink::begin() {
+  proc_ = std::make_unique<Process>();
+  std::error_code errcode;
+  proc_->child = bp::child(program_, "load", bp::std_in < proc_->stdin_pipe, errcode);
+  if (errcode) {
+    LOG_WARNING << "Could not run " << program_ << ": " << errcode.message();
+    proc_.reset();
+    return false;
+  }
+  return true;
+}
+
+bool DockerProcessSink::write(const struct iovec *iov, int iovcnt) {
+  return proc_ && writeAll(proc_->stdin_pipe.native_sink(), iov, iovcnt);
+}
+
+bool DockerProcessSink::finish(bool commit) {
+  if (! proc_) {
+    return false;
+  }
+  // Closing the pipe ends the input of `docker load` (possibly truncated).
+  proc_->stdin_pipe.close();
+  proc_->child.wait();
+  const int exit_code = proc_->child.exit_code();
+  proc_.reset();
+
+  LOG_DEBUG << program_ << " load exited with code " << exit_code;
+  return commit && (exit_code == 0);
+}
+
+// ---
+// DockerCountingSink
+// ---
+
+bool DockerCountingSink::begin() {
+  bytes_ = 0;
+  writes_ = 0;
+  committed_ = false;
+  return true;
+}
+
+bool DockerCountingSink::write(const struct iovec *iov, int iovcnt) {
+  for (int idx = 0; idx < iovcnt; idx++) {
+    bytes_ += iov[idx].iov_len;
+  }
+  writes_++;
+  return true;
+}
+
+bool DockerCountingSink::finish(bool commit) {
+  committed_ = commit;
+  return commit;
+}
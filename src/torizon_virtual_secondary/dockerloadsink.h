@@ -0,0 +1,97 @@
+#ifndef SECONDARY_DOCKERLOADSINK_H_
+#define SECONDARY_DOCKERLOADSINK_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct iovec;
+
+/**
+ * Destination of the contents of a `docker save` tarball being loaded by
+ * DockerTarballLoader::loadImages(). A sink can be used for several loads,
+ * each one being a call to begin(), any number of calls to write() and a
+ * call to finish().
+ */
+class DockerLoadSink {
+  public:
+    virtual ~DockerLoadSink() = default;
+
+    /**
+     * Start loading a new tarball.
+     *
+     * @return true iff the consumer is ready to receive data.
+     */
+    virtual bool begin() = 0;
+
+    /**
+     * Send all the data in the passed buffers to the consumer; this blocks
+     * while the consumer is not ready to take more data (backpressure).
+     *
+     * @return false if the consumer failed (no more data should be sent).
+     */
+    virtual bool write(const struct iovec *iov, int iovcnt) = 0;
+
+    /**
+     * Finish loading the tarball.
+     *
+     * @param commit if false, the stream is truncated at the current point so
+     *  that the consumer discards it.
+     * @return true iff the data was committed and the consumer succeeded.
+     */
+    virtual bool finish(bool commit) = 0;
+
+    /**
+     * Describe the sink (for logging).
+     */
+    virtual std::string describe() const = 0;
+
+  protected:
+    /**
+     * Write all the data in the buffers to a file descriptor, handling
+     * partial writes.
+     */
+    static bool writeAll(int fd, const struct iovec *iov, int iovcnt);
+};
+
+/**
+ * Sink running `docker load` and writing to its standard input.
+ */
+class DockerProcessSink : public DockerLoadSink {
+  public:
+    explicit DockerProcessSink(const std::string &program);
+    ~DockerProcessSink() override;
+
+    bool begin() override;
+    bool write(const struct iovec *iov, int iovcnt) override;
+    bool finish(bool commit) override;
+    std::string describe() const override { return program_ + " load"; }
+
+  protected:
+    struct Process;
+    std::string program_;
+    std::unique_ptr<Process> proc_;
+};
+
+/**
+ * Sink that only counts the data sent to it, for tests and for measuring the
+ * throughput of the tarball verification alone.
+ */
+class DockerCountingSink : public DockerLoadSink {
+  public:
+    bool begin() override;
+    bool write(const struct iovec *iov, int iovcnt) override;
+    bool finish(bool commit) override;
+    std::string describe() const override { return "counting sink"; }
+
+    uint64_t bytes() const { return bytes_; }
+    uint64_t writes() const { return writes_; }
+    bool committed() const { return committed_; }
+
+  protected:
+    uint64_t bytes_{0};
+    uint64_t writes_{0};
+    bool committed_{false};
+};
+
+#endif /* SECONDARY_DOCKERLOADSINK_H_ */
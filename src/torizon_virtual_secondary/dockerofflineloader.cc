@@ -1,5 +1,8 @@
 #include "dockerofflineloader.h"
 #include "dockertarballloader.h"
+#include "dockerstorageplanner.h"
+#include "updatetrace.h"
+#include "logguard.h"
 #include "crypto/crypto.h"
 #include "logging/logging.h"
 #include "utilities/utils.h"
@@ -7,20 +10,35 @@
 #include <sys/utsname.h>
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <regex>
+#include <unordered_set>
 #include <vector>
 
 #include <fcntl.h>
-#include <boost/algorithm/string/split.hpp>
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
 #include <boost/filesystem/path.hpp>
 
 static const std::string SHA256_PREFIX = "sha256:";
 static const std::string JSON_EXT = ".json";
 static const std::string TAR_EXT = ".tar";
+// Extensions of image tarballs in order of preference (the compression is
+// actually detected from the contents).
+static const std::vector<std::string> TARBALL_EXTS = {".tar.zst", ".tar.gz", TAR_EXT};
 
 // Maximum size of a manifest file.
 static constexpr std::size_t MAX_MANIFEST_FILE_SIZE_BYTES = 256 * 1024;
@@ -52,6 +70,7 @@ static void ensure(bool cond, const char *message) {
 bool loadManifest(
     const std::string &req_digest,
     const boost::filesystem::path manifests_dir, Json::Value &target) {
+  UpdateTrace::Scope trace("manifest load", req_digest);
 
   // Open manifest file and check its size.
   const boost::filesystem::path fname(manifests_dir / (req_digest + JSON_EXT));
@@ -70,17 +89,15 @@ bool loadManifest(
     return false;
   }
 
-  // Load manifest file into memory.
-  typedef std::vector<uint8_t> ManifestBufferType;
-  auto buffer = std::make_unique<ManifestBufferType>(orglen + 1);
-
-  input.read(reinterpret_cast<char *>(buffer->data()), buffer->size());
-  const uintmax_t len = input.gcount();
+  // Load manifest file into memory (one byte more to detect growth).
+  std::vector<char> buffer(orglen + 1);
+  input.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+  const uintmax_t len = static_cast<uintmax_t>(input.gcount());
   ensure(len == orglen, "Manifest file changed size");
 
   // Determine the file's digest and make sure it's correct.
   MultiPartSHA256Hasher hasher;
-  hasher.update(buffer->data(), static_cast<uint64_t>(len));
+  hasher.update(reinterpret_cast<const unsigned char *>(buffer.data()), static_cast<uint64_t>(len));
   std::string real_digest = boost::algorithm::to_lower_copy(hasher.getHexDigest());
 
   if (req_digest != real_digest) {
@@ -88,13 +105,10 @@ bool loadManifest(
     return false;
   }
 
-  // Encapsulate data into stream.
-  std::string _source(reinterpret_cast<char *>(buffer->data()), len);
-  std::istringstream source(std::move(_source));
-  // Parse contents.
-  Json::CharReaderBuilder builder;
+  // Parse contents (in place).
+  std::unique_ptr<Json::CharReader> reader(Json::CharReaderBuilder().newCharReader());
   Json::String errs;
-  bool status = Json::parseFromStream(builder, source, &target, &errs);
+  bool status = reader->parse(buffer.data(), buffer.data() + len, &target, &errs);
   if (! status) {
     LOG_WARNING << "Parsing failed for manifest " << fname;
     return false;
@@ -103,34 +117,52 @@ bool loadManifest(
   return true;
 }
 
-bool platformMatches(
-    const std::string plat1, const std::string plat2, unsigned *grade) {
-
-  // TODO: Determine if there are defined rules for how to compare platforms.
-  //       e.g. can we say that linux/arm/v7 encompasses linux/arm/v6?
-
-  std::string _plat1 = plat1;
-  std::string _plat2 = plat2;
+// ---
+// DockerPlatform class
+// ---
 
+DockerPlatform::DockerPlatform(const std::string &spec) : parts_(), nparts_(0) {
   // Remove slash at the end (if any).
-  if (boost::ends_with(_plat1, "/")) {
-    _plat1.erase(_plat1.size() - 1);
+  size_t end = spec.size();
+  if (end > 0 && spec[end - 1] == '/') {
+    end--;
   }
-  if (boost::ends_with(_plat2, "/")) {
-    _plat2.erase(_plat2.size() - 1);
+
+  size_t pos = 0;
+  while (true) {
+    size_t next = spec.find('/', pos);
+    if (next >= end || nparts_ == MAX_PARTS - 1) {
+      next = end;
+    }
+    parts_[nparts_++] = intern(spec.substr(pos, next - pos));
+    if (next == end) {
+      break;
+    }
+    pos = next + 1;
   }
+}
+
+DockerPlatform DockerPlatform::fromJson(const Json::Value &plat) {
+  ensure(plat.isMember("os") && plat.isMember("architecture"),
+         "Bad platform spec in manifest");
 
-  std::list<std::string> plat1_lst;
-  std::list<std::string> plat2_lst;
-  boost::split(plat1_lst, _plat1, std::bind1st(std::equal_to<char>(), '/'));
-  boost::split(plat2_lst, _plat2, std::bind1st(std::equal_to<char>(), '/'));
+  // Components are positional, as in the string form: the os.version takes
+  // the place of the variant when the latter is not set.
+  DockerPlatform platform;
+  for (const char *field : {"os", "architecture", "variant", "os.version"}) {
+    if (plat.isMember(field)) {
+      platform.parts_[platform.nparts_++] = intern(plat[field].asString());
+    }
+  }
+  return platform;
+}
 
+bool DockerPlatform::matches(const DockerPlatform &other, unsigned *grade) const {
   bool match = true;
   unsigned _grade = 0;
 
-  for (auto it1=plat1_lst.begin(), it2=plat2_lst.begin(); ; it1++, it2++) {
-    if (it1 == plat1_lst.end() || it2 == plat2_lst.end()) break;
-    if (*it1 != *it2) {
+  for (unsigned idx = 0; idx < nparts_ && idx < other.nparts_; idx++) {
+    if (parts_[idx] != other.parts_[idx]) {
       match = false;
       break;
     }
@@ -140,11 +172,58 @@ bool platformMatches(
   if (grade) {
     *grade = _grade;
   }
+  return match;
+}
 
-  // LOG_INFO << "platformMatches(\"" << plat1 << "\", \"" << plat2 << "\")"
-  //          << " = " << match << ", grade: " << _grade;
+std::vector<DockerPlatform> DockerPlatform::getFallbacks() const {
+  // See platforms.Only() in containerd.
+  static const std::map<std::string, std::vector<std::string>> fallbacks = {
+    {"linux/amd64", {"linux/386"}},
+    {"linux/arm64", {"linux/arm/v8", "linux/arm/v7", "linux/arm/v6", "linux/arm/v5"}},
+    {"linux/arm64/v8", {"linux/arm/v8", "linux/arm/v7", "linux/arm/v6", "linux/arm/v5"}},
+    {"linux/arm/v8", {"linux/arm/v7", "linux/arm/v6", "linux/arm/v5"}},
+    {"linux/arm/v7", {"linux/arm/v6", "linux/arm/v5"}},
+    {"linux/arm/v6", {"linux/arm/v5"}},
+  };
 
-  return match;
+  std::vector<DockerPlatform> result;
+  auto it = fallbacks.find(toString());
+  if (it != fallbacks.end()) {
+    for (const auto &plat : it->second) {
+      result.emplace_back(plat);
+    }
+  }
+  return result;
+}
+
+std::string DockerPlatform::toString() const {
+  std::string spec;
+  for (unsigned idx = 0; idx < nparts_; idx++) {
+    if (idx > 0) {
+      spec += "/";
+    }
+    spec += *parts_[idx];
+  }
+  return spec;
+}
+
+const std::string *DockerPlatform::intern(const std::string &part) {
+  // Elements of an unordered_set are never moved, so their addresses can be
+  // used as identifiers for the lifetime of the program.
+  static std::mutex mutex;
+  static std::unordered_set<std::string> pool;
+  std::lock_guard<std::mutex> guard(mutex);
+  return &*pool.insert(part).first;
+}
+
+bool platformMatches(
+    const std::string &plat1, const std::string &plat2, unsigned *grade) {
+
+  // TODO: Determine if there are defined rules for how to compare platforms.
+  //       e.g. can we say that linux/arm/v7 encompasses linux/arm/v6?
+  //       (For now, that is only done through DockerPlatform::getFallbacks().)
+
+  return DockerPlatform(plat1).matches(DockerPlatform(plat2), grade);
 }
 
 std::string getDockerPlatform() {
@@ -224,8 +303,8 @@ static const std::string &na_if_empty(const std::string &str) {
  * Replacement for `TemporaryDirectory` in libaktualizr that uses /var/tmp/ as
  * preferred directory for storing temporary files.
  *
- * TODO: In TorizonCore using /var/tmp/ does not solve the problem since
- *       even that directory is a tmpfs.
+ * NOTE: In TorizonCore /var/tmp/ is a tmpfs; see `snapshotTarball()` for how
+ *       large files are kept out of it.
  * TODO: Move to a specific module.
  */
 class LargeTemporaryDirectory {
@@ -274,103 +353,145 @@ const std::string DockerManifestWrapper::MEDIA_TYPE::SINGLE_PLAT =
     "application/vnd.docker.distribution.manifest.v2+json";
 const std::string DockerManifestWrapper::MEDIA_TYPE::MULTI_PLAT =
     "application/vnd.docker.distribution.manifest.list.v2+json";
+const std::string DockerManifestWrapper::MEDIA_TYPE::OCI_MANIFEST =
+    "application/vnd.oci.image.manifest.v1+json";
+const std::string DockerManifestWrapper::MEDIA_TYPE::OCI_INDEX =
+    "application/vnd.oci.image.index.v1+json";
 
 DockerManifestWrapper::DockerManifestWrapper(const Json::Value &manifest)
-  : manifest_(manifest)
+  : manifest_(manifest), multi_platform_(decodeMediaType(manifest)),
+    platforms_parsed_(false)
 {
-  // Ensure this is a media type we understand.
-  const std::string media_type = getMediaType();
-  ensure((media_type == MEDIA_TYPE::SINGLE_PLAT) ||
-         (media_type == MEDIA_TYPE::MULTI_PLAT), "Bad manifest type");
-}
-
-bool DockerManifestWrapper::isMultiPlatform() const {
-  return getMediaType() == MEDIA_TYPE::MULTI_PLAT;
 }
 
-void DockerManifestWrapper::findBestPlatform(
-    std::string req_platform,
-    std::string *sel_platform, std::string *sel_digest) const {
-  ensureMediaType(MEDIA_TYPE::MULTI_PLAT);
-
-  struct ManInfo {
-    unsigned grade_;
-    std::string digest_;
-    std::string platform_;
-    ManInfo(unsigned grade,
-            const std::string &digest, const std::string platform)
-      : grade_(grade), digest_(digest), platform_(platform) {}
-  };
-
-  // Go over all manifests in the manifest list.
-  std::vector<ManInfo> grade_digest_pairs;
-  for (auto man : manifest_["manifests"]) {
-    std::string man_platform = platformString(man["platform"]);
-    unsigned grade;
-    if (platformMatches(req_platform, man_platform, &grade)) {
-      const ManInfo info(grade, man["digest"].asString(), man_platform);
-      grade_digest_pairs.push_back(info);
-    }
+/**
+ * Determine the kind of a manifest, ensuring it is a media type we
+ * understand.
+ *
+ * @return true for manifest lists and image indexes.
+ */
+bool DockerManifestWrapper::decodeMediaType(const Json::Value &manifest) {
+  ensure(manifest.isObject(), "Undefined manifest type");
+
+  std::string media_type;
+  if (manifest.isMember("mediaType")) {
+    media_type = manifest["mediaType"].asString();
+  } else if (manifest.isMember("manifests")) {
+    media_type = MEDIA_TYPE::OCI_INDEX;
+  } else if (manifest.isMember("config") && manifest.isMember("layers")) {
+    media_type = MEDIA_TYPE::OCI_MANIFEST;
+  } else {
+    ensure(false, "Undefined manifest type");
   }
 
-  ensure(! grade_digest_pairs.empty(),
-         "There are no images appropriate for platform " + req_platform);
+  if ((media_type == MEDIA_TYPE::SINGLE_PLAT) ||
+      (media_type == MEDIA_TYPE::OCI_MANIFEST)) {
+    return false;
+  }
+  ensure((media_type == MEDIA_TYPE::MULTI_PLAT) ||
+         (media_type == MEDIA_TYPE::OCI_INDEX), "Bad manifest type");
+  return true;
+}
 
-  if (grade_digest_pairs.size() >= 2) {
-    // Sort in decreasing order of grades.
-    // LOG_DEBUG << "Sorting " << grade_digest_pairs.size() << " elements";
-    std::sort(
-        grade_digest_pairs.begin(), grade_digest_pairs.end(),
-        [](const ManInfo &a, const ManInfo &b) { return a.grade_ > b.grade_; });
-    ensure(grade_digest_pairs[0].grade_ > grade_digest_pairs[1].grade_,
-           "There are multiple images appropriate for platform " + req_platform);
+void DockerManifestWrapper::findBestPlatform(
+    const std::string &req_platform,
+    std::string *sel_platform, std::string *sel_digest,
+    bool use_fallbacks) const {
+  ensureMultiPlatform(true);
+
+  const auto key = std::make_pair(req_platform, use_fallbacks);
+  auto sel = selections_.find(key);
+  if (sel == selections_.end()) {
+    sel = selections_.emplace(key, selectPlatform(req_platform, use_fallbacks)).first;
   }
 
+  const PlatformEntry &entry = getPlatforms()[sel->second];
   if (sel_platform) {
-    *sel_platform = grade_digest_pairs[0].platform_;
+    *sel_platform = entry.platform.toString();
   }
   if (sel_digest) {
-    *sel_digest = grade_digest_pairs[0].digest_;
+    *sel_digest = entry.digest;
   }
 }
 
-std::string DockerManifestWrapper::getConfigDigest(bool removePrefix) const {
-  ensureMediaType(MEDIA_TYPE::SINGLE_PLAT);
-  std::string digest = manifest_["config"]["digest"].asString();
-  if (removePrefix) {
-    digest = removeDigestPrefix(digest);
+const std::vector<DockerManifestWrapper::PlatformEntry> &DockerManifestWrapper::getPlatforms() const {
+  if (! platforms_parsed_) {
+    for (const auto &man : manifest_["manifests"]) {
+      // The platform is optional in OCI indexes (e.g. for attestations).
+      if (! man.isMember("platform")) {
+        continue;
+      }
+      platforms_.push_back(
+          PlatformEntry{DockerPlatform::fromJson(man["platform"]), man["digest"].asString()});
+    }
+    platforms_parsed_ = true;
   }
-  return digest;
+  return platforms_;
 }
 
-std::string DockerManifestWrapper::platformString(const Json::Value &plat) const {
-  ensure(plat.isMember("os") && plat.isMember("architecture"),
-         "Bad platform spec in manifest");
-
-  std::string platform = plat["os"].asString();
-  platform += "/";
-  platform += plat["architecture"].asString();
+size_t DockerManifestWrapper::selectPlatform(const std::string &req_platform, bool use_fallbacks) const {
+  const std::vector<PlatformEntry> &platforms = getPlatforms();
 
-  if (plat.isMember("variant")) {
-    platform += "/";
-    platform += plat["variant"].asString();
+  std::vector<DockerPlatform> candidates{DockerPlatform(req_platform)};
+  if (use_fallbacks) {
+    for (auto &fallback : candidates[0].getFallbacks()) {
+      candidates.push_back(fallback);
+    }
   }
 
-  if (plat.isMember("os.version")) {
-    platform += "/";
-    platform += plat["os.version"].asString();
+  // Take the image with the highest grade for the requested platform or, if
+  // there is none, for the first fallback platform having any.
+  for (const auto &candidate : candidates) {
+    size_t best = platforms.size();
+    unsigned best_grade = 0;
+    bool tie = false;
+    for (size_t idx = 0; idx < platforms.size(); idx++) {
+      unsigned grade;
+      if (! candidate.matches(platforms[idx].platform, &grade)) {
+        continue;
+      }
+      if (best == platforms.size() || grade > best_grade) {
+        best = idx;
+        best_grade = grade;
+        tie = false;
+      } else if (grade == best_grade) {
+        tie = true;
+      }
+    }
+
+    if (best != platforms.size()) {
+      ensure(! tie,
+             "There are multiple images appropriate for platform " + req_platform);
+      if (&candidate != &candidates[0]) {
+        LOG_INFO << "No image for platform " << req_platform
+                 << ": using compatible platform " << platforms[best].platform.toString();
+      }
+      return best;
+    }
   }
 
-  return platform;
+  ensure(false,
+         "There are no images appropriate for platform " + req_platform);
+  return platforms.size();
+}
+
+std::string DockerManifestWrapper::getConfigDigest(bool removePrefix) const {
+  ensureMultiPlatform(false);
+  std::string digest = manifest_["config"]["digest"].asString();
+  if (removePrefix) {
+    digest = removeDigestPrefix(digest);
+  }
+  return digest;
 }
 
-std::string DockerManifestWrapper::getMediaType() const {
-  ensure(manifest_.isMember("mediaType"), "Undefined manifest type");
-  return manifest_["mediaType"].asString();
+const Json::Value &DockerManifestWrapper::getLayers() const {
+  ensureMultiPlatform(false);
+  ensure(manifest_["layers"].isArray(), "Bad layers in manifest");
+  return manifest_["layers"];
 }
 
-void DockerManifestWrapper::ensureMediaType(const std::string &req_type) const {
-  ensure(getMediaType() == req_type, "Bad mediaType of manifest");
+void DockerManifestWrapper::ensureMultiPlatform(bool multi_platform) const {
+  ensure(multi_platform_ == multi_platform, "Bad mediaType of manifest");
 }
 
 
@@ -387,7 +508,7 @@ DockerManifestsCache::loadByDigest(const std::string &digest) {
   // Try to find manifest in cache first.
   DigestToManifestCacheElemMap::iterator it = manifests_cache_.find(digest_nopref);
   if (it != manifests_cache_.end()) {
-    LOG_TRACE << "cache: hit for manifest with digest " << digest_nopref;
+    LOG_TRACE_LAZY << "cache: hit for manifest with digest " << digest_nopref;
     // Update access index and return it.
     ManifestCacheElem &cache_elem = it->second;
     cache_elem.first = ++access_counter_;
@@ -402,7 +523,7 @@ DockerManifestsCache::loadByDigest(const std::string &digest) {
   // Store into cache.
   ManifestPtr manifest_ptr = std::make_shared<DockerManifestWrapper>(manifest_json);
   ManifestCacheElem manifest_elem{++access_counter_, manifest_ptr};
-  LOG_TRACE << "cache: load manifest with digest " << digest_nopref;
+  LOG_TRACE_LAZY << "cache: load manifest with digest " << digest_nopref;
   manifests_cache_.insert({digest_nopref, manifest_elem});
 
   // Remove elements if desired size exceeded (next loop should run 0 or 1 time).
@@ -419,7 +540,7 @@ DockerManifestsCache::loadByDigest(const std::string &digest) {
     }
     if (delit == manifests_cache_.end()) break;
     // Remove LRU entry.
-    LOG_TRACE << "cache: discard entry with digest " << delit->first;
+    LOG_TRACE_LAZY << "cache: discard entry with digest " << delit->first;
     manifests_cache_.erase(delit);
   }
 
@@ -511,6 +632,9 @@ bool DockerComposeFile::read(const boost::filesystem::path &compose_path) {
 }
 
 void DockerComposeFile::dumpLines() {
+  if (! LOG_IS_ENABLED(debug)) {
+    return;
+  }
   for (auto &line : compose_lines_) {
     LOG_DEBUG << line;
   }
@@ -576,7 +700,7 @@ bool DockerComposeFile::getServices(StringToImagePlatformPair &dest, bool verbos
 
   store_current();
 
-  if (verbose) {
+  if (verbose && LOG_IS_ENABLED(debug)) {
     LOG_DEBUG << "Services in docker-compose:";
     for (auto &mapping : dest) {
       LOG_DEBUG << "* " << mapping.first << ": "
@@ -799,6 +923,9 @@ void DockerComposeOfflineLoader::updateReferencedImages() {
 }
 
 void DockerComposeOfflineLoader::dumpReferencedImages() {
+  if (! LOG_IS_ENABLED(debug)) {
+    return;
+  }
   LOG_DEBUG << "Images referenced in docker-compose:";
   for (auto &ri : referenced_images_) {
     LOG_DEBUG << "* " << ri.first << ":";
@@ -827,10 +954,11 @@ void DockerComposeOfflineLoader::updateImageMapping() {
     std::string best_platform;
 
     if (main_manifest->isMultiPlatform()) {
-      // Multi-platform image: load the most appropriate manifest.
+      // Multi-platform image: load the most appropriate manifest (compatible
+      // platforms are only accepted for the default platform).
       main_manifest->findBestPlatform(
           req_platform.empty() ? default_platform_ : req_platform,
-          &best_platform, &best_digest);
+          &best_platform, &best_digest, req_platform.empty());
       best_manifest = manifests_cache_->loadByDigest(best_digest);
     }
 
@@ -851,6 +979,9 @@ void DockerComposeOfflineLoader::updateImageMapping() {
 }
 
 void DockerComposeOfflineLoader::dumpImageMapping() {
+  if (! LOG_IS_ENABLED(debug)) {
+    return;
+  }
   LOG_DEBUG << "Image mapping:";
   for (auto &im : per_service_image_mapping_) {
     const std::string &svc_name = im.first;
@@ -872,9 +1003,11 @@ void DockerComposeOfflineLoader::dumpImageMapping() {
 void DockerComposeOfflineLoader::loadCompose(
     const boost::filesystem::path &compose_name,
     const std::string &compose_sha256) {
+  UpdateTrace::Scope trace("compose load", compose_name.filename().string());
 
   compose_file_ = std::make_shared<DockerComposeFile>();
   ensure(compose_file_->read(compose_name), "Could not load docker-compose file");
+  compose_sha256_ = compose_file_->getSHA256();
 
   if (! compose_sha256.empty()) {
     const std::string actual_sha256 = compose_file_->getSHA256();
@@ -890,23 +1023,194 @@ void DockerComposeOfflineLoader::loadCompose(
   updateImageMapping();
 }
 
-static void doInstallImage(
-    const boost::filesystem::path &tarball,
-    DockerTarballLoader::StringToStringSet expected_contents) {
-  // LOG_INFO << "Preparing to install " << tarball;
-  // Run actual tarball loader.
-  DockerTarballLoader tbloader(tarball);
-  tbloader.loadMetadata();
-  if (!tbloader.validateMetadata(&expected_contents) || !tbloader.loadImages()) {
-    LOG_WARNING << "Loading of tarballs aborted!";
-    throw std::runtime_error(
-        "Failed to load docker tarball " + tarball.filename().string());
+// Space to keep free on the spool filesystem in addition to the tarball.
+static constexpr uint64_t SPOOL_RESERVED_BYTES = 64 * 1024 * 1024;
+
+static bool isTmpfs(const boost::filesystem::path &dir) {
+  struct statfs fsinfo {};
+  if (::statfs(dir.c_str(), &fsinfo) != 0) {
+    return false;
+  }
+  return static_cast<uint64_t>(fsinfo.f_type) == static_cast<uint64_t>(TMPFS_MAGIC);
+}
+
+/**
+ * Take a private snapshot of `src` at `dst`, where `dst` lives in a directory
+ * only writable by us. The source is opened once and both the reflink and the
+ * copy are made from that descriptor.
+ *
+ * The snapshot is a reflink (FICLONE) when the filesystem supports it; otherwise
+ * the data is spooled to `dst` but only if its filesystem is disk-backed and has
+ * enough free space for the whole tarball, which is checked before starting.
+ *
+ * Returns false (leaving nothing behind) when no snapshot could be taken; the
+ * caller can then stream the original tarball: DockerTarballLoader also reads
+ * it through a single descriptor and checks its digest while streaming.
+ */
+static bool snapshotTarball(const boost::filesystem::path &src, const boost::filesystem::path &dst) {
+  int src_fd = ::open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  if (src_fd < 0) {
+    throw std::runtime_error("Could not open docker tarball " + src.filename().string());
+  }
+  struct stat src_stat {};
+  if (::fstat(src_fd, &src_stat) != 0) {
+    ::close(src_fd);
+    throw std::runtime_error("Could not stat docker tarball " + src.filename().string());
+  }
+  int dst_fd = ::open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (dst_fd < 0) {
+    ::close(src_fd);
+    throw std::runtime_error("Could not create " + dst.string());
+  }
+
+  bool done = false;
+  if (::ioctl(dst_fd, FICLONE, src_fd) == 0) {
+    LOG_DEBUG << "Reflinked " << src << " to " << dst;
+    done = true;
+  } else {
+    const boost::filesystem::path dst_dir = dst.parent_path();
+    struct statvfs vfsinfo {};
+    const auto needed = static_cast<uint64_t>(src_stat.st_size) + SPOOL_RESERVED_BYTES;
+    if (isTmpfs(dst_dir)) {
+      LOG_INFO << "Not spooling " << src.filename() << " to " << dst_dir << ": directory is in RAM";
+    } else if (::fstatvfs(dst_fd, &vfsinfo) != 0 ||
+               static_cast<uint64_t>(vfsinfo.f_bavail) * vfsinfo.f_frsize < needed) {
+      LOG_INFO << "Not spooling " << src.filename() << " to " << dst_dir << ": not enough free space";
+    } else {
+      LOG_DEBUG << "Spooling " << src << " to " << dst;
+      off_t offset = 0;
+      done = true;
+      while (offset < src_stat.st_size) {
+        ssize_t count = ::sendfile(dst_fd, src_fd, &offset, static_cast<size_t>(src_stat.st_size - offset));
+        if (count < 0 && errno == EINTR) {
+          continue;
+        }
+        if (count <= 0) {
+          LOG_WARNING << "Could not spool " << src.filename() << ": "
+                      << (count < 0 ? std::strerror(errno) : "unexpected end of file");
+          done = false;
+          break;
+        }
+      }
+    }
+  }
+
+  ::close(src_fd);
+  if (::close(dst_fd) != 0) {
+    done = false;
+  }
+  if (!done) {
+    ::unlink(dst.c_str());
+  }
+  return done;
+}
+
+void DockerComposeOfflineLoader::setJournal(const boost::filesystem::path &journal_path) {
+  journal_path_ = journal_path;
+}
+
+void DockerComposeOfflineLoader::setPruneUnusedImages(bool prune_unused_images) {
+  prune_unused_images_ = prune_unused_images;
+}
+
+void DockerComposeOfflineLoader::setLoadSink(const std::shared_ptr<DockerLoadSink> &load_sink) {
+  load_sink_ = load_sink;
+}
+
+Json::Value DockerComposeOfflineLoader::readJournal() {
+  Json::Value journal;
+  if (!journal_path_.empty() && boost::filesystem::exists(journal_path_)) {
+    try {
+      journal = Utils::parseJSONFile(journal_path_);
+    } catch (const std::exception &exc) {
+      LOG_WARNING << "Ignoring unreadable journal " << journal_path_ << ": " << exc.what();
+      journal = Json::Value();
+    }
+  }
+
+  // A journal is only valid for the compose file it was created for.
+  if (journal["compose"].asString() != compose_sha256_) {
+    journal = Json::Value();
+    journal["compose"] = compose_sha256_;
+  }
+  return journal;
+}
+
+void DockerComposeOfflineLoader::writeJournal(const Json::Value &journal) {
+  if (journal_path_.empty()) {
+    return;
+  }
+  // Write to a temporary file and rename it so that the journal is never
+  // left half-written if power is lost: both the file contents and the rename
+  // must reach the disk before the images are considered loaded.
+  boost::filesystem::path temp_path(journal_path_.string() + ".tmp");
+  const std::string contents = Utils::jsonToCanonicalStr(journal);
+  int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    throw std::runtime_error("Could not create journal " + temp_path.string() + ": " + std::strerror(errno));
+  }
+  size_t written = 0;
+  while (written < contents.size()) {
+    const ssize_t res = ::write(fd, contents.data() + written, contents.size() - written);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+    if (res < 0) {
+      const int err = errno;
+      ::close(fd);
+      throw std::runtime_error("Could not write journal " + temp_path.string() + ": " + std::strerror(err));
+    }
+    written += static_cast<size_t>(res);
+  }
+  if (::fsync(fd) != 0) {
+    const int err = errno;
+    ::close(fd);
+    throw std::runtime_error("Could not sync journal " + temp_path.string() + ": " + std::strerror(err));
+  }
+  ::close(fd);
+  boost::filesystem::rename(temp_path, journal_path_);
+
+  const boost::filesystem::path journal_dir =
+      journal_path_.has_parent_path() ? journal_path_.parent_path() : boost::filesystem::path(".");
+  int dirfd = ::open(journal_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd >= 0) {
+    ::fsync(dirfd);
+    ::close(dirfd);
+  }
+}
+
+/**
+ * Find the (possibly compressed) tarball of an image in the images directory.
+ */
+static boost::filesystem::path findTarball(const boost::filesystem::path &images_dir,
+                                           const std::string &man_digest) {
+  boost::system::error_code errcode;
+  for (const auto &ext : TARBALL_EXTS) {
+    const boost::filesystem::path tarball = images_dir / (man_digest + ext);
+    if (boost::filesystem::exists(tarball, errcode)) {
+      return tarball;
+    }
   }
-  // LOG_INFO << "Finished installing " << tarball;
+  // Not found: let the loader report it.
+  return images_dir / (man_digest + TAR_EXT);
 }
 
+/**
+ * Image to be installed from a tarball, kept between the validation of the
+ * tarball and the loading of its images.
+ */
+struct PendingImage {
+  std::string man_digest;
+  std::string cfg_digest;
+  std::string image;
+  boost::filesystem::path tarball;
+  std::unique_ptr<DockerTarballLoader> loader;
+};
+
 void DockerComposeOfflineLoader::installImages(bool make_copy) {
   std::list<std::string> loaded_digests;
+  std::vector<PendingImage> pending;
+  Json::Value journal = readJournal();
 
   for (const auto &im : per_service_image_mapping_) {
     // const std::string &svc_name = im.first;
@@ -921,36 +1225,89 @@ void DockerComposeOfflineLoader::installImages(bool make_copy) {
       LOG_INFO << "Tarball for manifest '" << man_digest << "' already loaded";
       continue;
     }
+    loaded_digests.push_back(man_digest);
+
+    // Skip images loaded by a previous (interrupted) attempt.
+    const Json::Value entry = journal["loaded"].get(man_digest, Json::Value());
+    if (entry["config"].asString() == cfg_digest && entry["image"].asString() == mapping.getSelImage() &&
+        DockerTarballLoader::isImageLoaded(mapping.getSelImage(), cfg_digest)) {
+      LOG_INFO << "Tarball for manifest '" << man_digest << "' already loaded by a previous attempt";
+      continue;
+    }
+
+    PendingImage pimage{man_digest, cfg_digest, mapping.getSelImage(),
+                        findTarball(images_dir_, man_digest), nullptr};
 
-    // Define expected contents of tarball.
+    // Define expected contents of tarball and validate it (1st pass).
     DockerTarballLoader::StringToStringSet expected;
     expected[cfg_digest].insert(mapping.getSelImage());
+    DockerTarballLoader::StringToString expected_manifests;
+    expected_manifests[cfg_digest] = man_digest;
+
+    pimage.loader = std::make_unique<DockerTarballLoader>(pimage.tarball);
+    pimage.loader->loadMetadata();
+    if (!pimage.loader->validateMetadata(&expected, &expected_manifests)) {
+      LOG_WARNING << "Loading of tarballs aborted!";
+      throw std::runtime_error(
+          "Failed to load docker tarball " + pimage.tarball.filename().string());
+    }
+    pending.push_back(std::move(pimage));
+  }
 
-    boost::filesystem::path org_tarball = images_dir_ / (man_digest + TAR_EXT);
+  // Make sure all images fit before loading any of them.
+  {
+    UpdateTrace::Scope trace("storage check");
+    DockerStoragePlanner planner;
+    for (const auto &pimage : pending) {
+      for (const auto &layers : pimage.loader->getImageLayers()) {
+        planner.addTarballImage(layers, pimage.loader->getContentLength());
+      }
+    }
+    DockerStoragePlanner::Estimate est{};
+    if (!pending.empty() && !planner.ensureCapacity(prune_unused_images_, &est)) {
+      throw std::runtime_error("Not enough storage for loading docker images: " + std::to_string(est.needed) +
+                               " bytes needed, " + std::to_string(est.available) + " bytes available");
+    }
+  }
 
+  for (auto &pimage : pending) {
+    // Snapshot tarball to a secure place (when it can be done cheaply) just
+    // before loading it, so that at most one snapshot exists at a time; the
+    // snapshot is still checked against the digest from the 1st pass.
+    std::unique_ptr<LargeTemporaryDirectory> tmpdir;
     if (make_copy) {
-      // Copy tarball to a secure place.
-      LargeTemporaryDirectory tmpdir;
-      boost::system::error_code errcode;
-      boost::filesystem::path tarball = tmpdir / org_tarball.filename();
-      LOG_DEBUG << "Copying " << org_tarball << " to " << tarball;
-      boost::filesystem::copy_file(org_tarball, tarball, errcode);
-      if (errcode != boost::system::errc::success) {
-        LOG_WARNING << "Could not copy Docker tarball to secure location: aborting";
-        throw std::runtime_error(
-            "Failed to copy docker tarball " + tarball.filename().string());
+      tmpdir = std::make_unique<LargeTemporaryDirectory>();
+      const boost::filesystem::path snapshot = *tmpdir / pimage.tarball.filename();
+      UpdateTrace::Scope trace("tarball snapshot", pimage.tarball.filename().string());
+      if (!snapshotTarball(pimage.tarball, snapshot) || !pimage.loader->reopenTarball(snapshot)) {
+        LOG_INFO << "Loading " << pimage.tarball.filename() << " in place";
       }
-      doInstallImage(tarball, expected);
-    } else {
-      doInstallImage(org_tarball, expected);
     }
 
-    loaded_digests.push_back(man_digest);
+    // Load the images (2nd pass).
+    if (!(load_sink_ ? pimage.loader->loadImages(*load_sink_) : pimage.loader->loadImages())) {
+      LOG_WARNING << "Loading of tarballs aborted!";
+      throw std::runtime_error(
+          "Failed to load docker tarball for manifest " + pimage.man_digest);
+    }
+    pimage.loader.reset();
+    tmpdir.reset();
+
+    journal["loaded"][pimage.man_digest]["config"] = pimage.cfg_digest;
+    journal["loaded"][pimage.man_digest]["image"] = pimage.image;
+    writeJournal(journal);
+  }
+
+  // All images are in place: the journal is of no further use.
+  if (!journal_path_.empty()) {
+    boost::system::error_code errcode;
+    boost::filesystem::remove(journal_path_, errcode);
   }
 }
 
 void DockerComposeOfflineLoader::writeOfflineComposeFile(
     const boost::filesystem::path &compose_name, bool verbose) {
+  UpdateTrace::Scope trace("offline compose write", compose_name.filename().string());
 
   DockerComposeFile::ServiceToImageMapping compose_mapping;
   for (const auto &im : per_service_image_mapping_) {
@@ -967,7 +1324,7 @@ void DockerComposeOfflineLoader::writeOfflineComposeFile(
     throw std::runtime_error("Failed to write " + compose_name.string());
   }
 
-  if (verbose) {
+  if (verbose && LOG_IS_ENABLED(debug)) {
     LOG_DEBUG << ("Offline-mode image mapping:");
     for (const auto &sm : compose_mapping) {
       LOG_DEBUG << "* " << sm.first <<  " => " << sm.second;
@@ -3,20 +3,74 @@
 
 #include <boost/filesystem/path.hpp>
 #include <json/value.h>
+#include <map>
 #include <memory>
 #include <regex>
 #include <string>
+#include <vector>
+
+class DockerLoadSink;
 
 // TODO: Should we put this in some specific namespace?
 
 /**
- * Basic wrapper to a JSON object which is expected to contain a Docker
- * manifest or manifest list.
+ * Docker platform specification such as "linux/arm/v7", split into its
+ * components (os, architecture and, optionally, variant and os.version).
+ * Components are interned so that comparing platforms does not compare
+ * strings.
+ */
+class DockerPlatform {
+  public:
+    static const unsigned MAX_PARTS = 4;
+
+    /**
+     * Parse a platform string; a slash at the end is ignored and anything
+     * after the third slash is kept in the last component.
+     */
+    explicit DockerPlatform(const std::string &spec);
+
+    /**
+     * Parse the "platform" object of an entry in a manifest list.
+     */
+    static DockerPlatform fromJson(const Json::Value &plat);
+
+    /**
+     * Determine whether two platforms match (see platformMatches()).
+     *
+     * @param grade if not null, receives the number of leading components
+     *  both platforms have in common.
+     */
+    bool matches(const DockerPlatform &other, unsigned *grade = nullptr) const;
+
+    /**
+     * Get the platforms whose images can also be run on this one, in order of
+     * preference (e.g. linux/arm/v8, linux/arm/v7, ... for linux/arm64);
+     * these are the same platforms accepted by containerd.
+     */
+    std::vector<DockerPlatform> getFallbacks() const;
+
+    std::string toString() const;
+
+  protected:
+    DockerPlatform() : parts_(), nparts_(0) {}
+
+    const std::string *parts_[MAX_PARTS];
+    unsigned nparts_;
+
+    static const std::string *intern(const std::string &part);
+};
+
+/**
+ * Basic wrapper to a JSON object which is expected to contain an image
+ * manifest or a list of them: a Docker (v2 schema 2) manifest or manifest
+ * list, or an OCI image manifest or image index.
  */
 class DockerManifestWrapper {
   public:
     /**
-     * Constructor taking a Docker manifest in a JsonCpp Value object.
+     * Constructor taking a Docker manifest in a JsonCpp Value object; the
+     * media type is inferred from the contents when not set (it is optional
+     * in OCI manifests).
      *
      * @param manifest the root Json::Value object to be wrapped.
      */
@@ -24,34 +78,65 @@ class DockerManifestWrapper {
 
     /**
      * Return whether or not the manifest is multi-platform (or more precisely,
-     * if it is a manifest list).
+     * if it is a manifest list or image index).
      */
-    bool isMultiPlatform() const;
+    bool isMultiPlatform() const { return multi_platform_; }
 
     /**
      * Get digest/platform pair most closely matching the requested platform
-     * from a manifest list. If none is found, throws a runtime_exception.
+     * from a manifest list; when no image matches and `use_fallbacks` is set,
+     * the fallback platforms (see DockerPlatform::getFallbacks()) are tried
+     * in order. If none is found, throws a runtime_exception.
+     *
+     * Fallbacks are meant for the default platform of the device (see
+     * getDockerPlatform()), not for a platform explicitly requested by the
+     * docker-compose file.
+     *
+     * The platforms in the list are parsed once and the selection is cached
+     * per requested platform.
      */
     void findBestPlatform(
-        std::string req_platform,
-        std::string *sel_platform, std::string *sel_digest) const;
+        const std::string &req_platform,
+        std::string *sel_platform, std::string *sel_digest,
+        bool use_fallbacks = false) const;
 
     /**
      * Get digest of the configuration object of an image.
      */
     std::string getConfigDigest(bool removePrefix=false) const;
 
+    /**
+     * Get the descriptors (mediaType, digest and size) of the layers of an
+     * image.
+     */
+    const Json::Value &getLayers() const;
+
   protected:
     Json::Value manifest_;
+    bool multi_platform_;
+
+    struct PlatformEntry {
+      DockerPlatform platform;
+      std::string digest;
+    };
+    // Entries of a manifest list (parsed on first use) and index of the entry
+    // selected for each requested platform.
+    mutable std::vector<PlatformEntry> platforms_;
+    mutable bool platforms_parsed_;
+    mutable std::map<std::pair<std::string, bool>, size_t> selections_;
 
-    std::string platformString(const Json::Value &plat) const;
-    std::string getMediaType() const;
-    void ensureMediaType(const std::string &req_type) const;
+    const std::vector<PlatformEntry> &getPlatforms() const;
+    size_t selectPlatform(const std::string &req_platform, bool use_fallbacks) const;
+    void ensureMultiPlatform(bool multi_platform) const;
+
+    static bool decodeMediaType(const Json::Value &manifest);
 
     // Known media types.
     struct MEDIA_TYPE {
       static const std::string SINGLE_PLAT;
       static const std::string MULTI_PLAT;
+      static const std::string OCI_MANIFEST;
+      static const std::string OCI_INDEX;
     };
 };
 
@@ -302,6 +387,28 @@ class DockerComposeOfflineLoader {
     void loadCompose(const boost::filesystem::path &compose_name,
                      const std::string &compose_sha256);
 
+    /**
+     * Keep a journal of the images successfully loaded into the Docker daemon
+     * in the specified file, so that an interrupted installation can be
+     * resumed by `installImages()` without verifying and loading those images
+     * again. Images listed in the journal are only skipped if the daemon
+     * confirms they are present with the expected image ID. The journal is
+     * removed once all images have been loaded.
+     */
+    void setJournal(const boost::filesystem::path &journal_path);
+
+    /**
+     * Allow `installImages()` to remove unused Docker images when there is not
+     * enough storage for the new ones (disabled by default: the update fails).
+     */
+    void setPruneUnusedImages(bool prune_unused_images);
+
+    /**
+     * Send the images to the specified sink instead of running `docker load`
+     * (e.g. to use the Docker Engine API socket directly).
+     */
+    void setLoadSink(const std::shared_ptr<DockerLoadSink> &load_sink);
+
     /**
      * Install images defined by the docker-compose file last "loaded".
      */
@@ -314,7 +421,8 @@ class DockerComposeOfflineLoader {
         const boost::filesystem::path &compose_name, bool verbose=true);
 
     /**
-     * Dump internal state: images being referenced by the docker-compose file.
+     * Dump internal state: images being referenced by the docker-compose file
+     * (only when debug logging is enabled, like the other dump functions).
      */
     void dumpReferencedImages();
 
@@ -328,12 +436,18 @@ class DockerComposeOfflineLoader {
   protected:
     void updateReferencedImages();
     void updateImageMapping();
+    Json::Value readJournal();
+    void writeJournal(const Json::Value &journal);
 
     // TODO: Allow configuring this attribute (FUTURE)?
     std::string default_platform_;
     boost::filesystem::path images_dir_;
     std::shared_ptr<DockerManifestsCache> manifests_cache_;
     std::shared_ptr<DockerComposeFile> compose_file_;
+    std::string compose_sha256_;
+    boost::filesystem::path journal_path_;
+    bool prune_unused_images_{false};
+    std::shared_ptr<DockerLoadSink> load_sink_;
 
     StringToImagePlatformPair referenced_images_;
     PerServiceImageMapping per_service_image_mapping_;
@@ -361,7 +475,7 @@ bool loadManifest(
  *
  */
 bool platformMatches(
-    const std::string plat1, const std::string plat2, unsigned *grade=nullptr);
+    const std::string &plat1, const std::string &plat2, unsigned *grade=nullptr);
 
 /**
  * Determine current Docker platform (default platform for fetching images).
@@ -398,10 +512,11 @@ std::string removeDigestPrefix(const std::string &digest);
  * Determine if a platform string matches any of an iterable.
  */
 template <class T>
-  bool platformIn(const std::string plat, const T &container) {
+  bool platformIn(const std::string &plat, const T &container) {
+  const DockerPlatform _plat(plat);
   bool res = false;
   for (auto &it : container) {
-    if (platformMatches(plat, it)) {
+    if (_plat.matches(DockerPlatform(it))) {
       res = true;
       break;
     }
@@ -0,0 +1,247 @@
+#include "dockerstorageplanner.h"
+#include "dockerofflineloader.h"
+#include "crypto/crypto.h"
+#include "logging/logging.h"
+#include "utilities/utils.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/process.hpp>
+#include <json/reader.h>
+#include <sys/statvfs.h>
+
+#include <algorithm>
+#include <limits>
+#include <set>
+#include <sstream>
+
+namespace bp = boost::process;
+
+static const std::string DOCKER_PROGRAM = "/usr/bin/docker";
+static const std::string DEFAULT_DATA_ROOT = "/var/lib/docker";
+static const std::string SHA256_PREFIX = "sha256:";
+
+// Space to keep free in Docker's data-root after the update.
+static constexpr uint64_t RESERVED_BYTES = 128 * 1024 * 1024;
+
+// Registries only report the size of the compressed layers: the layer is
+// downloaded and then extracted (with both copies present for a while), so
+// assume the extracted layer takes this many times its compressed size.
+static constexpr uint64_t REGISTRY_EXPANSION_FACTOR = 2;
+
+/**
+ * Run the docker CLI and capture its standard output.
+ */
+static bool runDocker(const std::vector<std::string> &args, std::string *output) {
+  bp::ipstream docker_stdout;
+  std::error_code errcode;
+  bp::environment env = boost::this_process::environment();
+  // Needed by `docker manifest` before Docker 20.10.
+  env["DOCKER_CLI_EXPERIMENTAL"] = "enabled";
+  bp::child docker_proc(DOCKER_PROGRAM, bp::args(args), env,
+                        bp::std_out > docker_stdout, bp::std_err > bp::null, errcode);
+  if (errcode) {
+    LOG_WARNING << "Could not run " << DOCKER_PROGRAM << ": " << errcode.message();
+    return false;
+  }
+
+  std::ostringstream data;
+  data << docker_stdout.rdbuf();
+  docker_proc.wait();
+  if (output != nullptr) {
+    *output = data.str();
+  }
+  return docker_proc.exit_code() == 0;
+}
+
+static bool inspectManifest(const std::string &image, Json::Value *manifest) {
+  std::string output;
+  if (! runDocker({"manifest", "inspect", image}, &output)) {
+    return false;
+  }
+  std::istringstream source(output);
+  Json::CharReaderBuilder builder;
+  std::string errs;
+  return Json::parseFromStream(builder, source, manifest, &errs);
+}
+
+static uint64_t availableBytes(const boost::filesystem::path &dir) {
+  struct statvfs vfsinfo {};
+  if (::statvfs(dir.c_str(), &vfsinfo) != 0) {
+    // Do not refuse updates because of a check that cannot be done.
+    LOG_WARNING << "Cannot determine free space in " << dir << ": skipping storage check";
+    return std::numeric_limits<uint64_t>::max();
+  }
+  const uint64_t avail = static_cast<uint64_t>(vfsinfo.f_bavail) * vfsinfo.f_frsize;
+  return avail > RESERVED_BYTES ? avail - RESERVED_BYTES : 0;
+}
+
+DockerStoragePlanner::DockerStoragePlanner()
+  : data_root_(getDockerDataRoot()) {}
+
+DockerStoragePlanner::DockerStoragePlanner(const boost::filesystem::path &data_root)
+  : data_root_(data_root) {}
+
+boost::filesystem::path DockerStoragePlanner::getDockerDataRoot(
+    const boost::filesystem::path &daemon_config) {
+  boost::system::error_code errcode;
+  if (boost::filesystem::exists(daemon_config, errcode)) {
+    try {
+      const Json::Value config = Utils::parseJSONFile(daemon_config);
+      // "graph" is the deprecated name of "data-root".
+      for (const char *key : {"data-root", "graph"}) {
+        if (config[key].isString() && !config[key].asString().empty()) {
+          return config[key].asString();
+        }
+      }
+    } catch (const std::exception &exc) {
+      LOG_WARNING << "Cannot parse " << daemon_config << ": " << exc.what();
+    }
+  }
+  return DEFAULT_DATA_ROOT;
+}
+
+void DockerStoragePlanner::addTarballImage(const DockerTarballLoader::LayerList &layers,
+                                           uint64_t tarball_size) {
+  // Layers are stored by chain ID: the digest of the layer stack up to and
+  // including the layer, so a layer is only reused with the same parents.
+  PlannedImage image{{}, {}, false, tarball_size};
+  std::string chain_id;
+  for (const auto &layer : layers) {
+    if (chain_id.empty()) {
+      chain_id = SHA256_PREFIX + layer.diff_id;
+    } else {
+      const std::string parent = chain_id + " " + SHA256_PREFIX + layer.diff_id;
+      MultiPartSHA256Hasher hasher;
+      hasher.update(reinterpret_cast<const unsigned char *>(parent.data()), parent.size());
+      chain_id = SHA256_PREFIX + boost::algorithm::to_lower_copy(hasher.getHexDigest());
+    }
+    image.layer_keys.push_back(chain_id);
+    image.layer_sizes.push_back(layer.size);
+  }
+  images_.push_back(image);
+}
+
+bool DockerStoragePlanner::addRegistryImage(const std::string &image, const std::string &platform) {
+  try {
+    Json::Value manifest;
+    if (! inspectManifest(image, &manifest)) {
+      LOG_WARNING << "Cannot get manifest of " << image << " from registry";
+      return false;
+    }
+
+    DockerManifestWrapper wrapper(manifest);
+    if (wrapper.isMultiPlatform()) {
+      std::string sel_platform, sel_digest;
+      const bool is_default = platform.empty();
+      wrapper.findBestPlatform(is_default ? getDockerPlatform() : platform, &sel_platform, &sel_digest, is_default);
+      const std::string name = image.substr(0, image.find('@'));
+      if (! inspectManifest(name + "@" + sel_digest, &manifest)) {
+        LOG_WARNING << "Cannot get manifest of " << name << "@" << sel_digest << " from registry";
+        return false;
+      }
+    }
+
+    const DockerManifestWrapper image_wrapper(manifest);
+    PlannedImage planned{{}, {}, true, 0};
+    for (const auto &layer : image_wrapper.getLayers()) {
+      planned.layer_keys.push_back(layer["digest"].asString());
+      planned.layer_sizes.push_back(layer["size"].asUInt64());
+    }
+    images_.push_back(planned);
+
+  } catch (std::runtime_error &exc) {
+    LOG_WARNING << "Cannot plan storage for " << image << ": " << exc.what();
+    return false;
+  }
+  return true;
+}
+
+boost::filesystem::path DockerStoragePlanner::getImageStoreDir() const {
+  // The image store is kept per storage driver: <data-root>/image/<driver>.
+  const boost::filesystem::path image_dir = data_root_ / "image";
+  boost::system::error_code errcode;
+  if (boost::filesystem::is_directory(image_dir / "overlay2", errcode)) {
+    return image_dir / "overlay2";
+  }
+  if (boost::filesystem::is_directory(image_dir, errcode)) {
+    for (const auto &entry : boost::filesystem::directory_iterator(image_dir, errcode)) {
+      if (boost::filesystem::is_directory(entry.path() / "layerdb", errcode)) {
+        return entry.path();
+      }
+    }
+  }
+  return boost::filesystem::path();
+}
+
+bool DockerStoragePlanner::isLayerPresent(const boost::filesystem::path &store_dir,
+                                          const PlannedImage &image, size_t index) const {
+  if (store_dir.empty()) {
+    return false;
+  }
+  const std::string &key = image.layer_keys[index];
+  if (! boost::starts_with(key, SHA256_PREFIX)) {
+    return false;
+  }
+  const std::string hex = key.substr(SHA256_PREFIX.length());
+  boost::system::error_code errcode;
+  if (image.from_registry) {
+    return boost::filesystem::exists(store_dir / "distribution" / "diffid-by-digest" / "sha256" / hex, errcode);
+  }
+  return boost::filesystem::exists(store_dir / "layerdb" / "sha256" / hex, errcode);
+}
+
+DockerStoragePlanner::Estimate DockerStoragePlanner::estimate() const {
+  const boost::filesystem::path store_dir = getImageStoreDir();
+  std::set<std::string> seen;
+  uint64_t layers_size = 0;
+  uint64_t staging_size = 0;
+
+  for (const auto &image : images_) {
+    for (size_t idx = 0; idx < image.layer_keys.size(); idx++) {
+      // Layers shared by several images are only stored once.
+      if (! seen.insert(image.layer_keys[idx]).second || isLayerPresent(store_dir, image, idx)) {
+        continue;
+      }
+      layers_size += image.from_registry ?
+          image.layer_sizes[idx] * (1 + REGISTRY_EXPANSION_FACTOR) : image.layer_sizes[idx];
+    }
+    // Tarballs are loaded one at a time.
+    staging_size = std::max(staging_size, image.staging_size);
+  }
+
+  return Estimate{layers_size + staging_size, availableBytes(data_root_)};
+}
+
+bool DockerStoragePlanner::ensureCapacity(bool prune_unused, Estimate *est_out) {
+  Estimate est = estimate();
+  if (est_out != nullptr) { *est_out = est; }
+  LOG_INFO << "Container update needs " << est.needed << " bytes in " << data_root_
+           << ", " << est.available << " bytes available";
+  if (est.fits()) {
+    return true;
+  }
+
+  if (! prune_unused) {
+    LOG_WARNING << "Not enough storage for container update: missing "
+                << (est.needed - est.available) << " bytes (removal of unused images is disabled)";
+    return false;
+  }
+
+  LOG_INFO << "Not enough storage: removing unused images";
+  if (! runDocker({"image", "prune", "--all", "--force"}, nullptr)) {
+    LOG_WARNING << "Could not remove unused images";
+  }
+
+  // Pruning may also remove layers that were counted as present.
+  est = estimate();
+  if (est_out != nullptr) { *est_out = est; }
+  LOG_INFO << "Container update needs " << est.needed << " bytes in " << data_root_
+           << ", " << est.available << " bytes available";
+  if (! est.fits()) {
+    LOG_WARNING << "Not enough storage for container update: missing "
+                << (est.needed - est.available) << " bytes";
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,110 @@
+#ifndef SECONDARY_DOCKERSTORAGEPLANNER_H_
+#define SECONDARY_DOCKERSTORAGEPLANNER_H_
+
+#include <boost/filesystem/path.hpp>
+#include <string>
+#include <vector>
+
+#include "dockertarballloader.h"
+
+/**
+ * Pre-flight check of the storage needed by a container update, so that an
+ * update is refused (or, if allowed, unused images are removed) before
+ * starting instead of failing halfway through `docker load` or
+ * `docker-compose pull` when Docker's data-root fills up. How to use:
+ *
+ *     DockerStoragePlanner planner;
+ *     planner.addTarballImage(layers, tarball_size);   // Offline updates.
+ *     planner.addRegistryImage(image, platform);       // Online updates.
+ *     if (! planner.ensureCapacity()) {
+ *       // Refuse update.
+ *     }
+ *
+ * Layers already present in Docker's layer store are not accounted for; the
+ * store is inspected directly (layer and distribution databases) since the
+ * daemon offers no API for that.
+ */
+class DockerStoragePlanner {
+  public:
+    struct Estimate {
+      uint64_t needed;     // Bytes needed in Docker's data-root.
+      uint64_t available;  // Bytes available there (minus a reserve).
+      bool fits() const { return needed <= available; }
+    };
+
+  public:
+    /**
+     * Constructor: use Docker's data-root from the daemon configuration.
+     */
+    DockerStoragePlanner();
+
+    /**
+     * Constructor.
+     *
+     * @param data_root Docker's data-root directory.
+     */
+    explicit DockerStoragePlanner(const boost::filesystem::path &data_root);
+
+    /**
+     * Account for an image to be loaded from a `docker save` tarball.
+     *
+     * @param layers image layers as returned by
+     *  DockerTarballLoader::getImageLayers().
+     * @param tarball_size size of the tarball, which is staged by the daemon
+     *  in its data-root while loading.
+     */
+    void addTarballImage(const DockerTarballLoader::LayerList &layers, uint64_t tarball_size);
+
+    /**
+     * Account for an image to be pulled from its registry; the manifest is
+     * obtained via `docker manifest inspect`.
+     *
+     * @param image image name (by digest or by tag).
+     * @param platform platform to select from a manifest list; if empty, the
+     *  default platform of the device, for which compatible platforms are
+     *  also accepted.
+     * @return false if the manifest of the image could not be obtained.
+     */
+    bool addRegistryImage(const std::string &image, const std::string &platform);
+
+    /**
+     * Estimate the storage needed by the images added so far.
+     */
+    Estimate estimate() const;
+
+    /**
+     * Check whether the images added so far fit in Docker's data-root; if
+     * not and `prune_unused` is set, remove unused images and check again.
+     *
+     * @param prune_unused whether unused images (not only dangling ones) may
+     *  be removed to make room; this may remove images the user still wants.
+     * @param est_out if not null, set to the last estimate made.
+     * @return true iff the images fit.
+     */
+    bool ensureCapacity(bool prune_unused = false, Estimate *est_out = nullptr);
+
+    /**
+     * Determine Docker's data-root from the daemon configuration.
+     */
+    static boost::filesystem::path getDockerDataRoot(
+        const boost::filesystem::path &daemon_config = "/etc/docker/daemon.json");
+
+  protected:
+    struct PlannedImage {
+      // Chain IDs of the layers (tarballs) or digests of the compressed
+      // layers (registry), as used to look them up in the layer store.
+      std::vector<std::string> layer_keys;
+      std::vector<uint64_t> layer_sizes;
+      bool from_registry;
+      uint64_t staging_size;
+    };
+
+    boost::filesystem::path data_root_;
+    std::vector<PlannedImage> images_;
+
+    boost::filesystem::path getImageStoreDir() const;
+    bool isLayerPresent(const boost::filesystem::path &store_dir,
+                        const PlannedImage &image, size_t index) const;
+};
+
+#endif /* SECONDARY_DOCKERSTORAGEPLANNER_H_ */
@@ -1,4 +1,8 @@
 #include "dockertarballloader.h"
+#include "dockerloadsink.h"
+#include "dockerofflineloader.h"
+#include "updatetrace.h"
+#include "logguard.h"
 #include "logging/logging.h"
 #include "crypto/crypto.h"
 
@@ -10,20 +14,35 @@
 #include <boost/algorithm/string/predicate.hpp>
 #include <json/reader.h>
 #include <json/value.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
-#include <sstream>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 namespace bp = boost::process;
 
-static const std::string DOCKER_PROGRAM = "/usr/bin/docker";
+static std::string docker_program = "/usr/bin/docker";
 static const std::string JSON_FILE = "json";
 static const std::string JSON_EXT = ".json";
+static const std::string MANIFEST_FILE = "manifest.json";
+static const std::string OCI_INDEX_FILE = "index.json";
+static const std::string OCI_BLOBS_DIR = "blobs/sha256/";
 static const std::string SHA256_PREFIX = "sha256:";
 
 // Maximum size of a JSON file in a `docker save` tarball.
@@ -116,65 +135,251 @@ static constexpr std::size_t ARCHIVE_CTRL_BUFFER_SIZE = DEFAULT_BLOCK_BUFFER_SIZ
 struct ArchiveCtrl {
   protected:
     typedef std::array<uint8_t, ARCHIVE_CTRL_BUFFER_SIZE> BufferType;
-    std::ifstream infile_;
+    int fd_;
     uint64_t nread_;
     BufferType buffer_;
     MultiPartSHA256Hasher hasher_;
 
   public:
-    ArchiveCtrl(const boost::filesystem::path& tarball)
-      : infile_(tarball.string(), std::ios::binary), nread_(0) {
-      if (! infile_) {
-        throw std::runtime_error("Could not open '" + tarball.string() + "'");
-      }
+    explicit ArchiveCtrl(int fd) : fd_(fd), nread_(0) {}
+
+    virtual ~ArchiveCtrl() {}
+
+    virtual ssize_t read() {
+      return readInto(buffer_.data(), buffer_.size());
     }
 
-    virtual ~ArchiveCtrl() {
-      infile_.close();
+    ssize_t readInto(uint8_t *buf, size_t size) {
+      ssize_t count;
+      do {
+        count = ::pread(fd_, buf, size, static_cast<off_t>(nread_));
+      } while (count < 0 && errno == EINTR);
+      if (count < 0) {
+        return ARCHIVE_FATAL;
+      }
+      hasher_.update(buf, static_cast<uint64_t>(count));
+      nread_ += count;
+      return count;
     }
 
-    ssize_t read() {
-      infile_.read(reinterpret_cast<char *>(buffer_.data()), buffer_.size());
-      hasher_.update(buffer_.data(), static_cast<uint64_t>(infile_.gcount()));
-      nread_ += infile_.gcount();
-      return infile_.gcount();
+    // Read (and hash) whatever the archive reader left unread.
+    bool drain() {
+      ssize_t count;
+      while ((count = read()) > 0) {}
+      return count == 0;
     }
 
     uint64_t nread() {
       return nread_;
     }
 
-    void *data() {
+    virtual void *data() {
       return static_cast<void *>(buffer_.data());
     }
 
-    std::string getHexDigest() {
+    virtual std::string getHexDigest() {
       return boost::algorithm::to_lower_copy(hasher_.getHexDigest());
     }
 };
 
+/**
+ * ArchiveCtrl reading and hashing the file ahead in a separate thread, so that
+ * the I/O and the digest computation overlap with the work done by libarchive
+ * on the returned data (mainly decompression, which libzstd and zlib can only
+ * do in a single thread for a single stream).
+ *
+ * Only read() may be used for reading.
+ */
+class PrefetchingArchiveCtrl : public ArchiveCtrl {
+  protected:
+    static constexpr size_t NUM_BUFFERS = 4;
+
+    std::array<BufferType, NUM_BUFFERS> buffers_;
+    std::array<ssize_t, NUM_BUFFERS> counts_;
+    // Buffers [head_, tail_) (modulo NUM_BUFFERS) are filled; the one at head_
+    // is in use by the consumer from the time it is returned by read() until
+    // the next call.
+    uint64_t head_{0};
+    uint64_t tail_{0};
+    bool holding_{false};
+    bool stop_{false};
+    uint64_t hashed_{0};
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::thread reader_;
+
+    void readerLoop() {
+      uint64_t offset = 0;
+      for (;;) {
+        uint64_t slot;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          cond_.wait(lock, [this] { return stop_ || tail_ - head_ < NUM_BUFFERS; });
+          if (stop_) {
+            return;
+          }
+          slot = tail_ % NUM_BUFFERS;
+        }
+        BufferType &buffer = buffers_[slot];
+        ssize_t count;
+        do {
+          count = ::pread(fd_, buffer.data(), buffer.size(), static_cast<off_t>(offset));
+        } while (count < 0 && errno == EINTR);
+        if (count > 0) {
+          hasher_.update(buffer.data(), static_cast<uint64_t>(count));
+          offset += static_cast<uint64_t>(count);
+        }
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          counts_[slot] = (count < 0) ? ARCHIVE_FATAL : count;
+          hashed_ = offset;
+          tail_++;
+        }
+        cond_.notify_all();
+        if (count <= 0) {
+          return;
+        }
+      }
+    }
+
+    void stopReader() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      cond_.notify_all();
+      if (reader_.joinable()) {
+        reader_.join();
+      }
+    }
+
+  public:
+    explicit PrefetchingArchiveCtrl(int fd) : ArchiveCtrl(fd) {
+      reader_ = std::thread(&PrefetchingArchiveCtrl::readerLoop, this);
+    }
+
+    ~PrefetchingArchiveCtrl() override { stopReader(); }
+
+    ssize_t read() override {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (holding_) {
+        // The end of the file (or an error) is returned repeatedly.
+        if (counts_[head_ % NUM_BUFFERS] <= 0) {
+          return counts_[head_ % NUM_BUFFERS];
+        }
+        head_++;
+        holding_ = false;
+        cond_.notify_all();
+      }
+      cond_.wait(lock, [this] { return head_ < tail_; });
+      holding_ = true;
+      const ssize_t count = counts_[head_ % NUM_BUFFERS];
+      if (count > 0) {
+        nread_ += static_cast<uint64_t>(count);
+      }
+      return count;
+    }
+
+    void *data() override {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return static_cast<void *>(buffers_[head_ % NUM_BUFFERS].data());
+    }
+
+    // Digest of the data returned by read(): empty if the reader went past it,
+    // i.e. if the consumer stopped before the end of the file.
+    std::string getHexDigest() override {
+      stopReader();
+      if (hashed_ != nread_) {
+        return std::string();
+      }
+      return ArchiveCtrl::getHexDigest();
+    }
+};
+
 /**
  * Helper function for integrating with libarchive.
  */
 static ssize_t _arch_read(struct archive *arch, void *client_data, const void **buff) {
   (void) arch;
   ArchiveCtrl *archctrl = reinterpret_cast<ArchiveCtrl *>(client_data);
+  const ssize_t count = archctrl->read();
   *buff = archctrl->data();
-  return archctrl->read();
+  return count;
 }
 
-bool DockerTarballLoader::loadMetadataEntryJson(archive *arch, archive_entry *entry) {
-  const boost::filesystem::path pathname{archive_entry_pathname(entry)};
+uint8_t *DockerTarballLoader::getJsonBuffer() {
+  // The buffer is allocated once and reused for all JSON files.
+  if (json_buffer_.empty()) {
+    json_buffer_.resize(MAX_JSON_FILE_SIZE_BYTES + 1);
+  }
+  return json_buffer_.data();
+}
 
-  // TODO: We might call archive_entry_size() to allocate the buffer.
-  //       However, the size is not guaranteed to be always set.
+static bool isBlobEntry(const boost::filesystem::path &pathname) {
+  return boost::starts_with(pathname.string(), OCI_BLOBS_DIR);
+}
 
-  // Load the JSON file into memory.
-  typedef std::array<uint8_t, MAX_JSON_FILE_SIZE_BYTES+1> JsonBufferType;
-  auto buffer = std::make_unique<JsonBufferType>();
-  ssize_t count = archive_read_data(
-      arch, reinterpret_cast<void *>(buffer->data()), buffer->size());
-  if (count > static_cast<ssize_t>(MAX_JSON_FILE_SIZE_BYTES)) {
+/**
+ * Determine whether a file in the tarball is loaded into memory and parsed:
+ * JSON files and, in OCI layouts, small blobs (which may be manifests or
+ * image configurations).
+ */
+static bool isJsonEntry(const boost::filesystem::path &pathname, uint64_t size) {
+  // TODO: Should we make these comparisons case-insensitive?
+  return pathname.extension() == JSON_EXT || pathname.filename() == JSON_FILE ||
+         (isBlobEntry(pathname) && size <= MAX_JSON_FILE_SIZE_BYTES);
+}
+
+/**
+ * Keep only the parts of a metadata file that are used later on (by
+ * validateMetadata() and getImageLayers()): Config, Layers and RepoTags of
+ * each image in the manifest, rootfs.diff_ids of image configurations and,
+ * in OCI layouts, the descriptors in the index and in image manifests;
+ * other files (e.g. the legacy per-layer `json`) are only needed for their
+ * digest.
+ */
+static void trimMetadata(const boost::filesystem::path &pathname, Json::Value *root) {
+  Json::Value trimmed;
+  if (pathname == MANIFEST_FILE) {
+    if (! root->isArray()) {
+      return;
+    }
+    trimmed = Json::Value(Json::arrayValue);
+    for (auto &man : *root) {
+      if (! man.isObject()) {
+        trimmed.append(man);
+        continue;
+      }
+      Json::Value &entry = trimmed.append(Json::Value(Json::objectValue));
+      for (const char *key : {"Config", "Layers", "RepoTags"}) {
+        if (man.isMember(key)) {
+          entry[key].swap(man[key]);
+        }
+      }
+    }
+  } else if (root->isObject()) {
+    if ((*root)["rootfs"].isObject() && (*root)["rootfs"].isMember("diff_ids")) {
+      trimmed["rootfs"]["diff_ids"].swap((*root)["rootfs"]["diff_ids"]);
+    }
+    if (pathname == OCI_INDEX_FILE || isBlobEntry(pathname)) {
+      for (const char *key : {"mediaType", "manifests", "layers"}) {
+        if (root->isMember(key)) {
+          trimmed[key].swap((*root)[key]);
+        }
+      }
+      // The config of a manifest is a descriptor (unlike the one of an image
+      // configuration, which is dropped).
+      if ((*root)["config"].isObject() && (*root)["config"].isMember("digest")) {
+        trimmed["config"].swap((*root)["config"]);
+      }
+    }
+  }
+  root->swap(trimmed);
+}
+
+bool DockerTarballLoader::storeEntryJson(const boost::filesystem::path &pathname,
+                                         const uint8_t *data, uint64_t count) {
+  if (count > MAX_JSON_FILE_SIZE_BYTES) {
     LOG_WARNING << "JSON file '" << pathname.string()
                 << "' in archive is larger than the maximum size of "
                 << MAX_JSON_FILE_SIZE_BYTES << " bytes";
@@ -183,27 +388,35 @@ bool DockerTarballLoader::loadMetadataEntryJson(archive *arch, archive_entry *en
 
   // Determine the file's digest.
   MultiPartSHA256Hasher hasher;
-  hasher.update(buffer->data(), static_cast<uint64_t>(count));
+  hasher.update(data, count);
   std::string digest = boost::algorithm::to_lower_copy(hasher.getHexDigest());
 
-  // Parse contents.
-  std::string _source(reinterpret_cast<char *>(buffer->data()), count);
-  std::istringstream source(_source);
+  // Parse contents (in place).
+  if (! json_reader_) {
+    json_reader_.reset(Json::CharReaderBuilder().newCharReader());
+  }
+  const char *begin = reinterpret_cast<const char *>(data);
   Json::Value root;
-  source >> root;
+  std::string errs;
+  if (! json_reader_->parse(begin, begin + count, &root, &errs)) {
+    // Small blobs that are not JSON are layers.
+    ensure(isBlobEntry(pathname),
+           "Cannot parse '" + pathname.string() + "' in tarball: " + errs);
+    return storeEntryOther(pathname, digest, count);
+  }
+  trimMetadata(pathname, &root);
 
   // Store metadata information (keyed by file name).
-  MetaInfo info(digest, root);
-  MetadataMap::value_type value(pathname.string(), info);
   std::pair<MetadataMap::iterator, bool> res;
-  res = metamap_.insert(value);
-  // LOG_INFO << "Inserted: (" << value.first
-  //          << ", " << value.second.sha256_ << ")";
+  res = metamap_.emplace(pathname.string(), MetaInfo(digest, count));
+  // LOG_INFO << "Inserted: (" << res.first->first
+  //          << ", " << res.first->second.getSHA256() << ")";
 
   if (! res.second) {
     LOG_WARNING << "Archive has duplicate file: " << pathname.string();
     return false;
   }
+  res.first->second.getRoot().swap(root);
 
   // Update statistics.
   metastats_.nfiles_json++;
@@ -217,34 +430,16 @@ bool DockerTarballLoader::loadMetadataEntryJson(archive *arch, archive_entry *en
   return true;
 }
 
-bool DockerTarballLoader::loadMetadataEntryOther(archive *arch, archive_entry *entry) {
-  const boost::filesystem::path pathname{archive_entry_pathname(entry)};
-
-  // Process file in blocks.
-  typedef std::array<uint8_t, DEFAULT_BLOCK_BUFFER_SIZE_BYTES> BufferType;
-  auto buffer = std::make_unique<BufferType>();
-
-  ssize_t count;
-  MultiPartSHA256Hasher hasher;
-
-  // Determine the file's digest.
-  do {
-    count = archive_read_data(
-        arch, reinterpret_cast<void *>(buffer->data()), buffer->size());
-    hasher.update(buffer->data(), static_cast<uint64_t>(count));
-    // Update statistics.
-    metastats_.nbytes_other += count;
-  } while(count > 0);
-
-  std::string digest = boost::algorithm::to_lower_copy(hasher.getHexDigest());
+bool DockerTarballLoader::storeEntryOther(const boost::filesystem::path &pathname,
+                                          const std::string &digest, uint64_t size) {
+  // Update statistics.
+  metastats_.nbytes_other += size;
 
   // Store metadata information (keyed by file name).
-  MetaInfo info(digest);
-  MetadataMap::value_type value(pathname.string(), info);
   std::pair<MetadataMap::iterator, bool> res;
-  res = metamap_.insert(value);
-  // LOG_INFO << "Inserted: (" << value.first
-  //          << ", " << value.second.sha256_ << ")";
+  res = metamap_.emplace(pathname.string(), MetaInfo(digest, size));
+  // LOG_INFO << "Inserted: (" << res.first->first
+  //          << ", " << res.first->second.getSHA256() << ")";
 
   if (! res.second) {
     LOG_WARNING << "Archive has duplicate file: " << pathname.string();
@@ -263,9 +458,44 @@ bool DockerTarballLoader::loadMetadataEntryOther(archive *arch, archive_entry *e
   return true;
 }
 
-bool DockerTarballLoader::loadMetadataEntry(archive *arch, archive_entry *entry) {
-  // Ensure path name is good (relative and not using '.' or '..').
+bool DockerTarballLoader::loadMetadataEntryJson(archive *arch, archive_entry *entry) {
+  const boost::filesystem::path pathname{archive_entry_pathname(entry)};
+
+  // Load the JSON file into memory (reading at most one byte more than
+  // allowed, to detect oversized files).
+  uint8_t *buffer = getJsonBuffer();
+  ssize_t count = archive_read_data(
+      arch, reinterpret_cast<void *>(buffer), MAX_JSON_FILE_SIZE_BYTES + 1);
+  if (count < 0) {
+    count = 0;
+  }
+  return storeEntryJson(pathname, buffer, static_cast<uint64_t>(count));
+}
+
+bool DockerTarballLoader::loadMetadataEntryOther(archive *arch, archive_entry *entry) {
   const boost::filesystem::path pathname{archive_entry_pathname(entry)};
+
+  // Process file in blocks.
+  typedef std::array<uint8_t, DEFAULT_BLOCK_BUFFER_SIZE_BYTES> BufferType;
+  auto buffer = std::make_unique<BufferType>();
+
+  ssize_t count;
+  uint64_t size = 0;
+  MultiPartSHA256Hasher hasher;
+
+  // Determine the file's digest.
+  while ((count = archive_read_data(
+              arch, reinterpret_cast<void *>(buffer->data()), buffer->size())) > 0) {
+    hasher.update(buffer->data(), static_cast<uint64_t>(count));
+    size += count;
+  }
+
+  std::string digest = boost::algorithm::to_lower_copy(hasher.getHexDigest());
+  return storeEntryOther(pathname, digest, size);
+}
+
+bool DockerTarballLoader::checkEntry(const boost::filesystem::path &pathname, unsigned filetype) {
+  // Ensure path name is good (relative and not using '.' or '..').
   if (!pathname.is_relative() || (pathname.lexically_normal() != pathname)) {
     LOG_WARNING << "Found in archive a file with non-relative name: "
                 << pathname.string();
@@ -273,64 +503,139 @@ bool DockerTarballLoader::loadMetadataEntry(archive *arch, archive_entry *entry)
   }
 
   // Ensure file type is good.
-  if (archive_entry_filetype(entry) != AE_IFREG &&
-      archive_entry_filetype(entry) != AE_IFDIR) {
-    LOG_WARNING << "Found in archive a file with bad file type: "
-                << archive_entry_filetype(entry);
+  if (filetype != AE_IFREG && filetype != AE_IFDIR) {
+    LOG_WARNING << "Found in archive a file with bad file type: " << filetype;
     return false;
   }
 
+  return true;
+}
+
+bool DockerTarballLoader::loadMetadataEntry(archive *arch, archive_entry *entry) {
+  const boost::filesystem::path pathname{archive_entry_pathname(entry)};
+  // Bad entries are skipped: validation fails if they are referenced.
+  if (! checkEntry(pathname, archive_entry_filetype(entry))) {
+    return true;
+  }
+
   // Do nothing for directory entries.
   if (archive_entry_filetype(entry) == AE_IFDIR)
     return true;
 
   assert(archive_entry_filetype(entry) == AE_IFREG);
 
-  // TODO: Should we make these comparisons case-insensitive?
-  if (pathname.extension() == JSON_EXT || pathname.filename() == JSON_FILE) {
+  if (isJsonEntry(pathname, static_cast<uint64_t>(archive_entry_size(entry)))) {
     return loadMetadataEntryJson(arch, entry);
   } else {
     return loadMetadataEntryOther(arch, entry);
   }
 }
 
+DockerTarballLoader::~DockerTarballLoader() {
+  if (tarball_fd_ >= 0) {
+    ::close(tarball_fd_);
+  }
+}
+
+bool DockerTarballLoader::openTarball() {
+  if (tarball_fd_ < 0) {
+    tarball_fd_ = ::open(tarball_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (tarball_fd_ < 0) {
+      LOG_WARNING << "Could not open '" << tarball_.string() << "': " << std::strerror(errno);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DockerTarballLoader::reopenTarball(const boost::filesystem::path &tarball) {
+  int fd = ::open(tarball.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG_WARNING << "Could not open '" << tarball.string() << "': " << std::strerror(errno);
+    return false;
+  }
+  if (tarball_fd_ >= 0) {
+    ::close(tarball_fd_);
+  }
+  tarball_ = tarball;
+  tarball_fd_ = fd;
+  return true;
+}
+
+unsigned DockerTarballLoader::getHashThreads() const {
+  if (hash_threads_ != 0) {
+    return hash_threads_;
+  }
+  return std::max(std::thread::hardware_concurrency(), 1U);
+}
+
 void DockerTarballLoader::loadMetadata() {
+  UpdateTrace::Scope trace("tarball first pass", tarball_.filename().string());
+  LOG_INFO << "Loading metadata from tarball: " << tarball_.string();
+  if (! openTarball()) {
+    throw std::runtime_error("Could not open '" + tarball_.string() + "'");
+  }
+
   archive *arch;
   archive_entry *entry;
 
-  LOG_INFO << "Loading metadata from tarball: " << tarball_.string();
-  auto archctrl = std::make_unique<ArchiveCtrl>(tarball_);
+  // Read ahead in another thread unless limited to a single one.
+  std::unique_ptr<ArchiveCtrl> archctrl;
+  if (getHashThreads() > 1) {
+    archctrl = std::make_unique<PrefetchingArchiveCtrl>(tarball_fd_);
+  } else {
+    archctrl = std::make_unique<ArchiveCtrl>(tarball_fd_);
+  }
 
   arch = archive_read_new();
   archive_read_support_filter_none(arch);
+  archive_read_support_filter_gzip(arch);
+  archive_read_support_filter_zstd(arch);
   archive_read_support_format_tar(arch);
   archive_read_open(arch, archctrl.get(), NULL, _arch_read, NULL);
 
   metamap_.clear();
   metastats_.clear();
   while (archive_read_next_header(arch, &entry) == ARCHIVE_OK) {
-    loadMetadataEntry(arch, entry);
+    if (! loadMetadataEntry(arch, entry)) {
+      const std::string pathname{archive_entry_pathname(entry)};
+      archive_read_free(arch);
+      throw std::runtime_error("Bad file '" + pathname + "' in tarball " + tarball_.string());
+    }
   }
+  compressed_ = (archive_filter_code(arch, 0) != ARCHIVE_FILTER_NONE);
+  content_length_ = static_cast<uint64_t>(archive_filter_bytes(arch, 0));
   archive_read_free(arch);
 
+  // The digest is defined over the whole (possibly compressed) file.
+  if (! archctrl->drain()) {
+    throw std::runtime_error("Could not read '" + tarball_.string() + "'");
+  }
+
   // Save original digest so we can check it upon loading the images.
   org_tarball_digest_ = archctrl->getHexDigest();
   org_tarball_length_ = archctrl->nread();
+  if (! compressed_) {
+    content_length_ = org_tarball_length_;
+  }
   LOG_DEBUG << "1st pass: tarball sha256=" << org_tarball_digest_
-            << ", len=" << org_tarball_length_ ;
-
-  LOG_TRACE << "nbytes_other: " << metastats_.nbytes_other
-            << ", nfiles_other: " << metastats_.nfiles_other;
-  LOG_TRACE << "nbytes_json: " << metastats_.nbytes_json
-            << ", nfiles_json: " << metastats_.nfiles_json;
-
-  LOG_TRACE << "Files in tarball:";
-  for (auto &value : metamap_) {
-    LOG_TRACE << value.second.getSHA256() << ": " << value.first;
+            << ", len=" << org_tarball_length_
+            << (compressed_ ? ", uncompressed len=" + std::to_string(content_length_) : "");
+
+  if (LOG_IS_ENABLED(trace)) {
+    LOG_TRACE << "nbytes_other: " << metastats_.nbytes_other
+              << ", nfiles_other: " << metastats_.nfiles_other;
+    LOG_TRACE << "nbytes_json: " << metastats_.nbytes_json
+              << ", nfiles_json: " << metastats_.nfiles_json;
+
+    LOG_TRACE << "Files in tarball:";
+    for (auto &value : metamap_) {
+      LOG_TRACE << value.second.getSHA256() << ": " << value.first;
+    }
   }
 }
 
-Json::Value DockerTarballLoader::metamapGetRoot(const std::string &key) {
+const Json::Value &DockerTarballLoader::metamapGetRoot(const std::string &key) {
   MetadataMap::iterator it = metamap_.find(key);
   ensure(it != metamap_.end(), "Key '" + key + "' not found in metamap");
   return it->second.getRoot();
@@ -342,31 +647,156 @@ std::string DockerTarballLoader::metamapGetSHA256(const std::string &key) {
   return it->second.getSHA256();
 }
 
-bool DockerTarballLoader::validateMetadata(StringToStringSet *expected_tags_per_image) {
+/**
+ * Get the name of the blob file with the given digest in an OCI layout.
+ */
+static std::string blobFileName(const std::string &digest) {
+  ensure(boost::starts_with(digest, SHA256_PREFIX), "Bad digest '" + digest + "' in OCI layout");
+  const std::string hash = digest.substr(SHA256_PREFIX.length());
+  ensure(hash.length() == 64 && std::all_of(hash.begin(), hash.end(), ::isxdigit),
+         "Bad digest '" + digest + "' in OCI layout");
+  return OCI_BLOBS_DIR + hash;
+}
+
+/**
+ * Get the name of an image (as Docker would show it in RepoTags) from the
+ * annotations of its entry in an OCI index; return an empty string if there
+ * is none.
+ */
+static std::string imageNameFromAnnotations(const Json::Value &annotations) {
+  if (! annotations.isObject()) {
+    return "";
+  }
+
+  std::string name;
+  if (annotations["io.containerd.image.name"].isString()) {
+    name = annotations["io.containerd.image.name"].asString();
+  } else if (annotations["org.opencontainers.image.ref.name"].isString()) {
+    // This can also be just a tag (e.g. "latest"), which does not identify
+    // the image.
+    name = annotations["org.opencontainers.image.ref.name"].asString();
+    const size_t slash = name.rfind('/');
+    if (name.find(':', slash == std::string::npos ? 0 : slash) == std::string::npos) {
+      return "";
+    }
+  }
+
+  // Docker shows the names of Docker Hub images in their short form.
+  static const std::string hub_prefix = "docker.io/";
+  static const std::string library_prefix = "library/";
+  if (boost::starts_with(name, hub_prefix)) {
+    name.erase(0, hub_prefix.length());
+    if (boost::starts_with(name, library_prefix) &&
+        name.find('/', library_prefix.length()) == std::string::npos) {
+      name.erase(0, library_prefix.length());
+    }
+  }
+  return name;
+}
+
+std::vector<DockerTarballLoader::ImageEntry> DockerTarballLoader::getImageEntries() {
+  // Recent `docker save` versions write both files: manifest.json is the
+  // one holding the tags.
+  if (metamap_.find(MANIFEST_FILE) != metamap_.end()) {
+    return getDockerImageEntries();
+  }
+  ensure(metamap_.find(OCI_INDEX_FILE) != metamap_.end(),
+         "no " + MANIFEST_FILE + " or " + OCI_INDEX_FILE + " in tarball");
+  return getOciImageEntries();
+}
+
+std::vector<DockerTarballLoader::ImageEntry> DockerTarballLoader::getDockerImageEntries() {
+  const Json::Value &manifest = metamapGetRoot(MANIFEST_FILE);
+  // LOG_INFO << "manifest:" << manifest;
+  ensure(manifest.isArray(), "bad manifest type");
+
+  std::vector<ImageEntry> images;
+  for (const auto &man: manifest) {
+    ensure(man.isMember("Config"), "no Config in manifest");
+    ImageEntry image;
+    image.config = man["Config"].asString();
+    for (const auto &layer : man["Layers"]) {
+      image.layers.push_back({layer.asString(), true});
+    }
+    if (man.isMember("RepoTags")) {
+      ensure(man["RepoTags"].isArray(), "bad RepoTags type");
+      for (const auto &tag : man["RepoTags"]) {
+        image.tags.insert(tag.asString());
+      }
+    }
+    images.push_back(image);
+  }
+  return images;
+}
+
+std::vector<DockerTarballLoader::ImageEntry> DockerTarballLoader::getOciImageEntries() {
+  const Json::Value &index = metamapGetRoot(OCI_INDEX_FILE);
+  ensure(index["manifests"].isArray(), "bad index type");
+
+  // The index has an entry per tag; entries of the same image are merged.
+  std::vector<ImageEntry> images;
+  std::map<std::string, size_t> image_by_manifest;
+  for (const auto &desc : index["manifests"]) {
+    const std::string man_file = blobFileName(desc["digest"].asString());
+    auto it = image_by_manifest.find(man_file);
+    if (it == image_by_manifest.end()) {
+      const DockerManifestWrapper manifest(metamapGetRoot(man_file));
+      ensure(! manifest.isMultiPlatform(), man_file + ": nested image indexes are not supported");
+      ImageEntry image;
+      image.config = blobFileName(manifest.getConfigDigest());
+      image.manifest = man_file;
+      for (const auto &layer : manifest.getLayers()) {
+        image.layers.push_back({blobFileName(layer["digest"].asString()),
+                                boost::ends_with(layer["mediaType"].asString(), ".tar")});
+      }
+      it = image_by_manifest.emplace(man_file, images.size()).first;
+      images.push_back(image);
+    }
+
+    const std::string name = imageNameFromAnnotations(desc["annotations"]);
+    if (! name.empty()) {
+      images[it->second].tags.insert(name);
+    }
+  }
+  return images;
+}
+
+bool DockerTarballLoader::validateMetadata(StringToStringSet *expected_tags_per_image,
+                                           const StringToString *expected_manifest_per_image) {
+  UpdateTrace::Scope trace("tarball validation", tarball_.filename().string());
   try {
-    Json::Value manifest = metamapGetRoot("manifest.json");
-    // LOG_INFO << "manifest:" << manifest;
-    ensure(manifest.isArray(), "bad manifest type");
+    const std::vector<ImageEntry> images = getImageEntries();
 
+    std::vector<std::string> image_ids;
     std::set<std::string> actual_image_ids;
 
     // ---
     // Check internal consistency.
     // ---
-    for (const auto &man: manifest) {
-      ensure(man.isMember("Config"), "no Config in manifest");
-      const boost::filesystem::path config(man["Config"].asString());
-      ensure(config.extension() == JSON_EXT, "bad config file extension");
+    for (const auto &image : images) {
+      const boost::filesystem::path config(image.config);
+      ensure(isBlobEntry(config) || config.extension() == JSON_EXT, "bad config file extension");
 
       // Ensure the configuration file has correct digest.
       const std::string imgid = metamapGetSHA256(config.string());
-      ensure(config.stem() == imgid,
+      const std::string name = isBlobEntry(config) ? config.filename().string() : config.stem().string();
+      ensure(name == imgid,
              imgid + ": config. file name does not match its own checksum");
 
       // Ensure there is only one configuration per image in the manifest.
       ensure(actual_image_ids.find(imgid) == actual_image_ids.end(),
              imgid + ": config. file declared multiple times in manifest");
       actual_image_ids.insert(imgid);
+      image_ids.push_back(imgid);
+    }
+
+    // Blobs are named by their digest: check all of them (including image
+    // manifests and compressed layers, which are not checked below).
+    for (auto &value : metamap_) {
+      if (isBlobEntry(value.first)) {
+        ensure(boost::filesystem::path(value.first).filename() == value.second.getSHA256(),
+               value.first + ": blob name does not match its own checksum");
+      }
     }
 
     LOG_DEBUG << this->tarball_.filename().string() << ": "
@@ -375,31 +805,34 @@ bool DockerTarballLoader::validateMetadata(StringToStringSet *expected_tags_per_
     // ---
     // Check internal consistency (not strictly required part).
     // ---
-    for (const auto &man: manifest) {
-      const boost::filesystem::path config(man["Config"].asString());
-      const Json::Value config_value = metamapGetRoot(config.string());
+    for (const auto &image : images) {
+      const Json::Value &config_value = metamapGetRoot(image.config);
 
       ensure(config_value["rootfs"]["diff_ids"].isArray(),
-             config.string() + ": bad config. object format");
-      ensure(config_value["rootfs"]["diff_ids"].size() == man["Layers"].size(),
-             config.string() + ": layer count mismatch");
+             image.config + ": bad config. object format");
+      ensure(config_value["rootfs"]["diff_ids"].size() == image.layers.size(),
+             image.config + ": layer count mismatch");
 
       const Json::Value &cfg_lhashes = config_value["rootfs"]["diff_ids"];
-      const Json::Value &man_layers = man["Layers"];
 
       for (Json::Value::ArrayIndex idx = 0; idx < cfg_lhashes.size(); idx++) {
         // Get expected hash.
         const std::string cfg_hash_(cfg_lhashes[idx].asString());
         ensure(boost::starts_with(cfg_hash_, SHA256_PREFIX),
-               config.string() + ": bad layer hash in config");
+               image.config + ": bad layer hash in config");
         const std::string cfg_hash = cfg_hash_.substr(SHA256_PREFIX.length());
 
-        // Get actual hash and check it.
-        const std::string tar_name(man_layers[idx].asString());
-        const std::string tar_hash(metamapGetSHA256(tar_name));
-        LOG_TRACE << "layer[" << idx << "]: "
-                  << cfg_hash.substr(0, 12) << " = " << tar_hash.substr(0, 12) << "?";
-        ensure(cfg_hash == tar_hash, config.string() + ": layer hash mismatch");
+        // Get actual hash and check it (compressed layers are identified by
+        // the digest of the compressed data, checked above, and anchored by
+        // the manifest digest, checked below).
+        const LayerFile &layer = image.layers[idx];
+        if (! layer.plain) {
+          continue;
+        }
+        const std::string tar_hash(metamapGetSHA256(layer.name));
+        LOG_TRACE_LAZY << "layer[" << idx << "]: "
+                       << cfg_hash.substr(0, 12) << " = " << tar_hash.substr(0, 12) << "?";
+        ensure(cfg_hash == tar_hash, image.config + ": layer hash mismatch");
       }
     }
 
@@ -422,24 +855,31 @@ bool DockerTarballLoader::validateMetadata(StringToStringSet *expected_tags_per_
              "Images in manifest do not match expected list");
 
       // Checks the list of tags related to each image.
-      for (const auto &man: manifest) {
-        const boost::filesystem::path config(man["Config"].asString());
-        const std::string imgid(config.stem().string());
-
-        static const char repo_tags_el[] = "RepoTags";
-        ensure(man.isMember(repo_tags_el), "no RepoTags in manifest");
-        ensure(man[repo_tags_el].isArray(), "bad RepoTags type");
-
+      for (size_t idx = 0; idx < images.size(); idx++) {
+        const std::string &imgid = image_ids[idx];
         std::set<std::string> &expected_repo_tags = expected_tags_per_image->at(imgid);
-        std::set<std::string> actual_repo_tags;
-        for (const auto &actual_tag : man[repo_tags_el]) {
-          actual_repo_tags.insert(actual_tag.asString());
-        }
-
-        ensure(actual_repo_tags == expected_repo_tags,
+        ensure(images[idx].tags == expected_repo_tags,
                imgid + ": does not have the expected tags");
       }
 
+      // Compressed layers are not checked against the diff_ids of the image
+      // configuration: the manifest listing their digests must be the
+      // expected one.
+      for (size_t idx = 0; idx < images.size(); idx++) {
+        const ImageEntry &image = images[idx];
+        const bool compressed = std::any_of(image.layers.begin(), image.layers.end(),
+                                            [](const LayerFile &layer) { return ! layer.plain; });
+        if (! compressed) {
+          continue;
+        }
+        const std::string &imgid = image_ids[idx];
+        ensure(expected_manifest_per_image != nullptr &&
+               expected_manifest_per_image->count(imgid) != 0 && ! image.manifest.empty(),
+               imgid + ": compressed layers but no expected manifest");
+        ensure(metamapGetSHA256(image.manifest) == expected_manifest_per_image->at(imgid),
+               imgid + ": manifest does not match the expected one");
+      }
+
       LOG_DEBUG << this->tarball_.filename().string() << ": "
                 << "tag validation passed";
     }
@@ -457,10 +897,14 @@ bool DockerTarballLoader::validateMetadata(StringToStringSet *expected_tags_per_
 }
 
 bool DockerTarballLoader::loadImages() {
-  // Open tarball as raw binary data.
-  std::ifstream infile(tarball_.string(), std::ios::binary);
-  if (! infile) {
-    LOG_WARNING << "Could not open '" << tarball_.string() << "'";
+  DockerProcessSink sink(docker_program);
+  return loadImages(sink);
+}
+
+bool DockerTarballLoader::loadImages(DockerLoadSink &sink) {
+  UpdateTrace::Scope trace("tarball second pass", tarball_.filename().string());
+  // Read the tarball through the descriptor used by loadMetadata().
+  if (! openTarball()) {
     return false;
   }
 
@@ -468,101 +912,193 @@ bool DockerTarballLoader::loadImages() {
   static constexpr const size_t num_blocks_power = 4;
   static constexpr const size_t num_blocks = (1U << num_blocks_power);
   static constexpr const size_t num_blocks_mask = num_blocks - 1U;
+  // Number of blocks sent at once (with a single vectored write) when the
+  // buffer is full; the remaining blocks are held back until the digest of
+  // the whole tarball has been checked.
+  static constexpr const size_t num_blocks_send = 4;
 
   struct Block {
     std::array<uint8_t, 16*1024> buf;
     size_t len;
-    bool used;
-    Block() : len(0), used(false) {}
-    void clear() { len = 0; used = false; }
+    Block() : len(0) {}
   };
   typedef std::array<Block, num_blocks> Blocks;
 
   auto blocks = std::make_unique<Blocks>();
-  unsigned block_index = 0;
+  size_t oldest_block = 0;  // Index of the oldest block not yet sent.
+  size_t used_blocks = 0;   // Number of blocks read but not yet sent.
+
+  auto send_blocks = [&](size_t count) {
+    std::array<struct iovec, num_blocks> iov;
+    for (size_t idx = 0; idx < count; idx++) {
+      auto &block = (*blocks)[(oldest_block + idx) & num_blocks_mask];
+      iov[idx].iov_base = block.buf.data();
+      iov[idx].iov_len = block.len;
+    }
+    oldest_block = (oldest_block + count) & num_blocks_mask;
+    used_blocks -= count;
+    return sink.write(iov.data(), static_cast<int>(count));
+  };
 
-  MultiPartSHA256Hasher hasher;
+  // The raw (possibly compressed) data is read and hashed by `archctrl`;
+  // compressed tarballs are decompressed by libarchive (reading through
+  // `archctrl`, which then reads ahead in another thread) and sent
+  // uncompressed to the sink.
+  std::unique_ptr<ArchiveCtrl> archctrl;
+  if (compressed_ && getHashThreads() > 1) {
+    archctrl = std::make_unique<PrefetchingArchiveCtrl>(tarball_fd_);
+  } else {
+    archctrl = std::make_unique<ArchiveCtrl>(tarball_fd_);
+  }
+  std::unique_ptr<archive, int (*)(archive *)> arch(nullptr, archive_read_free);
+  if (compressed_) {
+    archive_entry *entry;
+    arch.reset(archive_read_new());
+    archive_read_support_filter_gzip(arch.get());
+    archive_read_support_filter_zstd(arch.get());
+    archive_read_support_format_raw(arch.get());
+    if (archive_read_open(arch.get(), archctrl.get(), NULL, _arch_read, NULL) != ARCHIVE_OK ||
+        archive_read_next_header(arch.get(), &entry) != ARCHIVE_OK) {
+      LOG_WARNING << "Could not decompress '" << tarball_.string() << "': " << archive_error_string(arch.get());
+      return false;
+    }
+  }
 
-  // Prevent SIGPIPE in case the child program exits unexpectedly.
-  SignalBlocker blocker(SIGPIPE);
+  // Fill a block completely (unless the end of the data is reached).
+  auto fill_block = [&](Block &block) {
+    block.len = 0;
+    while (block.len < block.buf.size()) {
+      ssize_t count;
+      if (compressed_) {
+        count = archive_read_data(arch.get(), block.buf.data() + block.len, block.buf.size() - block.len);
+      } else {
+        count = archctrl->readInto(block.buf.data() + block.len, block.buf.size() - block.len);
+      }
+      if (count < 0) {
+        return false;
+      }
+      if (count == 0) {
+        break;
+      }
+      block.len += static_cast<size_t>(count);
+    }
+    return true;
+  };
 
-  bp::opstream docker_stdin;
-  // Run the `docker load` external program.
-  // bp::child docker_proc("/usr/bin/ls", bp::std_in < docker_stdin);
-  // bp::child docker_proc("/usr/bin/sha256sum", bp::std_in < docker_stdin);
-  bp::child docker_proc(DOCKER_PROGRAM, "load", bp::std_in < docker_stdin);
+  // Prevent SIGPIPE in case the consumer exits unexpectedly.
+  SignalBlocker blocker(SIGPIPE);
 
-  // TODO: Handle the program output if more control is needed. See:
-  // https://stackoverflow.com/questions/48678012/simultaneous-read-and-write-to-childs-stdio-using-boost-process
+  if (! sink.begin()) {
+    LOG_WARNING << "Could not start loading " << tarball_ << " into " << sink.describe();
+    return false;
+  }
 
-  // Read tarball, send it to `docker load` and determine its digest.
-  uint64_t nread = 0;
+  // Read tarball, send it to the sink and determine its digest.
+  bool sink_failed = false;
+  bool read_failed = false;
   for (;;) {
-    auto &cur_block = (*blocks)[block_index];
-    if (cur_block.used) {
-      // Block already used: send all data to external process.
-      docker_stdin.write(reinterpret_cast<char *>(cur_block.buf.data()), cur_block.len);
-      cur_block.clear();
+    if (used_blocks == num_blocks && ! send_blocks(num_blocks_send)) {
+      LOG_WARNING << "Could not send data to " << sink.describe();
+      sink_failed = true;
+      break;
     }
 
-    infile.read(reinterpret_cast<char *>(cur_block.buf.data()), cur_block.buf.size());
-    cur_block.len = infile.gcount();
-    cur_block.used = true;
+    auto &cur_block = (*blocks)[(oldest_block + used_blocks) & num_blocks_mask];
+    if (! fill_block(cur_block)) {
+      LOG_WARNING << "Could not read '" << tarball_.string() << "'";
+      read_failed = true;
+      break;
+    }
+    used_blocks++;
 
     // Prevent modifications of file size: this is very important to avoid attacks
     // where extraneous data is appended to the end marker of the tarball.
-    nread += infile.gcount();
-    if (nread > org_tarball_length_) {
+    if (archctrl->nread() > org_tarball_length_) {
       LOG_WARNING << "Size of tarball has changed (aborting)";
+      read_failed = true;
       break;
     }
 
-    // Update digest.
-    hasher.update(cur_block.buf.data(), static_cast<uint64_t>(cur_block.len));
+    if (cur_block.len < cur_block.buf.size()) break;
+  }
 
-    // Advance.
-    block_index = (block_index + 1) & num_blocks_mask;
-    if (! infile) break;
+  // Account for compressed data left unread by the decompressor.
+  arch.reset();
+  if (! read_failed && ! archctrl->drain()) {
+    LOG_WARNING << "Could not read '" << tarball_.string() << "'";
   }
 
-  // At this point, not all data has been sent to the child program. So here
-  // we decide whether or not to abort the process by truncating the stream.
-  std::string new_digest = boost::algorithm::to_lower_copy(hasher.getHexDigest());
+  // At this point, not all data has been sent to the sink. So here we decide
+  // whether or not to abort the process by truncating the stream.
+  std::string new_digest = archctrl->getHexDigest();
+  const uint64_t nread = archctrl->nread();
   LOG_TRACE << "2nd pass: tarball sha256=" << new_digest << ", len=" << nread;
 
   bool success = false;
-  if (org_tarball_digest_ == new_digest) {
+  if (sink_failed) {
+    // Nothing to do: the stream will be truncated.
+  } else if (org_tarball_digest_ == new_digest && org_tarball_length_ == nread) {
     // Send outstanding blocks if everything is good.
-    for (unsigned cnt = 0; cnt < num_blocks; cnt++) {
-      auto &cur_block = (*blocks)[block_index];
-      if (cur_block.used) {
-        // Block already used: send all data to external process.
-        docker_stdin.write(reinterpret_cast<char *>(cur_block.buf.data()), cur_block.len);
-        cur_block.clear();
-      }
-      block_index = (block_index + 1) & num_blocks_mask;
-    }
-
-    success = !docker_stdin.fail();
-
+    success = send_blocks(used_blocks);
   } else {
     // Digest changed from first time we took it.
     LOG_WARNING << "Digest of '" << tarball_.string() << "' has changed from '"
                 << org_tarball_digest_ << "' to '" << new_digest << "'";
   }
 
-  docker_stdin.flush();
-  docker_stdin.pipe().close();
-  docker_stdin.close();
+  // We have success only if the consumer succeeded (`docker load` imports
+  // the layers after the whole tarball has been received).
+  {
+    UpdateTrace::Scope finish_trace("docker load finish", tarball_.filename().string());
+    success = sink.finish(success) && success;
+  }
+
+  LOG_INFO << "Loading of " << tarball_ << " into " << sink.describe() << " finished, "
+           << "status: " << (success ? "success" : "failed");
 
-  docker_proc.wait();
+  return success;
+}
+
+std::string DockerTarballLoader::setDockerProgram(const std::string &program) {
+  std::string previous = program;
+  std::swap(previous, docker_program);
+  return previous;
+}
+
+std::vector<DockerTarballLoader::LayerList> DockerTarballLoader::getImageLayers() {
+  std::vector<LayerList> images;
+  for (const auto &image : getImageEntries()) {
+    const Json::Value &config_value = metamapGetRoot(image.config);
+    const Json::Value &cfg_lhashes = config_value["rootfs"]["diff_ids"];
+
+    LayerList layers;
+    for (Json::Value::ArrayIndex idx = 0; idx < cfg_lhashes.size(); idx++) {
+      const std::string &name = image.layers.at(idx).name;
+      const MetadataMap::iterator it = metamap_.find(name);
+      ensure(it != metamap_.end(), "Layer '" + name + "' not found in metamap");
+      // The size of compressed layers is only a lower bound of the space
+      // they take once loaded.
+      layers.push_back({cfg_lhashes[idx].asString().substr(SHA256_PREFIX.length()), it->second.getSize()});
+    }
+    images.push_back(layers);
+  }
+  return images;
+}
 
-  // We have success only if the loading program succeeded.
-  success = success && (docker_proc.exit_code() == 0);
+bool DockerTarballLoader::isImageLoaded(const std::string &image, const std::string &image_id) {
+  bp::ipstream docker_stdout;
+  std::error_code errcode;
+  bp::child docker_proc(docker_program, "image", "inspect", "--format", "{{.Id}}", image,
+                        bp::std_out > docker_stdout, bp::std_err > bp::null, errcode);
+  if (errcode) {
+    LOG_WARNING << "Could not run " << docker_program << ": " << errcode.message();
+    return false;
+  }
 
-  LOG_INFO << "Loading of " << tarball_ << " finished, "
-           << "code: " << docker_proc.exit_code()
-           << ", status: " << (success ? "success" : "failed");
+  std::string actual_id;
+  std::getline(docker_stdout, actual_id);
+  docker_proc.wait();
 
-  return success;
+  boost::algorithm::trim(actual_id);
+  return (docker_proc.exit_code() == 0) && (actual_id == SHA256_PREFIX + image_id);
 }
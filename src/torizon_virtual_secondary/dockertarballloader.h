@@ -2,33 +2,42 @@
 #define SECONDARY_DOCKERTARBALLLOADER_H_
 
 #include <boost/filesystem/path.hpp>
+#include <json/reader.h>
 #include <json/value.h>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
 struct archive;
 struct archive_entry;
+class DockerLoadSink;
 
 // TODO: Should we put this in some specific namespace?
 
 /**
  * Class for validating and loading tarballs produced by the `docker save`
- * command.
+ * command or holding images in the OCI image layout (index.json and
+ * blobs/sha256/), possibly compressed with gzip or zstd.
  */
 class DockerTarballLoader {
   public:
     class MetaInfo {
       protected:
         std::string sha256_;  // Metadata file's digest.
+        uint64_t size_;       // Metadata file's size.
         Json::Value root_;    // Metadata in the file.
       public:
-        explicit MetaInfo(const std::string &sha256)
-          : sha256_(sha256), root_() {}
-        MetaInfo(const std::string &sha256, Json::Value &root)
-          : sha256_(sha256), root_(root) {}
+        MetaInfo(const std::string &sha256, uint64_t size)
+          : sha256_(sha256), size_(size), root_() {}
+        MetaInfo(const std::string &sha256, uint64_t size, Json::Value &root)
+          : sha256_(sha256), size_(size), root_(root) {}
+        // Only the metadata fields used by the loader are kept.
         Json::Value &getRoot() { return root_; }
+        const Json::Value &getRoot() const { return root_; }
         std::string &getSHA256() { return sha256_; }
+        uint64_t getSize() const { return size_; }
     };
 
     typedef std::map<std::string, MetaInfo> MetadataMap;
@@ -47,20 +56,49 @@ class DockerTarballLoader {
     };
 
     typedef std::map<std::string, std::set<std::string>> StringToStringSet;
+    typedef std::map<std::string, std::string> StringToString;
+
+    struct LayerInfo {
+      std::string diff_id;  // Digest of the uncompressed layer (without prefix).
+      uint64_t size;        // Size of the layer file (compressed in some OCI layouts).
+    };
+
+    typedef std::vector<LayerInfo> LayerList;
 
   public:
     /**
      * Constructor.
      */
     explicit DockerTarballLoader(const boost::filesystem::path& tarball)
-      : tarball_(tarball), org_tarball_length_(0) {}
+      : tarball_(tarball), tarball_fd_(-1), org_tarball_length_(0),
+        compressed_(false), content_length_(0), hash_threads_(0) {}
+
+    /**
+     * Destructor: closes the tarball.
+     */
+    ~DockerTarballLoader();
+
+    DockerTarballLoader(const DockerTarballLoader &) = delete;
+    DockerTarballLoader &operator=(const DockerTarballLoader &) = delete;
 
     /**
      * Parse tarball archive and load all metadata (JSON) files into
      * memory. It also determines the sha256 of all files in the tarball.
+     *
+     * Tarballs are read once, sequentially, with the reading and hashing of
+     * the (possibly compressed) data done ahead in another thread.
+     *
+     * In case of errors, a `std::runtime_error` exception will be thrown.
      */
     void loadMetadata();
 
+    /**
+     * Set the number of threads used for reading and hashing tarballs: 0 (the
+     * default) means one per CPU; with a single thread tarballs are not read
+     * ahead in another thread (in either pass).
+     */
+    void setHashThreads(unsigned threads) { hash_threads_ = threads; }
+
     /**
      * Validate the metadata loaded by loadMetadata().
      *
@@ -68,30 +106,124 @@ class DockerTarballLoader {
      *  images in the tarball; the values are sets containing the expected tags
      *  each image must have; if this parameter is null then only internal
      *  validation of the tarball will be performed.
+     * @param expected_manifest_per_image digest (without prefix) of the
+     *  manifest of each expected image; compressed layers (OCI layouts) are
+     *  only identified by the manifest, so images having any are refused
+     *  unless their manifest in the tarball has this digest.
      */
-    bool validateMetadata(StringToStringSet *expected_tags_per_image = nullptr);
+    bool validateMetadata(StringToStringSet *expected_tags_per_image = nullptr,
+                          const StringToString *expected_manifest_per_image = nullptr);
 
     /**
      * Load the Docker images from the tarball; this function does not call
      * validateMetadata(); thus, it would be possible to load the images even
      * if no validation was performed (or if it failed); that decision is left
      * at the discretion of the caller.
+     *
+     * The images are loaded by running `docker load`.
      */
     bool loadImages();
 
+    /**
+     * Same as loadImages() but sending the tarball to the specified sink.
+     */
+    bool loadImages(DockerLoadSink &sink);
+
+    /**
+     * Read the tarball from `tarball` in the second pass (loadImages()), e.g.
+     * from a snapshot taken after loadMetadata(); its contents are still
+     * checked against the digest determined by loadMetadata().
+     *
+     * @return false if the new tarball could not be opened (the current one
+     *  is kept in that case).
+     */
+    bool reopenTarball(const boost::filesystem::path& tarball);
+
+    /**
+     * Get the layers of each image in the tarball, from the bottom to the top
+     * of the image; this should only be called after validateMetadata()
+     * succeeded.
+     */
+    std::vector<LayerList> getImageLayers();
+
+    /**
+     * Get the size of the tarball as determined by loadMetadata().
+     */
+    uint64_t getTarballLength() const { return org_tarball_length_; }
+
+    /**
+     * Get the size of the uncompressed tarball as determined by loadMetadata()
+     * (same as getTarballLength() for uncompressed tarballs).
+     */
+    uint64_t getContentLength() const { return content_length_; }
+
+    /**
+     * Ask the Docker daemon whether an image is present with the given tag.
+     *
+     * @param image image name with tag.
+     * @param image_id expected image ID (digest of its config. object,
+     *  without the sha256 prefix).
+     * @return true iff the tag exists and refers to the expected image ID.
+     */
+    static bool isImageLoaded(const std::string &image, const std::string &image_id);
+
+    /**
+     * Set the docker CLI to be run (/usr/bin/docker by default); meant for
+     * tests and benchmarks.
+     * @return the program run until now.
+     */
+    static std::string setDockerProgram(const std::string &program);
+
   protected:
     boost::filesystem::path tarball_;
+    // The tarball is opened only once and the same file description is used
+    // by both passes (metadata loading and image loading), so replacing the
+    // file in between has no effect (unless reopenTarball() is called);
+    // modifications of its contents are caught by the digest check done while
+    // streaming it in the second pass.
+    int tarball_fd_;
     std::string org_tarball_digest_;
     uint64_t org_tarball_length_;
+    // Tarballs can be compressed with gzip or zstd: the digest is that of
+    // the compressed file while layers are checked on the uncompressed data.
+    bool compressed_;
+    uint64_t content_length_;
+    unsigned hash_threads_;
     MetadataMap metamap_;
     MetaStats metastats_;
+    // Buffer and parser reused for all the JSON files in the tarball.
+    std::vector<uint8_t> json_buffer_;
+    std::unique_ptr<Json::CharReader> json_reader_;
 
+    bool openTarball();
+    unsigned getHashThreads() const;
     bool loadMetadataEntry(archive *arch, archive_entry *entry);
     bool loadMetadataEntryJson(archive *arch, archive_entry *entry);
     bool loadMetadataEntryOther(archive *arch, archive_entry *entry);
+    uint8_t *getJsonBuffer();
+    bool checkEntry(const boost::filesystem::path &pathname, unsigned filetype);
+    bool storeEntryJson(const boost::filesystem::path &pathname, const uint8_t *data, uint64_t count);
+    bool storeEntryOther(const boost::filesystem::path &pathname, const std::string &digest, uint64_t size);
 
-    Json::Value metamapGetRoot(const std::string &key);
+    const Json::Value &metamapGetRoot(const std::string &key);
     std::string metamapGetSHA256(const std::string &key);
+
+    // Image in the tarball as described by manifest.json (`docker save`
+    // format) or by index.json and the image manifests (OCI image layout).
+    struct LayerFile {
+      std::string name;
+      bool plain;  // Whether the layer is an uncompressed tar (named by its diff_id).
+    };
+    struct ImageEntry {
+      std::string config;    // Name of the image configuration file.
+      std::string manifest;  // Name of the image manifest blob (OCI layouts only).
+      std::vector<LayerFile> layers;
+      std::set<std::string> tags;
+    };
+
+    std::vector<ImageEntry> getImageEntries();
+    std::vector<ImageEntry> getDockerImageEntries();
+    std::vector<ImageEntry> getOciImageEntries();
 };
 
 #endif /* SECONDARY_DOCKERTARBALLLOADER_H_ */
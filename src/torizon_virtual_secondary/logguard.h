@@ -0,0 +1,31 @@
+#ifndef SECONDARY_LOGGUARD_H_
+#define SECONDARY_LOGGUARD_H_
+
+#include <boost/log/trivial.hpp>
+
+#include "logging/logging.h"
+
+/**
+ * Check whether messages of a given severity (trace, debug, info, warning,
+ * error or fatal) are currently logged. This is a plain comparison with the
+ * logger's threshold, which is much cheaper than having the logging core
+ * open and reject a record; it is meant for skipping loops or formatting
+ * that only produce log output:
+ *
+ *     if (LOG_IS_ENABLED(trace)) {
+ *       for (const auto &item : items) {
+ *         LOG_TRACE << describe(item);
+ *       }
+ *     }
+ */
+#define LOG_IS_ENABLED(sev) \
+  (loggerGetSeverity() <= static_cast<int>(boost::log::trivial::sev))
+
+/**
+ * Variants of LOG_TRACE and LOG_DEBUG for hot paths: when the severity is
+ * disabled, neither a log record is opened nor are the arguments evaluated.
+ */
+#define LOG_TRACE_LAZY if (! LOG_IS_ENABLED(trace)) {} else LOG_TRACE
+#define LOG_DEBUG_LAZY if (! LOG_IS_ENABLED(debug)) {} else LOG_DEBUG
+
+#endif /* SECONDARY_LOGGUARD_H_ */
@@ -9,6 +9,7 @@
 
 #include "crypto/crypto.h"
 #include "logging/logging.h"
+#include "offlinemetadatasnapshot.h"
 #include "storage/invstorage.h"
 #include "uptane/directorrepository.h"
 #include "uptane/imagerepository.h"
@@ -17,9 +18,41 @@
 #include "utilities/exceptions.h"
 #include "utilities/fault_injection.h"
 #include "utilities/utils.h"
+#include "verifiedmetadatacache.h"
 
 namespace Primary {
 
+constexpr const char* const ManagedSecondaryConfig::KeyTypeField;
+constexpr const char* const ManagedSecondaryConfig::PruneImagesField;
+
+KeyType ManagedSecondaryConfig::keyTypeFromString(const std::string &str) {
+  if (str == "ED25519" || str == "ed25519") {
+    return KeyType::kED25519;
+  } else if (str == "RSA2048" || str == "rsa2048") {
+    return KeyType::kRSA2048;
+  } else if (str == "RSA3072" || str == "rsa3072") {
+    return KeyType::kRSA3072;
+  } else if (str == "RSA4096" || str == "rsa4096") {
+    return KeyType::kRSA4096;
+  }
+  throw std::invalid_argument("Unsupported secondary key type: " + str);
+}
+
+std::string ManagedSecondaryConfig::keyTypeToString(KeyType key_type) {
+  switch (key_type) {
+    case KeyType::kED25519:
+      return "ED25519";
+    case KeyType::kRSA2048:
+      return "RSA2048";
+    case KeyType::kRSA3072:
+      return "RSA3072";
+    case KeyType::kRSA4096:
+      return "RSA4096";
+    default:
+      return "unknown";
+  }
+}
+
 ManagedSecondary::ManagedSecondary(Primary::ManagedSecondaryConfig sconfig_in) : sconfig(std::move(sconfig_in)) {
   struct stat st {};
   if (!boost::filesystem::is_directory(sconfig.metadata_path)) {
@@ -44,16 +77,32 @@ ManagedSecondary::ManagedSecondary(Primary::ManagedSecondaryConfig sconfig_in) :
   }
 
   std::string public_key_string;
-  if (!loadKeys(&public_key_string, &private_key)) {
-    if (!Crypto::generateKeyPair(sconfig.key_type, &public_key_string, &private_key)) {
-      LOG_ERROR << "Could not generate RSA keys for secondary " << ManagedSecondary::getSerial() << "@"
-                << sconfig.ecu_hardware_id;
-      throw std::runtime_error("Unable to generate secondary RSA keys");
+  if (loadKeys(&public_key_string, &private_key)) {
+    // Keep the type of the stored keys: RSA keys are PEM encoded, Ed25519
+    // keys are hex encoded.
+    if (public_key_string.find("-----BEGIN") != std::string::npos) {
+      if (sconfig.key_type != KeyType::kRSA2048 && sconfig.key_type != KeyType::kRSA3072 &&
+          sconfig.key_type != KeyType::kRSA4096) {
+        sconfig.key_type = KeyType::kRSA2048;
+      }
+    } else {
+      sconfig.key_type = KeyType::kED25519;
     }
+    public_key_ = PublicKey(public_key_string, sconfig.key_type);
+    storeKeys(public_key_.Value(), private_key);
+  } else {
+    // Key generation is slow on small devices (especially RSA), so it is run
+    // in the background while storage and metadata are being loaded.
+    keys_future_ = std::async(std::launch::async, [this]() {
+      std::pair<std::string, std::string> keys;
+      if (!Crypto::generateKeyPair(sconfig.key_type, &keys.first, &keys.second)) {
+        throw std::runtime_error("Unable to generate secondary " +
+                                 ManagedSecondaryConfig::keyTypeToString(sconfig.key_type) + " keys");
+      }
+      storeKeys(PublicKey(keys.first, sconfig.key_type).Value(), keys.second);
+      return keys;
+    });
   }
-  public_key_ = PublicKey(public_key_string, sconfig.key_type);
-
-  storeKeys(public_key_.Value(), private_key);
 
   storage_config_.path = sconfig.full_client_dir;
   storage_ = INvStorage::newStorage(storage_config_);
@@ -71,6 +120,65 @@ ManagedSecondary::ManagedSecondary(Primary::ManagedSecondaryConfig sconfig_in) :
 
 ManagedSecondary::~ManagedSecondary() {}  // NOLINT(modernize-use-equals-default, hicpp-use-equals-default)
 
+// Metadata roles kept in the storage of a Secondary, roots first.
+static const std::vector<std::pair<Uptane::RepositoryType, Uptane::Role>> &storedRoles() {
+  static const std::vector<std::pair<Uptane::RepositoryType, Uptane::Role>> roles = {
+      {Uptane::RepositoryType::Director(), Uptane::Role::Root()},
+      {Uptane::RepositoryType::Director(), Uptane::Role::Targets()},
+      {Uptane::RepositoryType::Image(), Uptane::Role::Root()},
+      {Uptane::RepositoryType::Image(), Uptane::Role::Timestamp()},
+      {Uptane::RepositoryType::Image(), Uptane::Role::Snapshot()},
+      {Uptane::RepositoryType::Image(), Uptane::Role::Targets()},
+  };
+  return roles;
+}
+
+static std::vector<std::string> loadStoredState(INvStorage &storage) {
+  std::vector<std::string> state;
+  for (const auto &role : storedRoles()) {
+    std::string data;
+    if (role.second == Uptane::Role::Root()) {
+      storage.loadLatestRoot(&data, role.first);
+    } else {
+      storage.loadNonRoot(&data, role.first, role.second);
+    }
+    state.push_back(data);
+  }
+  return state;
+}
+
+static std::string metadataKey(const std::vector<std::string> &state, const Uptane::MetaBundle &bundle) {
+  std::string digests;
+  for (const auto &data : state) {
+    digests += Crypto::sha256digestHex(data) + ";";
+  }
+  digests += "|";
+  for (const auto &meta : bundle) {
+    digests += meta.first.first.ToString() + "/" + meta.first.second.ToString() + "=" +
+               Crypto::sha256digestHex(meta.second) + ";";
+  }
+  return Crypto::sha256digestHex(digests);
+}
+
+void ManagedSecondary::storeVerifiedState(const std::vector<std::string> &state) {
+  std::vector<std::string> current = loadStoredState(*storage_);
+  for (size_t i = 0; i < storedRoles().size() && i < state.size(); ++i) {
+    const auto &repo = storedRoles()[i].first;
+    const auto &role = storedRoles()[i].second;
+    if (state[i].empty() || state[i] == current[i]) {
+      continue;
+    }
+    if (role == Uptane::Role::Root()) {
+      const int version = (repo == Uptane::RepositoryType::Director()) ? director_repo_->rootVersion()
+                                                                        : image_repo_->rootVersion();
+      storage_->storeRoot(state[i], repo, Uptane::Version(version));
+      storage_->clearNonRootMeta(repo);
+    } else {
+      storage_->storeNonRoot(state[i], repo, role);
+    }
+  }
+}
+
 data::InstallationResult ManagedSecondary::putMetadata(const Uptane::Target &target) {
   detected_attack = "";
 
@@ -81,6 +189,16 @@ data::InstallationResult ManagedSecondary::putMetadata(const Uptane::Target &tar
   }
   Uptane::SecondaryMetadata metadata(bundle);
 
+  const std::string key = metadataKey(loadStoredState(*storage_), bundle);
+  VerifiedMetadataCache::Entry verified;
+  if (VerifiedMetadataCache::instance().find(key, &verified)) {
+    LOG_DEBUG << "Metadata for secondary " << getSerial() << " already verified, reusing the result";
+    director_repo_ = std_::make_unique<Uptane::DirectorRepository>(*verified.director_repo);
+    image_repo_ = std_::make_unique<Uptane::ImageRepository>(*verified.image_repo);
+    storeVerifiedState(verified.state);
+    return data::InstallationResult(data::ResultCode::Numeric::kOk, "");
+  }
+
   // 2. Download and check the Root metadata file from the Director repository.
   // 3. NOT SUPPORTED: Download and check the Timestamp metadata file from the Director repository.
   // 4. NOT SUPPORTED: Download and check the Snapshot metadata file from the Director repository.
@@ -105,6 +223,11 @@ data::InstallationResult ManagedSecondary::putMetadata(const Uptane::Target &tar
     return data::InstallationResult(data::ResultCode::Numeric::kVerificationFailed, detected_attack);
   }
 
+  verified.director_repo = std::make_shared<const Uptane::DirectorRepository>(*director_repo_);
+  verified.image_repo = std::make_shared<const Uptane::ImageRepository>(*image_repo_);
+  verified.state = loadStoredState(*storage_);
+  VerifiedMetadataCache::instance().insert(key, std::move(verified));
+
   // 10. Verify that Targets metadata from the Director and Image repositories match.
   // FIXME: [TORIZON] Skip this check since it does not support delegations which we use.
   // See here: https://github.com/uptane/aktualizr/issues/80
@@ -164,11 +287,18 @@ data::InstallationResult ManagedSecondary::putMetadataOffUpd(const Uptane::Targe
   }
   storage_->stashEcuSerialsForHwId(serials);
 
+  // Both repositories verify the in-memory copy of the offline metadata
+  // shared with the other Secondaries instead of reading it from the update
+  // media on each access.
+  std::shared_ptr<OfflineMetadataSnapshot> pinned =
+      offline_metadata_ ? offline_metadata_->current() : std::make_shared<OfflineMetadataSnapshot>();
+  SnapshotFetcher snapshot(fetcher, *pinned);
+
   // 2. Download and check the Root metadata file from the Director repository.
   // 3. Download and check the offline Snapshot metadata file from the Director repository.
   // 4. Download and check the offline Targets metadata file from the Director repository.
   try {
-    director_repo_->updateMetaOffUpd(*storage_, fetcher);
+    director_repo_->updateMetaOffUpd(*storage_, snapshot);
   } catch (const std::exception &e) {
     detected_attack = std::string("Failed to update Director metadata: ") + e.what();
     LOG_ERROR << detected_attack;
@@ -179,7 +309,7 @@ data::InstallationResult ManagedSecondary::putMetadataOffUpd(const Uptane::Targe
   // 7. Download and check the offline Snapshot metadata file from the Image repository.
   // 8. Download and check the offline Targets metadata file from the Image repository.
   try {
-    image_repo_->updateMetaOffUpd(*storage_, fetcher);
+    image_repo_->updateMetaOffUpd(*storage_, snapshot);
   } catch (const std::exception &e) {
     detected_attack = std::string("Failed to update Image repo metadata: ") + e.what();
     LOG_ERROR << detected_attack;
@@ -256,10 +386,18 @@ data::InstallationResult ManagedSecondary::install(const Uptane::Target &target,
   out_file.close();
 
   Utils::writeFile(sconfig.target_name_path, target.filename());
+  invalidateManifest();
   return data::InstallationResult(data::ResultCode::Numeric::kOk, "");
 }
 
 Uptane::Manifest ManagedSecondary::getManifest() const {
+  std::lock_guard<std::mutex> guard(manifest_mutex_);
+  const std::string stamp = firmwareStamp();
+  if (!manifest_cache_.isNull() && stamp == manifest_cache_stamp_ && detected_attack == manifest_cache_attack_) {
+    manifest_hits_++;
+    return manifest_cache_;
+  }
+
   Uptane::InstalledImageInfo firmware_info;
   if (!getFirmwareInfo(firmware_info)) {
     return Json::Value(Json::nullValue);
@@ -273,19 +411,53 @@ Uptane::Manifest ManagedSecondary::getManifest() const {
 
   Json::Value signed_ecu_version;
 
-  std::string b64sig = Utils::toBase64(Crypto::RSAPSSSign(nullptr, private_key, Utils::jsonToCanonicalStr(manifest)));
+  waitForKeys();
   Json::Value signature;
-  signature["method"] = "rsassa-pss";
-  signature["sig"] = b64sig;
+  if (sconfig.key_type == KeyType::kED25519) {
+    signature["method"] = "ed25519";
+    signature["sig"] = Utils::toBase64(
+        Crypto::ED25519Sign(boost::algorithm::unhex(private_key), Utils::jsonToCanonicalStr(manifest)));
+  } else {
+    signature["method"] = "rsassa-pss";
+    signature["sig"] = Utils::toBase64(Crypto::RSAPSSSign(nullptr, private_key, Utils::jsonToCanonicalStr(manifest)));
+  }
 
   signature["keyid"] = public_key_.KeyId();
   signed_ecu_version["signed"] = manifest;
   signed_ecu_version["signatures"] = Json::Value(Json::arrayValue);
   signed_ecu_version["signatures"].append(signature);
 
+  manifest_cache_ = signed_ecu_version;
+  manifest_cache_stamp_ = stamp;
+  manifest_cache_attack_ = detected_attack;
+  manifest_signs_++;
+  LOG_DEBUG << "Signed manifest of secondary " << getSerial() << " (cache hits: " << manifest_hits_
+            << ", signed: " << manifest_signs_ << ")";
+
   return signed_ecu_version;
 }
 
+void ManagedSecondary::invalidateManifest() {
+  std::lock_guard<std::mutex> guard(manifest_mutex_);
+  manifest_cache_ = Json::Value(Json::nullValue);
+}
+
+// Identity of the installed firmware files: any rewrite changes the inode, the
+// size or the modification time of at least one of them.
+std::string ManagedSecondary::firmwareStamp() const {
+  std::string stamp;
+  for (const auto &path : {sconfig.firmware_path, sconfig.target_name_path}) {
+    struct stat st {};
+    if (stat(path.c_str(), &st) < 0) {
+      stamp += "none;";
+      continue;
+    }
+    stamp += std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) + ":" + std::to_string(st.st_size) + ":" +
+             std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec) + ";";
+  }
+  return stamp;
+}
+
 bool ManagedSecondary::getFirmwareInfo(Uptane::InstalledImageInfo &firmware_info) const {
   std::string content;
 
@@ -302,7 +474,25 @@ bool ManagedSecondary::getFirmwareInfo(Uptane::InstalledImageInfo &firmware_info
   return true;
 }
 
-void ManagedSecondary::storeKeys(const std::string &pub_key, const std::string &priv_key) {
+void ManagedSecondary::waitForKeys() const {
+  std::lock_guard<std::mutex> guard(keys_mutex_);
+  if (!keys_future_.valid()) {
+    return;
+  }
+
+  std::pair<std::string, std::string> keys;
+  try {
+    keys = keys_future_.get();
+  } catch (const std::exception &e) {
+    LOG_ERROR << "Could not generate keys for secondary " << sconfig.ecu_serial << "@" << sconfig.ecu_hardware_id << ": "
+              << e.what();
+    throw;
+  }
+  public_key_ = PublicKey(keys.first, sconfig.key_type);
+  private_key = keys.second;
+}
+
+void ManagedSecondary::storeKeys(const std::string &pub_key, const std::string &priv_key) const {
   Utils::writeFile((sconfig.full_client_dir / sconfig.ecu_private_key), priv_key);
   Utils::writeFile((sconfig.full_client_dir / sconfig.ecu_public_key), pub_key);
 }
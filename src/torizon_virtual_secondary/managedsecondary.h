@@ -1,8 +1,12 @@
 #ifndef PRIMARY_MANAGEDSECONDARY_H_
 #define PRIMARY_MANAGEDSECONDARY_H_
 
+#include <atomic>
 #include <future>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <boost/filesystem.hpp>
@@ -22,10 +26,17 @@ class INvStorage;
 
 namespace Primary {
 
+class OfflineUpdateMetadata;
+
 class ManagedSecondaryConfig : public SecondaryConfig {
  public:
   explicit ManagedSecondaryConfig(const std::string& type = "managed") : SecondaryConfig(type) {}
 
+  static constexpr const char* const KeyTypeField{"key_type"};
+  static constexpr const char* const PruneImagesField{"prune_unused_images"};
+  static KeyType keyTypeFromString(const std::string& str);
+  static std::string keyTypeToString(KeyType key_type);
+
   bool partial_verifying{false};
   std::string ecu_serial;
   std::string ecu_hardware_id;
@@ -35,7 +46,12 @@ class ManagedSecondaryConfig : public SecondaryConfig {
   boost::filesystem::path firmware_path;
   boost::filesystem::path target_name_path;
   boost::filesystem::path metadata_path;
-  KeyType key_type{KeyType::kRSA2048};
+  // Type of the keys generated for new ECUs; ECUs keep the type of their
+  // stored keys.
+  KeyType key_type{KeyType::kED25519};
+  // Whether unused container images may be removed when there is not enough
+  // storage for a container update (otherwise the update fails).
+  bool prune_unused_images{false};
 };
 
 // ManagedSecondary is an abstraction over virtual and other types of legacy
@@ -57,10 +73,14 @@ class ManagedSecondary : public SecondaryInterface {
     if (!sconfig.ecu_serial.empty()) {
       return Uptane::EcuSerial(sconfig.ecu_serial);
     }
+    waitForKeys();
     return Uptane::EcuSerial(public_key_.KeyId());
   }
   Uptane::HardwareIdentifier getHwId() const override { return Uptane::HardwareIdentifier(sconfig.ecu_hardware_id); }
-  PublicKey getPublicKey() const override { return public_key_; }
+  PublicKey getPublicKey() const override {
+    waitForKeys();
+    return public_key_;
+  }
   data::InstallationResult putMetadata(const Uptane::Target& target) override;
   int getRootVersion(bool director) const override;
   data::InstallationResult putRoot(const std::string& root, bool director) override;
@@ -72,28 +92,58 @@ class ManagedSecondary : public SecondaryInterface {
 
   bool loadKeys(std::string* pub_key, std::string* priv_key);
 
+  // Number of getManifest() calls answered from the cache and number of
+  // manifests actually built and signed.
+  uint64_t manifestCacheHits() const { return manifest_hits_; }
+  uint64_t manifestSigns() const { return manifest_signs_; }
+
   // TODO: [OFFUPD] #ifdef BUILD_OFFLINE_UPDATES
 #if 1
   data::InstallationResult putMetadataOffUpd(const Uptane::Target& target, const Uptane::OfflineUpdateFetcher& fetcher) override;
 #endif
+  // Share the offline update metadata read by the other Secondaries (see
+  // OfflineUpdateMetadata); without it each call reads the update media.
+  void setOfflineMetadata(std::shared_ptr<OfflineUpdateMetadata> offline_metadata) {
+    offline_metadata_ = std::move(offline_metadata);
+  }
 
  protected:
   ManagedSecondary(ManagedSecondary&&) = default;
   ManagedSecondary& operator=(ManagedSecondary&&) = default;
 
   virtual bool getFirmwareInfo(Uptane::InstalledImageInfo& firmware_info) const;
+  // Force the next getManifest() call to rebuild and sign the manifest.
+  void invalidateManifest();
+  // Wait for the keys of a new ECU being generated in the background.
+  void waitForKeys() const;
 
   std::shared_ptr<SecondaryProvider> secondary_provider_;
   Primary::ManagedSecondaryConfig sconfig;
   std::string detected_attack;
 
  private:
-  void storeKeys(const std::string& pub_key, const std::string& priv_key);
+  void storeKeys(const std::string& pub_key, const std::string& priv_key) const;
+  // Store metadata verified on behalf of another Secondary.
+  void storeVerifiedState(const std::vector<std::string>& state);
+  std::string firmwareStamp() const;
 
   std::unique_ptr<Uptane::DirectorRepository> director_repo_;
   std::unique_ptr<Uptane::ImageRepository> image_repo_;
-  PublicKey public_key_;
-  std::string private_key;
+  std::shared_ptr<OfflineUpdateMetadata> offline_metadata_;
+  // Keys of new ECUs are generated in the background (see waitForKeys()).
+  mutable std::future<std::pair<std::string, std::string>> keys_future_;
+  mutable std::mutex keys_mutex_;
+  mutable PublicKey public_key_;
+  mutable std::string private_key;
+
+  // Last signed manifest, valid as long as the firmware files (identified by
+  // firmwareStamp()) and the detected attack do not change.
+  mutable std::mutex manifest_mutex_;
+  mutable Json::Value manifest_cache_;
+  mutable std::string manifest_cache_stamp_;
+  mutable std::string manifest_cache_attack_;
+  mutable std::atomic<uint64_t> manifest_hits_{0};
+  mutable std::atomic<uint64_t> manifest_signs_{0};
   StorageConfig storage_config_;
   std::shared_ptr<INvStorage> storage_;
 };
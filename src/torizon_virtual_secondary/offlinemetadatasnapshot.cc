@@ -0,0 +1,56 @@
+#include "offlinemetadatasnapshot.h"
+
+#include "logging/logging.h"
+
+namespace Primary {
+
+template <class Fetch>
+void OfflineMetadataSnapshot::serve(const std::string &key, std::string *result, int64_t maxsize,
+                                    Fetch fetch) const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    std::string data;
+    fetch(&data);
+    LOG_DEBUG << "Offline metadata " << key << " pinned (" << data.size() << " bytes)";
+    it = entries_.emplace(key, std::move(data)).first;
+  }
+  if (maxsize > 0 && static_cast<int64_t>(it->second.size()) > maxsize) {
+    throw std::runtime_error("Offline metadata " + key + " exceeds the maximum size");
+  }
+  *result = it->second;
+}
+
+void OfflineMetadataSnapshot::fetchRole(const Uptane::OfflineUpdateFetcher &source, std::string *result,
+                                        int64_t maxsize, Uptane::RepositoryType repo, const Uptane::Role &role,
+                                        Uptane::Version version, const api::FlowControlToken *flow_control) const {
+  const std::string key = repo.ToString() + "/" + role.ToString() + "/" + std::to_string(version.version());
+  serve(key, result, maxsize,
+        [&](std::string *data) { source.fetchRole(data, maxsize, repo, role, version, flow_control); });
+}
+
+void OfflineMetadataSnapshot::fetchLatestRole(const Uptane::OfflineUpdateFetcher &source, std::string *result,
+                                              int64_t maxsize, Uptane::RepositoryType repo, const Uptane::Role &role,
+                                              const api::FlowControlToken *flow_control) const {
+  const std::string key = repo.ToString() + "/" + role.ToString() + "/latest";
+  serve(key, result, maxsize,
+        [&](std::string *data) { source.fetchLatestRole(data, maxsize, repo, role, flow_control); });
+}
+
+std::shared_ptr<OfflineMetadataSnapshot> OfflineUpdateMetadata::current() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (!current_) {
+    current_ = std::make_shared<OfflineMetadataSnapshot>();
+  }
+  return current_;
+}
+
+void OfflineUpdateMetadata::reset() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  current_.reset();
+}
+
+SnapshotFetcher::SnapshotFetcher(const Uptane::OfflineUpdateFetcher &source, const OfflineMetadataSnapshot &snapshot)
+    : Uptane::OfflineUpdateFetcher(boost::filesystem::path()), source_(source), snapshot_(snapshot) {}
+
+}  // namespace Primary
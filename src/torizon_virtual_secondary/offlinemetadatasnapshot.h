@@ -0,0 +1,78 @@
+#ifndef PRIMARY_OFFLINEMETADATASNAPSHOT_H_
+#define PRIMARY_OFFLINEMETADATASNAPSHOT_H_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "uptane/fetcher.h"
+
+namespace Primary {
+
+// In-memory copy of the metadata of one offline update. Each role is read from
+// the (possibly slow) update media only once and then served from memory, so
+// that every verification step of every Secondary sees identical bytes.
+class OfflineMetadataSnapshot {
+ public:
+  void fetchRole(const Uptane::OfflineUpdateFetcher& source, std::string* result, int64_t maxsize,
+                 Uptane::RepositoryType repo, const Uptane::Role& role, Uptane::Version version,
+                 const api::FlowControlToken* flow_control = nullptr) const;
+  void fetchLatestRole(const Uptane::OfflineUpdateFetcher& source, std::string* result, int64_t maxsize,
+                       Uptane::RepositoryType repo, const Uptane::Role& role,
+                       const api::FlowControlToken* flow_control = nullptr) const;
+
+  // Number of reads done from the update media.
+  size_t sourceReads() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return entries_.size();
+  }
+
+ private:
+  template <class Fetch>
+  void serve(const std::string& key, std::string* result, int64_t maxsize, Fetch fetch) const;
+
+  mutable std::mutex mutex_;
+  mutable std::map<std::string, std::string> entries_;
+};
+
+// Snapshot of the offline update in progress. The Primary owns one instance,
+// hands it to all the managed Secondaries and resets it at the end of each
+// update.
+class OfflineUpdateMetadata {
+ public:
+  // Snapshot of the current update, started by its first user.
+  std::shared_ptr<OfflineMetadataSnapshot> current();
+  // End the current update: the next one is read from its media again.
+  void reset();
+
+ private:
+  std::mutex mutex_;
+  std::shared_ptr<OfflineMetadataSnapshot> current_;
+};
+
+// Fetcher given to the repositories of a Secondary: it reads the metadata of
+// `source` through `snapshot`. It overrides every virtual function of
+// OfflineUpdateFetcher, so the source path of the base class is never used.
+class SnapshotFetcher final : public Uptane::OfflineUpdateFetcher {
+ public:
+  // `source` and `snapshot` must outlive the fetcher.
+  SnapshotFetcher(const Uptane::OfflineUpdateFetcher& source, const OfflineMetadataSnapshot& snapshot);
+
+  void fetchRole(std::string* result, int64_t maxsize, Uptane::RepositoryType repo, const Uptane::Role& role,
+                 Uptane::Version version, const api::FlowControlToken* flow_control = nullptr) const override {
+    snapshot_.fetchRole(source_, result, maxsize, repo, role, version, flow_control);
+  }
+  void fetchLatestRole(std::string* result, int64_t maxsize, Uptane::RepositoryType repo, const Uptane::Role& role,
+                       const api::FlowControlToken* flow_control = nullptr) const override {
+    snapshot_.fetchLatestRole(source_, result, maxsize, repo, role, flow_control);
+  }
+
+ private:
+  const Uptane::OfflineUpdateFetcher& source_;
+  const OfflineMetadataSnapshot& snapshot_;
+};
+
+}  // namespace Primary
+
+#endif  // PRIMARY_OFFLINEMETADATASNAPSHOT_H_
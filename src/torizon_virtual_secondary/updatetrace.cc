@@ -0,0 +1,204 @@
+#include "updatetrace.h"
+#include "logging/logging.h"
+#include "utilities/utils.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Key of the summary in the device data.
+static const char *const DEVICE_DATA_KEY = "container_update_trace";
+
+struct TraceEvent {
+  const char *name;
+  std::string detail;
+  int64_t ts_us;   // Start, relative to the start of the trace.
+  int64_t dur_us;
+  unsigned tid;
+};
+
+struct TraceState {
+  std::mutex mutex;
+  std::atomic<bool> active{false};
+  boost::filesystem::path path;
+  std::chrono::steady_clock::time_point origin;
+  std::vector<TraceEvent> events;
+  // Small thread numbers are easier to read in trace viewers.
+  std::map<std::thread::id, unsigned> tids;
+  uint16_t proxy_port{0};
+};
+
+static TraceState &traceState() {
+  static TraceState state;
+  return state;
+}
+
+static int64_t toMicroseconds(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+UpdateTrace::Scope::Scope(const char *name, const std::string &detail)
+  : name_(name), active_(traceState().active) {
+  if (active_) {
+    detail_ = detail;
+    begin_ = std::chrono::steady_clock::now();
+  }
+}
+
+UpdateTrace::Scope::~Scope() {
+  if (! active_) {
+    return;
+  }
+  const auto end = std::chrono::steady_clock::now();
+  TraceState &state = traceState();
+  std::lock_guard<std::mutex> guard(state.mutex);
+  // The trace may have been restarted or finished meanwhile.
+  if (! state.active || begin_ < state.origin) {
+    return;
+  }
+  const auto next_tid = static_cast<unsigned>(state.tids.size() + 1);
+  const auto tid = state.tids.emplace(std::this_thread::get_id(), next_tid).first->second;
+  state.events.push_back(
+      TraceEvent{name_, detail_, toMicroseconds(begin_ - state.origin), toMicroseconds(end - begin_), tid});
+}
+
+void UpdateTrace::start(const boost::filesystem::path &path) {
+  TraceState &state = traceState();
+  std::lock_guard<std::mutex> guard(state.mutex);
+  state.path = path;
+  state.origin = std::chrono::steady_clock::now();
+  state.events.clear();
+  state.tids.clear();
+  state.active = true;
+}
+
+bool UpdateTrace::active() {
+  return traceState().active;
+}
+
+static Json::Value summarize(const std::vector<TraceEvent> &events) {
+  // Number of events and total duration per step.
+  std::map<std::string, std::pair<unsigned, int64_t>> steps;
+  for (const auto &event : events) {
+    auto &step = steps[event.name];
+    step.first++;
+    step.second += event.dur_us;
+  }
+
+  Json::Value summary(Json::objectValue);
+  for (const auto &step : steps) {
+    summary[step.first]["count"] = step.second.first;
+    summary[step.first]["milliseconds"] = static_cast<Json::Int64>(step.second.second / 1000);
+  }
+  return summary;
+}
+
+Json::Value UpdateTrace::summary() {
+  TraceState &state = traceState();
+  std::lock_guard<std::mutex> guard(state.mutex);
+  return summarize(state.events);
+}
+
+void UpdateTrace::setDataProxyPort(uint16_t port) {
+  TraceState &state = traceState();
+  std::lock_guard<std::mutex> guard(state.mutex);
+  state.proxy_port = port;
+}
+
+/**
+ * Send data to the device data proxy (which expects one JSON object per
+ * connection, terminated by a newline).
+ */
+static bool sendToDataProxy(uint16_t port, const Json::Value &data) {
+  const std::string message = Utils::jsonToCanonicalStr(data) + "\n";
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+
+  const int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return false;
+  }
+  bool success = ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+  size_t sent = 0;
+  while (success && sent < message.size()) {
+    const ssize_t count = ::send(fd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    success = count > 0;
+    sent += success ? static_cast<size_t>(count) : 0;
+  }
+  if (! success) {
+    LOG_WARNING << "Could not send update trace to device data proxy: " << std::strerror(errno);
+  }
+  ::close(fd);
+  return success;
+}
+
+bool UpdateTrace::finish() {
+  TraceState &state = traceState();
+  std::vector<TraceEvent> events;
+  boost::filesystem::path path;
+  uint16_t proxy_port;
+  {
+    std::lock_guard<std::mutex> guard(state.mutex);
+    if (! state.active) {
+      return false;
+    }
+    state.active = false;
+    events.swap(state.events);
+    path = state.path;
+    proxy_port = state.proxy_port;
+  }
+
+  Json::Value trace_events(Json::arrayValue);
+  const auto pid = static_cast<Json::Int>(::getpid());
+  for (const auto &event : events) {
+    Json::Value item;
+    item["name"] = event.name;
+    item["cat"] = "update";
+    item["ph"] = "X";
+    item["ts"] = static_cast<Json::Int64>(event.ts_us);
+    item["dur"] = static_cast<Json::Int64>(event.dur_us);
+    item["pid"] = pid;
+    item["tid"] = event.tid;
+    if (! event.detail.empty()) {
+      item["args"]["detail"] = event.detail;
+    }
+    trace_events.append(item);
+  }
+
+  Json::Value root;
+  root["traceEvents"] = trace_events;
+  root["displayTimeUnit"] = "ms";
+  const Json::Value summary = summarize(events);
+
+  bool success = true;
+  try {
+    Utils::writeFile(path, Utils::jsonToCanonicalStr(root));
+    LOG_INFO << "Update timing trace written to " << path;
+  } catch (const std::exception &exc) {
+    LOG_WARNING << "Could not write update trace " << path << ": " << exc.what();
+    success = false;
+  }
+  LOG_DEBUG << "Update timing summary: " << Utils::jsonToCanonicalStr(summary);
+
+  if (proxy_port != 0) {
+    Json::Value data;
+    data[DEVICE_DATA_KEY] = summary;
+    sendToDataProxy(proxy_port, data);
+  }
+  return success;
+}
@@ -0,0 +1,97 @@
+#ifndef SECONDARY_UPDATETRACE_H_
+#define SECONDARY_UPDATETRACE_H_
+
+#include <boost/filesystem/path.hpp>
+#include <json/value.h>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/**
+ * Timing trace of a container update, written in the Chrome trace-event
+ * format (it can be opened with chrome://tracing or https://ui.perfetto.dev).
+ * How to use:
+ *
+ *     UpdateTrace::Recording recording(trace_file);  // For the whole update.
+ *     {
+ *       UpdateTrace::Scope scope("docker load", image);
+ *       ...(timed code)...
+ *     }
+ *     // The trace file is written when `recording` goes out of scope.
+ *
+ * Scopes can be used from any thread; they do nothing while no trace is
+ * being recorded.
+ */
+class UpdateTrace {
+  public:
+    /**
+     * Timer recording the lifetime of the object as a trace event.
+     */
+    class Scope {
+      public:
+        /**
+         * Constructor.
+         *
+         * @param name name of the traced step (a string literal); events with
+         *  the same name are added up in the summary.
+         * @param detail what the step is applied to (e.g. a file name).
+         */
+        explicit Scope(const char *name, const std::string &detail = "");
+        ~Scope();
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+      protected:
+        const char *name_;
+        std::string detail_;
+        std::chrono::steady_clock::time_point begin_;
+        bool active_;
+    };
+
+    /**
+     * Recorder of a trace during its lifetime: it calls start() when created
+     * and finish() when destroyed, also when an exception is thrown.
+     */
+    class Recording {
+      public:
+        explicit Recording(const boost::filesystem::path &path) { start(path); }
+        ~Recording() { finish(); }
+
+        Recording(const Recording &) = delete;
+        Recording &operator=(const Recording &) = delete;
+    };
+
+    /**
+     * Start recording a new trace (discarding any trace not finished).
+     *
+     * @param path file where the trace is written by finish().
+     */
+    static void start(const boost::filesystem::path &path);
+
+    /**
+     * Stop recording, write the trace file and (if enabled) send its summary
+     * as device data.
+     *
+     * @return false if no trace was being recorded or it could not be written.
+     */
+    static bool finish();
+
+    /**
+     * Whether a trace is being recorded.
+     */
+    static bool active();
+
+    /**
+     * Total time and number of events per step of the trace being recorded.
+     */
+    static Json::Value summary();
+
+    /**
+     * Send the summary of each trace to the device data proxy listening on
+     * the given local TCP port (0 disables it, the default).
+     */
+    static void setDataProxyPort(uint16_t port);
+};
+
+#endif /* SECONDARY_UPDATETRACE_H_ */
@@ -0,0 +1,110 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "logging/logging.h"
+#include "updatetrace.h"
+#include "utilities/utils.h"
+
+/*
+ * Nested scopes from several threads are written to the trace file, each
+ * thread with its own id, and added up in the summary.
+ */
+TEST(UpdateTrace, NestedScopesFromThreads) {
+  TemporaryDirectory temp_dir;
+  const boost::filesystem::path trace_file = temp_dir / "trace.json";
+
+  // Nothing is recorded outside of a trace.
+  { UpdateTrace::Scope ignored("ignored"); }
+  EXPECT_FALSE(UpdateTrace::active());
+
+  Json::Value summary;
+  {
+    UpdateTrace::Recording recording(trace_file);
+    EXPECT_TRUE(UpdateTrace::active());
+
+    auto work = [](const std::string &name) {
+      UpdateTrace::Scope outer("outer", name);
+      UpdateTrace::Scope inner("inner");
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    };
+    std::thread first(work, "first");
+    std::thread second(work, "second");
+    first.join();
+    second.join();
+    summary = UpdateTrace::summary();
+  }
+  EXPECT_FALSE(UpdateTrace::active());
+
+  EXPECT_EQ(summary["outer"]["count"].asUInt(), 2U);
+  EXPECT_EQ(summary["inner"]["count"].asUInt(), 2U);
+  EXPECT_GE(summary["inner"]["milliseconds"].asInt64(), 20);
+  EXPECT_GE(summary["outer"]["milliseconds"].asInt64(), summary["inner"]["milliseconds"].asInt64());
+  EXPECT_FALSE(summary.isMember("ignored"));
+
+  const Json::Value trace = Utils::parseJSONFile(trace_file);
+  EXPECT_EQ(trace["displayTimeUnit"].asString(), "ms");
+  const Json::Value &events = trace["traceEvents"];
+  ASSERT_EQ(events.size(), 4U);
+
+  // Outer events per thread; each inner event lies within the outer one of
+  // its thread.
+  std::map<unsigned, Json::Value> outer;
+  std::set<std::string> details;
+  for (const auto &event : events) {
+    EXPECT_EQ(event["ph"].asString(), "X");
+    if (event["name"].asString() == "outer") {
+      outer[event["tid"].asUInt()] = event;
+      details.insert(event["args"]["detail"].asString());
+    }
+  }
+  ASSERT_EQ(outer.size(), 2U);
+  EXPECT_EQ(details, (std::set<std::string>{"first", "second"}));
+  for (const auto &event : events) {
+    if (event["name"].asString() != "inner") {
+      continue;
+    }
+    ASSERT_EQ(outer.count(event["tid"].asUInt()), 1U);
+    const Json::Value &parent = outer[event["tid"].asUInt()];
+    EXPECT_GE(event["ts"].asInt64(), parent["ts"].asInt64());
+    EXPECT_LE(event["ts"].asInt64() + event["dur"].asInt64(), parent["ts"].asInt64() + parent["dur"].asInt64());
+  }
+}
+
+/*
+ * The trace is finished and written when the update fails with an exception.
+ */
+TEST(UpdateTrace, FinishedOnException) {
+  TemporaryDirectory temp_dir;
+  const boost::filesystem::path trace_file = temp_dir / "trace.json";
+
+  EXPECT_THROW(
+      {
+        UpdateTrace::Recording recording(trace_file);
+        UpdateTrace::Scope scope("failing step");
+        throw std::runtime_error("update failed");
+      },
+      std::runtime_error);
+  EXPECT_FALSE(UpdateTrace::active());
+  EXPECT_FALSE(UpdateTrace::finish());
+
+  const Json::Value trace = Utils::parseJSONFile(trace_file);
+  ASSERT_EQ(trace["traceEvents"].size(), 1U);
+  EXPECT_EQ(trace["traceEvents"][0]["name"].asString(), "failing step");
+}
+
+#ifndef __NO_MAIN__
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+
+  logger_init();
+  logger_set_threshold(boost::log::trivial::trace);
+
+  return RUN_ALL_TESTS();
+}
+#endif
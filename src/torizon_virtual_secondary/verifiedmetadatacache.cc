@@ -0,0 +1,83 @@
+#include "verifiedmetadatacache.h"
+
+#include <algorithm>
+
+#include "libaktualizr/types.h"
+#include "logging/logging.h"
+#include "utilities/utils.h"
+
+namespace Primary {
+
+constexpr std::chrono::seconds VerifiedMetadataCache::default_max_age;
+constexpr size_t VerifiedMetadataCache::max_entries;
+
+VerifiedMetadataCache& VerifiedMetadataCache::instance() {
+  static VerifiedMetadataCache cache;
+  return cache;
+}
+
+bool VerifiedMetadataCache::expired(const std::vector<std::string>& state, const TimeStamp& now) {
+  for (const auto& data : state) {
+    if (data.empty()) {
+      continue;
+    }
+    try {
+      const Json::Value expires = Utils::parseJSON(data)["signed"]["expires"];
+      if (!expires.isString() || TimeStamp(expires.asString()).IsExpiredAt(now)) {
+        return true;
+      }
+    } catch (const std::exception& e) {
+      LOG_DEBUG << "Unable to check metadata expiration: " << e.what();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool VerifiedMetadataCache::find(const std::string& key, Entry* entry) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return false;
+  }
+
+  // Verification results are only shared within one round of updates, and
+  // the expiration checks done by the verification are repeated on each hit.
+  if (std::chrono::steady_clock::now() - it->second.verified_at >= max_age_ ||
+      expired(it->second.state, TimeStamp::Now())) {
+    entries_.erase(it);
+    order_.erase(std::find(order_.begin(), order_.end(), key));
+    return false;
+  }
+
+  *entry = it->second;
+  hits_++;
+  return true;
+}
+
+void VerifiedMetadataCache::insert(const std::string& key, Entry entry) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  // Only the metadata of the current round is worth keeping.
+  if (entries_.size() >= max_entries) {
+    entries_.erase(order_.front());
+    order_.pop_front();
+  }
+  entry.verified_at = std::chrono::steady_clock::now();
+  if (entries_.emplace(key, std::move(entry)).second) {
+    order_.push_back(key);
+  }
+}
+
+void VerifiedMetadataCache::clear() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  entries_.clear();
+  order_.clear();
+  hits_ = 0;
+}
+
+uint64_t VerifiedMetadataCache::hits() const {
+  std::lock_guard<std::mutex> guard(mutex_);
+  return hits_;
+}
+
+}  // namespace Primary
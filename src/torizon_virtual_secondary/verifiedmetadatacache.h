@@ -0,0 +1,69 @@
+#ifndef PRIMARY_VERIFIEDMETADATACACHE_H_
+#define PRIMARY_VERIFIEDMETADATACACHE_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Uptane {
+class DirectorRepository;
+class ImageRepository;
+}  // namespace Uptane
+
+class TimeStamp;
+
+namespace Primary {
+
+// Metadata verification results shared by the managed Secondaries of the
+// process.
+//
+// Secondaries on the same device usually trust the same repositories and get
+// the same metadata from the Primary, so verifying it once per round of
+// putMetadata() calls is enough: the outcome only depends on the metadata and
+// on the trusted state stored by the Secondary beforehand, which the keys of
+// the entries are made of. Entries are only reused for max_age after they
+// were verified, and never once any of their metadata has expired.
+class VerifiedMetadataCache {
+ public:
+  struct Entry {
+    std::shared_ptr<const Uptane::DirectorRepository> director_repo;
+    std::shared_ptr<const Uptane::ImageRepository> image_repo;
+    // Stored metadata after verification, in storeVerifiedState() order.
+    std::vector<std::string> state;
+    std::chrono::steady_clock::time_point verified_at;
+  };
+
+  static constexpr std::chrono::seconds default_max_age{60};
+
+  static VerifiedMetadataCache& instance();
+
+  explicit VerifiedMetadataCache(std::chrono::milliseconds max_age = default_max_age) : max_age_(max_age) {}
+
+  bool find(const std::string& key, Entry* entry);
+  void insert(const std::string& key, Entry entry);
+  // Drop all entries and reset the statistics.
+  void clear();
+  // Number of lookups that returned a reusable result.
+  uint64_t hits() const;
+
+  // Whether any of the metadata (raw JSON) expired at `now`.
+  static bool expired(const std::vector<std::string>& state, const TimeStamp& now);
+
+ private:
+  static constexpr size_t max_entries = 4;
+
+  const std::chrono::milliseconds max_age_;
+  mutable std::mutex mutex_;
+  std::map<std::string, Entry> entries_;
+  std::deque<std::string> order_;
+  uint64_t hits_{0};
+};
+
+}  // namespace Primary
+
+#endif  // PRIMARY_VERIFIEDMETADATACACHE_H_
@@ -1,9 +1,14 @@
 #include <gtest/gtest.h>
 
+#include <ctime>
+#include <thread>
+
 #include "httpfake.h"
 #include "libaktualizr/secondaryinterface.h"
+#include "offlinemetadatasnapshot.h"
 #include "uptane_test_common.h"
 #include "utilities/utils.h"
+#include "verifiedmetadatacache.h"
 #include "virtualsecondary.h"
 
 class VirtualSecondaryTest : public ::testing::Test {
@@ -20,7 +25,7 @@ class VirtualSecondaryTest : public ::testing::Test {
     config_.metadata_path = temp_dir_.Path() / "metadata";
   }
 
-  virtual void SetUp() {}
+  virtual void SetUp() { Primary::VerifiedMetadataCache::instance().clear(); }
   virtual void TearDown() {}
 
  protected:
@@ -31,6 +36,244 @@ class VirtualSecondaryTest : public ::testing::Test {
 /* Create a virtual secondary for testing. */
 TEST_F(VirtualSecondaryTest, Instantiation) { EXPECT_NO_THROW(Primary::VirtualSecondary virtual_sec(config_)); }
 
+/*
+ * A new Secondary gets an Ed25519 key pair and its manifest signature
+ * verifies with its public key, also once the keys were reloaded.
+ */
+TEST_F(VirtualSecondaryTest, Ed25519Manifest) {
+  Json::Value manifest;
+  PublicKey public_key;
+  {
+    Primary::VirtualSecondary virtual_sec(config_);
+    public_key = virtual_sec.getPublicKey();
+    EXPECT_EQ(public_key.Type(), KeyType::kED25519);
+    EXPECT_EQ(virtual_sec.getSerial().ToString(), public_key.KeyId());
+
+    manifest = virtual_sec.getManifest();
+    ASSERT_EQ(manifest["signatures"].size(), 1U);
+    const Json::Value &signature = manifest["signatures"][0];
+    EXPECT_EQ(signature["method"].asString(), "ed25519");
+    EXPECT_EQ(signature["keyid"].asString(), public_key.KeyId());
+    EXPECT_TRUE(public_key.VerifySignature(signature["sig"].asString(), Utils::jsonToCanonicalStr(manifest["signed"])));
+    EXPECT_FALSE(public_key.VerifySignature(signature["sig"].asString(), Utils::jsonToCanonicalStr(manifest)));
+  }
+
+  Primary::VirtualSecondary reloaded(config_);
+  EXPECT_EQ(reloaded.getPublicKey(), public_key);
+  const Json::Value signature = reloaded.getManifest()["signatures"][0];
+  EXPECT_EQ(signature["method"].asString(), "ed25519");
+  EXPECT_TRUE(public_key.VerifySignature(signature["sig"].asString(),
+                                         Utils::jsonToCanonicalStr(reloaded.getManifest()["signed"])));
+}
+
+/*
+ * The signed manifest is reused until the firmware changes.
+ */
+TEST_F(VirtualSecondaryTest, ManifestCache) {
+  Primary::VirtualSecondary virtual_sec(config_);
+
+  Json::Value manifest = virtual_sec.getManifest();
+  EXPECT_EQ(manifest["signatures"][0]["method"].asString(), "ed25519");
+  EXPECT_EQ(virtual_sec.getManifest(), manifest);
+  EXPECT_EQ(virtual_sec.manifestSigns(), 1U);
+  EXPECT_EQ(virtual_sec.manifestCacheHits(), 1U);
+
+  Utils::writeFile(config_.firmware_path, std::string("new firmware"));
+  Utils::writeFile(config_.target_name_path, std::string("firmware.txt"));
+  Json::Value updated = virtual_sec.getManifest();
+  EXPECT_NE(updated, manifest);
+  EXPECT_EQ(updated["signed"]["installed_image"]["filepath"].asString(), "firmware.txt");
+  EXPECT_EQ(virtual_sec.manifestSigns(), 2U);
+  EXPECT_EQ(virtual_sec.manifestCacheHits(), 1U);
+}
+
+/* Offline update fetcher returning fixed metadata and counting its reads. */
+class CountingOfflineFetcher : public Uptane::OfflineUpdateFetcher {
+ public:
+  CountingOfflineFetcher() : Uptane::OfflineUpdateFetcher(boost::filesystem::path()) {}
+
+  void fetchRole(std::string *result, int64_t maxsize, Uptane::RepositoryType repo, const Uptane::Role &role,
+                 Uptane::Version version, const api::FlowControlToken *flow_control = nullptr) const override {
+    (void)maxsize;
+    (void)flow_control;
+    reads++;
+    *result = repo.ToString() + role.ToString() + std::to_string(version.version());
+  }
+  void fetchLatestRole(std::string *result, int64_t maxsize, Uptane::RepositoryType repo, const Uptane::Role &role,
+                       const api::FlowControlToken *flow_control = nullptr) const override {
+    (void)maxsize;
+    (void)flow_control;
+    reads++;
+    *result = repo.ToString() + role.ToString();
+  }
+
+  mutable int reads{0};
+};
+
+/*
+ * The metadata of an offline update is read from the update media once per
+ * role, whatever the number of Secondaries verifying it, and read again for
+ * the next update.
+ */
+TEST(VirtualSecondary, OfflineMetadataSnapshot) {
+  CountingOfflineFetcher media;
+  Primary::OfflineUpdateMetadata offline_metadata;
+  const std::vector<Uptane::Role> roles = {Uptane::Role::Root(), Uptane::Role::Snapshot(), Uptane::Role::Targets()};
+
+  // Three Secondaries processing the same update concurrently, each one
+  // reading every role twice, as their repositories do.
+  auto verify = [&]() {
+    std::shared_ptr<Primary::OfflineMetadataSnapshot> snapshot = offline_metadata.current();
+    Primary::SnapshotFetcher fetcher(media, *snapshot);
+    for (int pass = 0; pass < 2; ++pass) {
+      for (const auto &role : roles) {
+        std::string data;
+        fetcher.fetchLatestRole(&data, 1024, Uptane::RepositoryType::Director(), role);
+        EXPECT_EQ(data, "director" + role.ToString());
+        fetcher.fetchRole(&data, 1024, Uptane::RepositoryType::Image(), role, Uptane::Version(1));
+        EXPECT_EQ(data, "image" + role.ToString() + "1");
+      }
+    }
+  };
+  std::vector<std::thread> secondaries;
+  for (int sec = 0; sec < 3; ++sec) {
+    secondaries.emplace_back(verify);
+  }
+  for (auto &sec : secondaries) {
+    sec.join();
+  }
+  EXPECT_EQ(offline_metadata.current()->sourceReads(), 2 * roles.size());
+  EXPECT_EQ(media.reads, 2 * static_cast<int>(roles.size()));
+
+  // The next update does not reuse the metadata of the previous one.
+  offline_metadata.reset();
+  verify();
+  EXPECT_EQ(media.reads, 4 * static_cast<int>(roles.size()));
+
+  std::string data;
+  Primary::SnapshotFetcher fetcher(media, *offline_metadata.current());
+  EXPECT_THROW(fetcher.fetchLatestRole(&data, 4, Uptane::RepositoryType::Director(), Uptane::Role::Root()),
+               std::runtime_error);
+}
+
+/* Uptane timestamp `seconds` from now. */
+static std::string timestampIn(int seconds) {
+  const std::time_t expires = std::time(nullptr) + seconds;
+  char buf[32];
+  std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&expires));
+  return buf;
+}
+
+/* Metadata (as far as the expiration check goes) expiring in `seconds`. */
+static std::string metadataExpiringIn(int seconds) {
+  return std::string(R"({"signed": {"expires": ")") + timestampIn(seconds) + R"("}})";
+}
+
+/*
+ * A metadata verification result is not reused once any of the metadata it
+ * covers has expired, even after earlier successful lookups, nor after the
+ * round of updates it was made in.
+ */
+TEST(VirtualSecondary, VerifiedMetadataCache) {
+  Primary::VerifiedMetadataCache cache;
+  Primary::VerifiedMetadataCache::Entry entry;
+  entry.state = {metadataExpiringIn(3600), "", metadataExpiringIn(2)};
+  cache.insert("metadata", entry);
+  EXPECT_TRUE(cache.find("metadata", &entry));
+  EXPECT_TRUE(cache.find("metadata", &entry));
+
+  std::this_thread::sleep_for(std::chrono::seconds(3));
+  EXPECT_TRUE(Primary::VerifiedMetadataCache::expired(entry.state, TimeStamp::Now()));
+  EXPECT_FALSE(cache.find("metadata", &entry));
+
+  Primary::VerifiedMetadataCache round(std::chrono::milliseconds(100));
+  entry.state = {metadataExpiringIn(3600)};
+  round.insert("metadata", entry);
+  EXPECT_TRUE(round.find("metadata", &entry));
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  EXPECT_FALSE(round.find("metadata", &entry));
+}
+
+/*
+ * Managed Secondaries getting the same metadata verify it once: the second
+ * one reuses the result. Metadata that changed, or that expired since it was
+ * verified, is still rejected.
+ */
+TEST(VirtualSecondary, SharedMetadataVerification) {
+  Primary::VerifiedMetadataCache &cache = Primary::VerifiedMetadataCache::instance();
+  cache.clear();
+
+  TemporaryDirectory temp_dir;
+  TemporaryDirectory meta_dir;
+  auto http = std::make_shared<HttpFake>(temp_dir.Path(), "", meta_dir.Path() / "repo");
+  Config conf = UptaneTestCommon::makeTestConfig(temp_dir, http->tls_server);
+  auto storage = INvStorage::newStorage(conf.storage);
+  UptaneTestCommon::TestAktualizr aktualizr(conf, storage, http);
+
+  std::vector<std::shared_ptr<Primary::VirtualSecondary>> secondaries;
+  for (const char *serial : {"sec_a", "sec_b", "sec_c", "sec_d"}) {
+    const boost::filesystem::path dir = temp_dir.Path() / serial;
+    Primary::VirtualSecondaryConfig sconfig;
+    sconfig.partial_verifying = false;
+    sconfig.full_client_dir = dir;
+    sconfig.ecu_serial = serial;
+    sconfig.ecu_hardware_id = "secondary_hw";
+    sconfig.ecu_private_key = "sec.priv";
+    sconfig.ecu_public_key = "sec.pub";
+    sconfig.firmware_path = dir / "firmware.txt";
+    sconfig.target_name_path = dir / "firmware_name.txt";
+    sconfig.metadata_path = dir / "metadata";
+    secondaries.push_back(std::make_shared<Primary::VirtualSecondary>(sconfig));
+    aktualizr.AddSecondary(secondaries.back());
+  }
+  aktualizr.Initialize();
+
+  // The metadata expires soon after the update.
+  const int expires_s = 10;
+  UptaneRepo uptane_repo{meta_dir.PathString(), timestampIn(expires_s), ""};
+  const auto start = std::chrono::steady_clock::now();
+  uptane_repo.generateRepo(KeyType::kED25519);
+  uptane_repo.addImage("tests/test_data/firmware.txt", "firmware.txt", "secondary_hw");
+  uptane_repo.addTarget("firmware.txt", "secondary_hw", "sec_a");
+  uptane_repo.addTarget("firmware.txt", "secondary_hw", "sec_b");
+  uptane_repo.signTargets();
+
+  // sec_a verifies the metadata and sec_b reuses the result.
+  result::UpdateCheck update_result = aktualizr.CheckUpdates().get();
+  ASSERT_EQ(update_result.status, result::UpdateStatus::kUpdatesAvailable);
+  result::Download download_result = aktualizr.Download(update_result.updates).get();
+  ASSERT_EQ(download_result.status, result::DownloadStatus::kSuccess);
+  result::Install install_result = aktualizr.Install(download_result.updates).get();
+  EXPECT_TRUE(install_result.dev_report.success);
+  EXPECT_EQ(cache.hits(), 1U);
+  EXPECT_EQ(secondaries[1]->getRootVersion(true), secondaries[0]->getRootVersion(true));
+  EXPECT_EQ(secondaries[1]->getRootVersion(false), secondaries[0]->getRootVersion(false));
+
+  // So does a Secondary that was not part of the update.
+  const Uptane::Target target = update_result.updates[0];
+  EXPECT_TRUE(secondaries[2]->putMetadata(target).isSuccess());
+  EXPECT_EQ(cache.hits(), 2U);
+
+  // Metadata that does not match its signatures anymore.
+  std::string targets;
+  ASSERT_TRUE(storage->loadNonRoot(&targets, Uptane::RepositoryType::Director(), Uptane::Role::Targets()));
+  Json::Value tampered = Utils::parseJSON(targets);
+  tampered["signed"]["expires"] = "2099-01-01T00:00:00Z";
+  storage->storeNonRoot(Utils::jsonToCanonicalStr(tampered), Uptane::RepositoryType::Director(),
+                        Uptane::Role::Targets());
+  EXPECT_EQ(secondaries[2]->putMetadata(target).result_code.num_code,
+            data::ResultCode::Numeric::kVerificationFailed);
+  storage->storeNonRoot(targets, Uptane::RepositoryType::Director(), Uptane::Role::Targets());
+  EXPECT_EQ(cache.hits(), 2U);
+
+  // sec_d is in the same state sec_a was in when it verified the metadata,
+  // which has expired since.
+  std::this_thread::sleep_until(start + std::chrono::seconds(expires_s + 2));
+  EXPECT_EQ(secondaries[3]->putMetadata(target).result_code.num_code,
+            data::ResultCode::Numeric::kVerificationFailed);
+  EXPECT_EQ(cache.hits(), 2U);
+}
+
 /*
  * Rotate both Director and Image repo Root keys twice and make sure the Primary
  * correctly sends the intermediate Roots to the Secondary.
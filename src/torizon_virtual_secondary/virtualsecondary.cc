@@ -22,6 +22,9 @@ VirtualSecondaryConfig::VirtualSecondaryConfig(const Json::Value& json_config) :
   firmware_path = json_config["firmware_path"].asString();
   target_name_path = json_config["target_name_path"].asString();
   metadata_path = json_config["metadata_path"].asString();
+  if (json_config.isMember(KeyTypeField)) {
+    key_type = keyTypeFromString(json_config[KeyTypeField].asString());
+  }
 }
 
 std::vector<VirtualSecondaryConfig> VirtualSecondaryConfig::create_from_file(
@@ -52,6 +55,7 @@ void VirtualSecondaryConfig::dump(const boost::filesystem::path& file_full_path)
   json_config["firmware_path"] = firmware_path.string();
   json_config["target_name_path"] = target_name_path.string();
   json_config["metadata_path"] = metadata_path.string();
+  json_config[KeyTypeField] = keyTypeToString(key_type);
 
   Json::Value root;
   // Append to the config file if it already exists.